@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blobindex.h"
+#include "manifest.h"
+
+static void index_alloc(struct BLOB_INDEX *index, size_t capacity) {
+    index->capacity = capacity;
+    index->count = 0;
+    index->records = malloc(capacity * sizeof(struct BLOB_INDEX_RECORD));
+    index->used = calloc(capacity, 1);
+    assert(index->records != NULL && index->used != NULL);
+}
+
+void blob_index_init(struct BLOB_INDEX *index, const char *blob_dir) {
+    strcpy(index->blob_dir, blob_dir);
+    index_alloc(index, 4096);
+    memset(index->dirs, 0, sizeof(index->dirs));
+    index->dirty = 0;
+    pthread_mutex_init(&index->lock, NULL);
+}
+
+void blob_index_free(struct BLOB_INDEX *index) {
+    free(index->records);
+    free(index->used);
+    index->records = NULL;
+    index->used = NULL;
+    index->capacity = 0;
+    index->count = 0;
+    pthread_mutex_destroy(&index->lock);
+}
+
+static int dir_number(const unsigned char *digest) {
+    return (digest[0] << 4) | (digest[1] >> 4);
+}
+
+// returns the slot holding the blob, or the empty slot where it belongs.
+// digests are already uniformly distributed, so their leading bytes are
+// used as the hash.
+static size_t index_slot(const struct BLOB_INDEX *index, const unsigned char *digest, int codec) {
+    size_t i;
+    memcpy(&i, digest, sizeof(i));
+    i = (i ^ codec) & (index->capacity - 1);
+    while (index->used[i] && (index->records[i].codec != codec || memcmp(index->records[i].digest, digest, SHA256_DIGEST_LENGTH) != 0))
+        i = (i + 1) & (index->capacity - 1);
+    return i;
+}
+
+static void index_add(struct BLOB_INDEX *index, const unsigned char *digest, int codec, uint64_t size) {
+    // keep the load factor under one half
+    if ((index->count + 1) * 2 > index->capacity) {
+        struct BLOB_INDEX_RECORD *records = index->records;
+        unsigned char *used = index->used;
+        size_t capacity = index->capacity;
+        size_t i;
+        index_alloc(index, capacity * 2);
+        for (i = 0; i < capacity; i++) {
+            if (used[i])
+                index_add(index, records[i].digest, records[i].codec, records[i].size);
+        }
+        free(records);
+        free(used);
+    }
+
+    size_t i = index_slot(index, digest, codec);
+    if (!index->used[i]) {
+        index->used[i] = 1;
+        index->count++;
+    }
+    memset(&index->records[i], 0, sizeof(struct BLOB_INDEX_RECORD));
+    memcpy(index->records[i].digest, digest, SHA256_DIGEST_LENGTH);
+    index->records[i].codec = codec;
+    index->records[i].size = size;
+}
+
+static const struct BLOB_INDEX_RECORD* index_find(const struct BLOB_INDEX *index, const unsigned char *digest, int codec) {
+    size_t i = index_slot(index, digest, codec);
+    return index->used[i] ? &index->records[i] : NULL;
+}
+
+// read the index saved by a previous run. it is only a cache of blob
+// sizes: whatever it says, only blobs actually in the store are indexed.
+static void load_saved(struct BLOB_INDEX *saved, const char *blob_dir) {
+    char path[PATH_MAX];
+    char magic[16];
+    struct BLOB_INDEX_RECORD records[256];
+    size_t n, i;
+    sprintf(path, "%s/%s", blob_dir, BLOB_INDEX_NAME);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return;
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, BLOB_INDEX_MAGIC, sizeof(BLOB_INDEX_MAGIC)) != 0) {
+        fclose(f);
+        return;
+    }
+    while ((n = fread(records, sizeof(struct BLOB_INDEX_RECORD), sizeof(records) / sizeof(records[0]), f)) > 0) {
+        for (i = 0; i < n; i++)
+            index_add(saved, records[i].digest, records[i].codec, records[i].size);
+    }
+    fclose(f);
+}
+
+static int is_dir(const char *path, const struct dirent *ep) {
+    struct stat st;
+    if (ep->d_type != DT_UNKNOWN)
+        return ep->d_type == DT_DIR;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+int blob_index_load(struct BLOB_INDEX *index) {
+    struct BLOB_INDEX saved;
+    blob_index_init(&saved, index->blob_dir);
+    load_saved(&saved, index->blob_dir);
+
+    DIR *dp = opendir(index->blob_dir);
+    if (dp == NULL) {
+        blob_index_free(&saved);
+        return 1;
+    }
+    struct dirent *ep;
+    while ((ep = readdir(dp))) {
+        char dir[PATH_MAX];
+        unsigned char prefix[SHA256_DIGEST_LENGTH];
+        if (strlen(ep->d_name) != 3)
+            continue;
+        // parse the directory name as the start of a digest
+        char name[SHA256_DIGEST_LENGTH * 2 + 1];
+        memset(name, '0', sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+        memcpy(name, ep->d_name, 3);
+        sprintf(dir, "%s/%s", index->blob_dir, ep->d_name);
+        if (parse_blob_name(name, prefix, NULL) || !is_dir(dir, ep))
+            continue;
+        index->dirs[dir_number(prefix)] = 1;
+
+        DIR *sub = opendir(dir);
+        if (sub == NULL)
+            continue;
+        struct dirent *bp;
+        while ((bp = readdir(sub))) {
+            char rel[PATH_MAX];
+            unsigned char digest[SHA256_DIGEST_LENGTH];
+            int codec;
+            sprintf(rel, "%s/%s", ep->d_name, bp->d_name);
+            if (parse_blob_name(rel, digest, &codec))
+                continue;
+            const struct BLOB_INDEX_RECORD *known = index_find(&saved, digest, codec);
+            if (known != NULL) {
+                index_add(index, digest, codec, known->size);
+                continue;
+            }
+            // new since the index was saved (or there is no index)
+            char blob[PATH_MAX];
+            struct stat st;
+            sprintf(blob, "%s/%s", index->blob_dir, rel);
+            if (stat(blob, &st) == 0 && S_ISREG(st.st_mode)) {
+                index_add(index, digest, codec, st.st_size);
+                index->dirty = 1;
+            }
+        }
+        closedir(sub);
+    }
+    closedir(dp);
+
+    // blobs removed since (by gc)
+    if (index->count != saved.count)
+        index->dirty = 1;
+    blob_index_free(&saved);
+    return 0;
+}
+
+int blob_index_lookup(struct BLOB_INDEX *index, const unsigned char *digest, int codec, off_t *size) {
+    pthread_mutex_lock(&index->lock);
+    const struct BLOB_INDEX_RECORD *r = index_find(index, digest, codec);
+    if (r != NULL)
+        *size = r->size;
+    pthread_mutex_unlock(&index->lock);
+    return r != NULL;
+}
+
+void blob_index_add(struct BLOB_INDEX *index, const unsigned char *digest, int codec, off_t size) {
+    pthread_mutex_lock(&index->lock);
+    index_add(index, digest, codec, size);
+    index->dirty = 1;
+    pthread_mutex_unlock(&index->lock);
+}
+
+int blob_index_make_dir(struct BLOB_INDEX *index, const unsigned char *digest, const char *dir) {
+    int n = dir_number(digest);
+    int ret = 0;
+    // under the lock, so no other worker renames into it before it exists
+    pthread_mutex_lock(&index->lock);
+    if (!index->dirs[n]) {
+        if (mkdir(dir, S_IRWXU | S_IRWXG | S_IRWXO) == 0 || errno == EEXIST)
+            index->dirs[n] = 1;
+        else
+            ret = errno;
+    }
+    pthread_mutex_unlock(&index->lock);
+    return ret;
+}
+
+int blob_index_save(struct BLOB_INDEX *index) {
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    char magic[16];
+    size_t i;
+    if (!index->dirty)
+        return 0;
+
+    // several stores may share the blob dir, each saves its own copy
+    sprintf(path, "%s/%s", index->blob_dir, BLOB_INDEX_NAME);
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return 1;
+    FILE *f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        unlink(tmp);
+        return 1;
+    }
+    memset(magic, 0, sizeof(magic));
+    memcpy(magic, BLOB_INDEX_MAGIC, sizeof(BLOB_INDEX_MAGIC));
+    int failed = fwrite(magic, sizeof(magic), 1, f) != 1;
+    for (i = 0; i < index->capacity && !failed; i++) {
+        if (index->used[i])
+            failed = fwrite(&index->records[i], sizeof(struct BLOB_INDEX_RECORD), 1, f) != 1;
+    }
+    if (fclose(f) || failed || rename(tmp, path)) {
+        unlink(tmp);
+        return 1;
+    }
+    index->dirty = 0;
+    return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef DEDUPE_BLOBINDEX_H
+#define DEDUPE_BLOBINDEX_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <openssl/sha.h>
+
+// name of the persisted index, at the top of the blob dir
+#define BLOB_INDEX_NAME "index"
+#define BLOB_INDEX_MAGIC "dedupe-index\t1\n"
+
+// the blob dir fans out on the first three hex digits of the digest
+#define BLOB_INDEX_DIR_COUNT 4096
+
+struct BLOB_INDEX_RECORD {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    uint64_t size;
+    uint8_t codec;
+    uint8_t reserved[7];
+};
+
+// an in memory digest -> size index of the blob store, so storing a file
+// does not cost a stat (and a mkdir) on the sd card per file. it is
+// built from one walk of the blob dir, taking sizes from the persisted
+// index where it has them, and saved back at the end of the run.
+// safe to use from several threads.
+struct BLOB_INDEX {
+    char blob_dir[PATH_MAX];
+    struct BLOB_INDEX_RECORD *records;
+    unsigned char *used;
+    size_t capacity;
+    size_t count;
+    unsigned char dirs[BLOB_INDEX_DIR_COUNT];
+    int dirty;
+    pthread_mutex_t lock;
+};
+
+void blob_index_init(struct BLOB_INDEX *index, const char *blob_dir);
+// walk the blob dir. returns nonzero if it could not be read.
+int blob_index_load(struct BLOB_INDEX *index);
+// returns 1 and fills in the size if the blob is in the store.
+int blob_index_lookup(struct BLOB_INDEX *index, const unsigned char *digest, int codec, off_t *size);
+void blob_index_add(struct BLOB_INDEX *index, const unsigned char *digest, int codec, off_t size);
+// creates dir, the fan-out directory of a blob, unless the index knows
+// it exists. returns 0 once it does, or the errno of mkdir.
+int blob_index_make_dir(struct BLOB_INDEX *index, const unsigned char *digest, const char *dir);
+// write the index back to the blob dir if it changed.
+int blob_index_save(struct BLOB_INDEX *index);
+void blob_index_free(struct BLOB_INDEX *index);
+
+#endif
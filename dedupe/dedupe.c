@@ -13,6 +13,7 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <signal.h>
@@ -20,13 +21,128 @@
 #include <unistd.h>
 #include <paths.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+#include "blobindex.h"
+#include "dedupe.h"
+#include "manifest.h"
+#include "workqueue.h"
+
+#define DIGEST_SET_CAPACITY 4096
+// number of manifest entries that may be in flight per worker thread
+// before directory traversal blocks waiting for the workers to catch up.
+#define PENDING_PER_THREAD 64
+#define STORE_BUFFER_SIZE (64 * 1024)
+// largest single in-kernel copy request
+#define COPY_CHUNK_SIZE (1024 * 1024 * 1024)
+// files smaller than this are never compressed
+#define COMPRESS_MIN_SIZE 512
+// with -c, files of at least this size are split into content defined
+// chunks, so a small change to a large image only stores the chunks
+// around it.
+#define CHUNK_FILE_MIN_SIZE (4 * 1024 * 1024)
+#define CHUNK_MIN_SIZE (64 * 1024)
+#define CHUNK_AVG_SIZE (256 * 1024)
+#define CHUNK_MAX_SIZE (1024 * 1024)
+// the high bits of the gear hash cover the longest window. two more
+// bits than log2(CHUNK_AVG_SIZE - CHUNK_MIN_SIZE) before the average,
+// two fewer after it.
+#define CHUNK_MASK_SMALL (((1ULL << 20) - 1) << 44)
+#define CHUNK_MASK_LARGE (((1ULL << 16) - 1) << 48)
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// set once a kernel turns out not to support a copy method, so it is
+// not retried for every file. races between workers are harmless.
+static int reflink_unsupported = 0;
+static int copy_range_unsupported = 0;
+static int sendfile_unsupported = 0;
+
+static ssize_t do_copy_file_range(int srcfd, int dstfd, size_t len) {
+#ifdef __NR_copy_file_range
+    return syscall(__NR_copy_file_range, srcfd, NULL, dstfd, NULL, len, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// copy with the file data staying in the kernel. returns 0 on success,
+// and -1 with nothing written if neither copy_file_range nor sendfile
+// work for this pair of files.
+static int copy_in_kernel(int srcfd, int dstfd, off_t size) {
+    off_t copied = 0;
+    ssize_t ret;
+
+    if (!copy_range_unsupported) {
+        while (copied < size) {
+            ret = do_copy_file_range(srcfd, dstfd, size - copied > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : size - copied);
+            if (ret <= 0)
+                break;
+            copied += ret;
+        }
+        if (copied == size)
+            return 0;
+        if (copied != 0)
+            return 1;
+        if (errno == ENOSYS)
+            copy_range_unsupported = 1;
+    }
+
+    if (!sendfile_unsupported) {
+        while (copied < size) {
+            ret = sendfile(dstfd, srcfd, NULL, size - copied > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : size - copied);
+            if (ret <= 0)
+                break;
+            copied += ret;
+        }
+        if (copied == size)
+            return 0;
+        if (copied != 0)
+            return 1;
+        if (errno == ENOSYS)
+            sendfile_unsupported = 1;
+    }
+    return -1;
+}
+
+static int write_fully(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t bytes_written = write(fd, data, len);
+        if (bytes_written < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        data += bytes_written;
+        len -= bytes_written;
+    }
+    return 0;
+}
 
-#define DEDUPE_VERSION 2
-#define ARRAY_CAPACITY 1000
+static int copy_buffered(int srcfd, int dstfd) {
+    unsigned char buf[STORE_BUFFER_SIZE];
+    ssize_t bytes_read;
+    while ((bytes_read = read(srcfd, buf, sizeof(buf))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        if (write_fully(dstfd, buf, bytes_read))
+            return 1;
+    }
+    return 0;
+}
 
-static int copy_file(const char *src, const char *dst) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
+static int copy_file(const char *src, const char *dst, int method) {
+    int dstfd, srcfd;
     if (src == NULL)
         return 1;
     if (dst == NULL)
@@ -42,135 +158,572 @@ static int copy_file(const char *src, const char *dst) {
         return 4;
     }
 
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
-            return 5;
+    int ret = -1;
+    if (method == DEDUPE_COPY_AUTO) {
+        if (!reflink_unsupported) {
+            if (ioctl(dstfd, FICLONE, srcfd) == 0)
+                ret = 0;
+            else if (errno == ENOTTY || errno == ENOSYS)
+                reflink_unsupported = 1;
+        }
+        struct stat st;
+        if (ret != 0 && fstat(srcfd, &st) == 0)
+            ret = copy_in_kernel(srcfd, dstfd, st.st_size);
     }
+    if (ret < 0)
+        ret = copy_buffered(srcfd, dstfd);
 
-    close(dstfd);
     close(srcfd);
+    if (close(dstfd) || ret)
+        return 5;
 
     return 0;
 }
 
+// a manifest line waiting to be written. entries are kept in traversal
+// order; regular files are hashed and stored by the worker threads, and
+// the line is only written once every entry before it has been written.
+struct STORE_ENTRY {
+    struct DEDUPE_MANIFEST_ENTRY entry;
+    char *path;
+    char *link;
+    struct DEDUPE_MANIFEST_CHUNK *chunks;
+    unsigned int chunk_capacity;
+    struct stat st;
+    int is_file;
+    int done;
+    int ret;
+    struct STORE_ENTRY *next;
+};
+
 typedef struct DEDUPE_STORE_CONTEXT {
+    struct DEDUPE_CONTEXT *dedupe;
+    // the directory being stored. paths in the manifest are relative to
+    // it, the process' working directory is left alone.
+    char input_dir[PATH_MAX];
     char blob_dir[PATH_MAX];
-    FILE *output_manifest;
+    struct DEDUPE_MANIFEST_WRITER output_manifest;
     const char** excludes;
     int exclude_count;
+    // keys of unchanged files from a previous manifest, may be NULL
+    struct STAT_CACHE *stat_cache;
+    int reused_count;
+    // zlib level for compressible blobs, 0 stores everything uncompressed
+    int compress;
+    // split large files into content defined chunks
+    int chunking;
+    // what is already in the blob store, may be NULL
+    struct BLOB_INDEX *index;
+
+    int threads;
+    // regular files, hashed and stored by the pool
+    struct WORK_QUEUE queue;
+    pthread_mutex_t lock;
+    pthread_cond_t job_done;
+    // manifest entries in traversal order
+    struct STORE_ENTRY *head;
+    struct STORE_ENTRY *tail;
+    int pending;
+    int max_pending;
+    int failure;
 };
 
+// hands a stored or restored path to the caller. calls must not overlap.
+static void report_progress(struct DEDUPE_CONTEXT *dedupe, const char *path, unsigned long long bytes) {
+    dedupe->bytes += bytes;
+    dedupe->files++;
+    if (dedupe->callback != NULL)
+        dedupe->callback(path, dedupe->cookie);
+}
+
+// where a path relative to the input directory is on disk
+static const char* input_path(struct DEDUPE_STORE_CONTEXT *context, const char *path, char *buf) {
+    snprintf(buf, PATH_MAX, "%s/%s", context->input_dir, path);
+    return buf;
+}
+
 static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
-    fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
-    fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "usage: %s c [-j threads] [-r reference_manifest] [-z] [-c] input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
+    fprintf(stderr, "usage: %s x [-j threads] [-m auto|copy|link] input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s gc [-n] blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "usage: %s verify [-j threads] [-l kbytes_per_second] blob_dir [input_manifests...]\n", argv[0]);
+}
+
+static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
+static int stat_cache_lookup(struct DEDUPE_STORE_CONTEXT *context, struct STORE_ENTRY *e);
+
+// a quick entropy estimate on the first block of a file. already
+// compressed data (apks, jpegs, ...) looks close to random and is not
+// worth spending cpu on. this uses the collision entropy,
+// -log2(sum(p^2)), which needs no floating point: anything above 7.5
+// bits per byte (2^7.5 ~= 181) is treated as incompressible.
+static int looks_compressible(const unsigned char *buf, size_t len) {
+    unsigned int counts[256];
+    unsigned long long sum = 0;
+    size_t i;
+    if (len < COMPRESS_MIN_SIZE)
+        return 0;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < len; i++)
+        counts[buf[i]]++;
+    for (i = 0; i < 256; i++)
+        sum += (unsigned long long)counts[i] * counts[i];
+    return sum * 181 > (unsigned long long)len * len;
 }
 
-static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
-    char rdata[BUFSIZ];
-    int rsize;
-    SHA256_CTX c;
+struct BLOB_WRITER {
+    int fd;
+    int codec;
+    z_stream zs;
+};
 
-    SHA256_Init(&c);
-    while(!feof(mfile)) {
-        rsize = fread(rdata, sizeof(char), BUFSIZ, mfile);
-        if(rsize > 0) {
-            SHA256_Update(&c, rdata, rsize);
-        }
-    }
+static int blob_write(struct BLOB_WRITER *w, const unsigned char *data, size_t len, int flush) {
+    if (w->codec == DEDUPE_CODEC_NONE)
+        return write_fully(w->fd, data, len);
+
+    unsigned char out[STORE_BUFFER_SIZE];
+    w->zs.next_in = (unsigned char*)data;
+    w->zs.avail_in = len;
+    do {
+        w->zs.next_out = out;
+        w->zs.avail_out = sizeof(out);
+        if (deflate(&w->zs, flush) == Z_STREAM_ERROR)
+            return 1;
+        if (write_fully(w->fd, out, sizeof(out) - w->zs.avail_out))
+            return 1;
+    } while (w->zs.avail_out == 0);
+    return 0;
+}
 
-    SHA256_Final(rptr, &c);
+// returns 1 if the blob is in the store. uncompressed blobs must also
+// have the expected size.
+static int blob_exists(struct DEDUPE_STORE_CONTEXT *context, const unsigned char *digest, int codec, off_t size) {
+    char key[BLOB_NAME_MAX];
+    char blob[PATH_MAX];
+    struct stat file_info;
+    if (context->index != NULL) {
+        off_t blob_size;
+        if (!blob_index_lookup(context->index, digest, codec, &blob_size))
+            return 0;
+        return codec != DEDUPE_CODEC_NONE || blob_size == size;
+    }
+    blob_name(digest, codec, key);
+    sprintf(blob, "%s/%s", context->blob_dir, key);
+    if (stat(blob, &file_info) != 0)
+        return 0;
+    return codec != DEDUPE_CODEC_NONE || file_info.st_size == size;
 }
 
-static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "Unable to open file: %s\n", filename);
+// a blob being spooled into the store: written to a temporary file
+// while it is hashed, and moved to its content addressed name once
+// complete.
+struct BLOB_SPOOL {
+    char tmp_path[PATH_MAX];
+    struct BLOB_WRITER w;
+    SHA256_CTX sha;
+    off_t size;
+};
+
+static int spool_open(struct DEDUPE_STORE_CONTEXT *context, struct BLOB_SPOOL *spool) {
+    sprintf(spool->tmp_path, "%s/tmp.XXXXXX", context->blob_dir);
+    spool->w.fd = mkstemp(spool->tmp_path);
+    if (spool->w.fd < 0)
         return 1;
-    }
-    do_sha256sum(f, rptr);
-    fclose(f);
+    fchmod(spool->w.fd, 0666);
+    spool->w.codec = DEDUPE_CODEC_NONE;
+    spool->size = 0;
+    SHA256_Init(&spool->sha);
     return 0;
 }
 
-static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
+// decide how to store the blob from a sample of its first bytes. must
+// be called before anything is appended.
+static void spool_probe(struct DEDUPE_STORE_CONTEXT *context, struct BLOB_SPOOL *spool, const unsigned char *data, size_t len) {
+    if (context->compress && looks_compressible(data, len)) {
+        memset(&spool->w.zs, 0, sizeof(spool->w.zs));
+        if (deflateInit(&spool->w.zs, context->compress) == Z_OK)
+            spool->w.codec = DEDUPE_CODEC_ZLIB;
+    }
+}
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%d\t%d\t%lu\t%lu\t%lu\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, st.st_atime, st.st_mtime, st.st_ctime, f);
+static int spool_append(struct BLOB_SPOOL *spool, const unsigned char *data, size_t len) {
+    SHA256_Update(&spool->sha, data, len);
+    spool->size += len;
+    return blob_write(&spool->w, data, len, Z_NO_FLUSH);
 }
 
-static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
-    printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
-    int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
-        fprintf(stderr, "Error calculating sha256sum of %s\n", f);
-        return ret;
+static void spool_abort(struct BLOB_SPOOL *spool) {
+    if (spool->w.codec == DEDUPE_CODEC_ZLIB)
+        deflateEnd(&spool->w.zs);
+    close(spool->w.fd);
+    unlink(spool->tmp_path);
+}
+
+// finish the blob and move it into the store, or discard it if that
+// content is already stored, however it was stored. fills in the digest
+// and the codec of the stored copy.
+static int spool_commit(struct DEDUPE_STORE_CONTEXT *context, struct BLOB_SPOOL *spool, unsigned char *digest, unsigned char *codec) {
+    int failed = 0;
+    if (spool->w.codec == DEDUPE_CODEC_ZLIB) {
+        failed = blob_write(&spool->w, NULL, 0, Z_FINISH);
+        deflateEnd(&spool->w.zs);
+    }
+    // the size of the blob as stored, for the index
+    off_t stored = lseek(spool->w.fd, 0, SEEK_CUR);
+    if (close(spool->w.fd) || failed) {
+        unlink(spool->tmp_path);
+        return 5;
+    }
+    SHA256_Final(digest, &spool->sha);
+
+    // not quite sure how I feel about trusting existing blobs.
+    if (blob_exists(context, digest, DEDUPE_CODEC_NONE, spool->size)) {
+        *codec = DEDUPE_CODEC_NONE;
+        unlink(spool->tmp_path);
+        return 0;
+    }
+    if (blob_exists(context, digest, DEDUPE_CODEC_ZLIB, spool->size)) {
+        *codec = DEDUPE_CODEC_ZLIB;
+        unlink(spool->tmp_path);
+        return 0;
     }
-    char psum[128];
-    int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
-        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
 
-    // if a hash is abcdefg,
-    // the output blob name is abc/defg
-    // this is to get around vfat having a 64k directory size limit (usually around 20k files)
+    // only new blobs touch the store's directories
+    char key[BLOB_NAME_MAX];
     char out_blob[PATH_MAX];
-    char tmp_out_blob[PATH_MAX];
-    char key[SHA256_DIGEST_LENGTH + SHA256_DIGEST_LENGTH / 3 + 3];
-    // int i = 0;
-    // int keyIndex = 0;
-    // while (psum[i]) {
-    //     key[keyIndex] = psum[i];
-    //     i++;
-    //     keyIndex++;
-    //     if (i % 2 == 0 && psum[i]) {
-    //         key[keyIndex] = '/';
-    //         keyIndex++;
-    //     }
-    // }
-    strcpy(key, psum);
-    key[3] = '/';
-    key[4] = NULL;
-    strcat(key, psum + 3);
+    char out_blob_dir[PATH_MAX];
+    blob_name(digest, spool->w.codec, key);
     sprintf(out_blob, "%s/%s", context->blob_dir, key);
-    sprintf(tmp_out_blob, "%s.tmp", out_blob);
-    mkdir(dirname(out_blob), S_IRWXU | S_IRWXG | S_IRWXO);
+    // the fan-out directory is the first three digits of the name
+    sprintf(out_blob_dir, "%s/%.3s", context->blob_dir, key);
+    int ret = 0;
+    if (context->index != NULL)
+        ret = blob_index_make_dir(context->index, digest, out_blob_dir);
+    else if (mkdir(out_blob_dir, S_IRWXU | S_IRWXG | S_IRWXO) && errno != EEXIST)
+        ret = errno;
+    if (ret) {
+        unlink(spool->tmp_path);
+        return ret;
+    }
+    if (rename(spool->tmp_path, out_blob)) {
+        ret = errno;
+        unlink(spool->tmp_path);
+        return ret;
+    }
+    *codec = spool->w.codec;
+    if (context->index != NULL)
+        blob_index_add(context->index, digest, *codec, stored);
+    return 0;
+}
 
-    // don't copy the file if it exists? not quite sure how I feel about this.
-    int size = (int)st.st_size;
-    struct stat file_info;
-    // verify the file exists and is of the same size
-    int file_ok = stat(out_blob, &file_info) == 0;
-    if (file_ok) {
-        int existing_size = file_info.st_size;
-        if (existing_size != size)
-            file_ok = 0;
-    }
-    if (!file_ok) {
-        // copy to the tmp file
-        if ((ret = copy_file(f, tmp_out_blob)) || (ret = rename(tmp_out_blob, out_blob))) {
-            fprintf(stderr, "Error copying blob %s\n", f);
-            return ret;
+// content defined chunking (FastCDC): a gear rolling hash over the data
+// cuts a chunk wherever its low bits are zero, so an insertion or change
+// only moves the boundaries of the chunks around it. a stricter mask
+// before the average size and a looser one after it keeps chunk sizes
+// close to the average.
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init() {
+    // splitmix64, so the table (and so the chunk boundaries) never change
+    uint64_t x = 0x6465647570650000ULL;
+    int i;
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+struct CHUNKER {
+    uint64_t hash;
+    size_t length;
+};
+
+// returns how many bytes of data belong to the current chunk, setting
+// cut if the chunk ends there.
+static size_t chunker_scan(struct CHUNKER *c, const unsigned char *data, size_t len, int *cut) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        c->length++;
+        if (c->length < CHUNK_MIN_SIZE)
+            continue;
+        c->hash = (c->hash << 1) + gear[data[i]];
+        uint64_t mask = c->length < CHUNK_AVG_SIZE ? CHUNK_MASK_SMALL : CHUNK_MASK_LARGE;
+        if (!(c->hash & mask) || c->length >= CHUNK_MAX_SIZE) {
+            c->hash = 0;
+            c->length = 0;
+            *cut = 1;
+            return i + 1;
         }
     }
+    *cut = 0;
+    return len;
+}
+
+static void add_chunk(struct STORE_ENTRY *e, const unsigned char *digest, unsigned char codec, off_t length) {
+    if (e->entry.chunk_count == e->chunk_capacity) {
+        e->chunk_capacity = e->chunk_capacity ? e->chunk_capacity * 2 : 64;
+        e->chunks = realloc(e->chunks, sizeof(struct DEDUPE_MANIFEST_CHUNK) * e->chunk_capacity);
+        assert(e->chunks != NULL);
+    }
+    struct DEDUPE_MANIFEST_CHUNK *chunk = &e->chunks[e->entry.chunk_count++];
+    memset(chunk, 0, sizeof(*chunk));
+    memcpy(chunk->digest, digest, SHA256_DIGEST_LENGTH);
+    chunk->length = length;
+    chunk->codec = codec;
+    e->entry.chunks = e->chunks;
+}
+
+// read the file exactly once, hashing it while spooling it (compressed,
+// if enabled and the content looks compressible) into the store. large
+// files are split into content defined chunks when chunking is enabled.
+static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct STORE_ENTRY *e) {
+    unsigned char buf[STORE_BUFFER_SIZE];
+    const char *f = e->path;
+    int srcfd, bytes_read, ret = 0;
+    int chunked = context->chunking && e->st.st_size >= CHUNK_FILE_MIN_SIZE;
+    off_t total_read = 0;
+    SHA256_CTX whole;
+    struct BLOB_SPOOL spool;
+    struct CHUNKER chunker;
+
+    char full_path[PATH_MAX];
+    srcfd = open(input_path(context, f, full_path), O_RDONLY);
+    if (srcfd < 0) {
+        fprintf(stderr, "Unable to open file: %s\n", f);
+        return 1;
+    }
+    if (spool_open(context, &spool)) {
+        fprintf(stderr, "Unable to create temporary blob for %s\n", f);
+        close(srcfd);
+        return 1;
+    }
+    if (chunked) {
+        SHA256_Init(&whole);
+        memset(&chunker, 0, sizeof(chunker));
+    }
+
+    while (ret == 0 && (bytes_read = read(srcfd, buf, sizeof(buf))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = 1;
+            break;
+        }
+        if (context->dedupe->cancel) {
+            ret = ECANCELED;
+            break;
+        }
+        if (!chunked) {
+            if (total_read == 0)
+                spool_probe(context, &spool, buf, bytes_read);
+            ret = spool_append(&spool, buf, bytes_read);
+            total_read += bytes_read;
+            continue;
+        }
+
+        SHA256_Update(&whole, buf, bytes_read);
+        total_read += bytes_read;
+        const unsigned char *p = buf;
+        size_t left = bytes_read;
+        while (ret == 0 && left > 0) {
+            int cut;
+            size_t n = chunker_scan(&chunker, p, left, &cut);
+            if (spool.size == 0)
+                spool_probe(context, &spool, p, left);
+            ret = spool_append(&spool, p, n);
+            p += n;
+            left -= n;
+            if (ret == 0 && cut) {
+                unsigned char digest[SHA256_DIGEST_LENGTH];
+                unsigned char codec;
+                off_t length = spool.size;
+                if ((ret = spool_commit(context, &spool, digest, &codec)) == 0) {
+                    add_chunk(e, digest, codec, length);
+                    if (spool_open(context, &spool))
+                        ret = 1;
+                }
+                if (ret)
+                    spool.w.fd = -1;
+            }
+        }
+    }
+    close(srcfd);
+
+    if (ret) {
+        if (spool.w.fd >= 0)
+            spool_abort(&spool);
+    }
+    else if (!chunked) {
+        ret = spool_commit(context, &spool, e->entry.digest, &e->entry.codec);
+    }
+    else {
+        // the last chunk
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        unsigned char codec;
+        off_t length = spool.size;
+        if (length == 0)
+            spool_abort(&spool);
+        else if ((ret = spool_commit(context, &spool, digest, &codec)) == 0)
+            add_chunk(e, digest, codec, length);
+        SHA256_Final(e->entry.digest, &whole);
+        e->entry.codec = DEDUPE_CODEC_NONE;
+    }
+    if (ret) {
+        fprintf(stderr, "Error copying blob %s\n", f);
+        return ret;
+    }
 
-    fprintf(context->output_manifest, "%s\t%d\t\n", key, size);
+    // the manifest records what was actually read, in case the file
+    // changed size since it was stat'ed.
+    e->st.st_size = total_read;
     return 0;
 }
 
+// write out every finished entry at the head of the pending list.
+// called with context->lock held.
+static void flush_entries(struct DEDUPE_STORE_CONTEXT *context) {
+    struct STORE_ENTRY *e;
+    while ((e = context->head) != NULL && e->done) {
+        if (e->ret) {
+            if (!context->failure) {
+                fprintf(stderr, "Error storing: %s\n", e->path);
+                context->failure = e->ret;
+            }
+        }
+        else if (!context->failure) {
+            e->entry.size = e->is_file ? e->st.st_size : 0;
+            report_progress(context->dedupe, e->path, e->entry.size);
+            if (manifest_write(&context->output_manifest, &e->entry)) {
+                fprintf(stderr, "Error writing manifest\n");
+                context->failure = 1;
+            }
+        }
+        context->head = e->next;
+        if (context->head == NULL)
+            context->tail = NULL;
+        context->pending--;
+        free(e->path);
+        free(e->link);
+        free(e->chunks);
+        free(e);
+    }
+}
+
+// a work queue job. the entry stays on the pending list, errors are
+// reported when it reaches the head of it.
+static int store_job(void *job, void *cookie) {
+    struct DEDUPE_STORE_CONTEXT *context = (struct DEDUPE_STORE_CONTEXT*)cookie;
+    struct STORE_ENTRY *e = (struct STORE_ENTRY*)job;
+    pthread_mutex_lock(&context->lock);
+    int failed = context->failure;
+    pthread_mutex_unlock(&context->lock);
+
+    int ret = failed ? failed : store_file(context, e);
+
+    pthread_mutex_lock(&context->lock);
+    e->ret = ret;
+    e->done = 1;
+    pthread_cond_broadcast(&context->job_done);
+    pthread_mutex_unlock(&context->lock);
+    return 0;
+}
+
+// append a manifest entry in traversal order, handing regular files to
+// the worker pool. blocks while too many entries are outstanding.
+static int queue_entry(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, const char *path, const char *link) {
+    struct STORE_ENTRY *e = calloc(1, sizeof(struct STORE_ENTRY));
+    assert(e != NULL);
+    e->path = strdup(path);
+    e->link = link != NULL ? strdup(link) : NULL;
+    e->st = st;
+    e->is_file = S_ISREG(st.st_mode);
+    e->done = !e->is_file;
+
+    e->entry.type = type;
+    e->entry.mode = st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID);
+    e->entry.uid = st.st_uid;
+    e->entry.gid = st.st_gid;
+    e->entry.atime = st.st_atime;
+    e->entry.mtime = st.st_mtime;
+    e->entry.ctime = st.st_ctime;
+    e->entry.ino = st.st_ino;
+    e->entry.path = e->path;
+    e->entry.link = e->link;
+
+    if (e->is_file && stat_cache_lookup(context, e)) {
+        context->reused_count++;
+        e->done = 1;
+    }
+
+    pthread_mutex_lock(&context->lock);
+    if (context->tail != NULL)
+        context->tail->next = e;
+    else
+        context->head = e;
+    context->tail = e;
+    context->pending++;
+    pthread_mutex_unlock(&context->lock);
+    // with a single thread the file is stored right here
+    if (!e->done)
+        work_queue_push(&context->queue, e);
+
+    pthread_mutex_lock(&context->lock);
+    flush_entries(context);
+    while (context->pending >= context->max_pending && !context->failure) {
+        pthread_cond_wait(&context->job_done, &context->lock);
+        flush_entries(context);
+    }
+    int ret = context->failure;
+    pthread_mutex_unlock(&context->lock);
+    return ret;
+}
+
+static void start_workers(struct DEDUPE_STORE_CONTEXT *context) {
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->job_done, NULL);
+    context->head = context->tail = NULL;
+    context->pending = 0;
+    context->failure = 0;
+    if (context->threads < 1)
+        context->threads = 1;
+    context->max_pending = context->threads * PENDING_PER_THREAD;
+    // no more files can be queued than entries are pending
+    work_queue_start(&context->queue, context->threads, context->max_pending, store_job, context);
+}
+
+// wait for the outstanding entries to be written and stop the workers.
+static int finish_workers(struct DEDUPE_STORE_CONTEXT *context) {
+    pthread_mutex_lock(&context->lock);
+    while (context->head != NULL) {
+        flush_entries(context);
+        if (context->head != NULL)
+            pthread_cond_wait(&context->job_done, &context->lock);
+    }
+    pthread_mutex_unlock(&context->lock);
+
+    work_queue_finish(&context->queue);
+    pthread_cond_destroy(&context->job_done);
+    pthread_mutex_destroy(&context->lock);
+    return context->failure;
+}
+
 static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
     char full_path[PATH_MAX];
-    printf("%s\n", d);
-    DIR *dp = opendir(d);
+    char disk_path[PATH_MAX];
+    DIR *dp = opendir(input_path(context, d, disk_path));
     if (dp == NULL) {
         fprintf(stderr, "Error opening directory: %s\n", d);
         return 1;
     }
     struct dirent *ep;
     while (ep = readdir(dp)) {
+        if (context->dedupe->cancel) {
+            closedir(dp);
+            return ECANCELED;
+        }
         if (strcmp(ep->d_name, ".") == 0)
             continue;
         if (strcmp(ep->d_name, "..") == 0)
@@ -185,14 +738,15 @@ static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
         }
         if (i != context->exclude_count)
             continue;
-        if (0 != (ret = lstat(full_path, &cst))) {
+        if (0 != (ret = lstat(input_path(context, full_path, disk_path), &cst))) {
             fprintf(stderr, "Error opening: %s\n", full_path);
             closedir(dp);
             return ret;
         }
 
         if (ret = store_st(context, cst, full_path)) {
-            fprintf(stderr, "Error storing: %s\n", full_path);
+            if (ret != ECANCELED)
+                fprintf(stderr, "Error storing: %s\n", full_path);
             closedir(dp);
             return ret;
         }
@@ -202,30 +756,28 @@ static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
 }
 
 static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
-    printf("%s\n", l);
     char link[PATH_MAX];
-    int ret = readlink(l, link, PATH_MAX);
+    char disk_path[PATH_MAX];
+    int ret = readlink(input_path(context, l, disk_path), link, PATH_MAX - 1);
     if (ret < 0) {
         fprintf(stderr, "Error reading symlink\n");
         return errno;
     }
     link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
-    return 0;
+    return queue_entry(context, 'l', st, l, link);
 }
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
+    int ret;
     if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, s);
-        return store_file(context, st, s);
+        return queue_entry(context, 'f', st, s, NULL);
     }
     else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, s);
-        fprintf(context->output_manifest, "\n");
+        if (ret = queue_entry(context, 'd', st, s, NULL))
+            return ret;
         return store_dir(context, st, s);
     }
     else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, s);
         return store_link(context, st, s);
     }
     else {
@@ -234,79 +786,648 @@ static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     }
 }
 
-static char* tokenize(char *out, const char* line, const char sep) {
-    while (*line != sep) {
-        if (*line == '\0') {
-            return NULL;
+// files from a previous manifest keyed by path. a file whose size,
+// mtime and ctime are unchanged since then is assumed to still hash to
+// the same key, so it does not need to be read again.
+struct STAT_CACHE_ENTRY {
+    char *path;
+    unsigned long long size;
+    unsigned long long ino;
+    long mtime;
+    long ctime;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned char codec;
+    struct DEDUPE_MANIFEST_CHUNK *chunks;
+    unsigned int chunk_count;
+    struct STAT_CACHE_ENTRY *next;
+};
+
+struct STAT_CACHE {
+    struct STAT_CACHE_ENTRY **buckets;
+    unsigned int bucket_count;
+    unsigned int count;
+};
+
+static unsigned int hash_string(const char *str) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void stat_cache_init(struct STAT_CACHE *cache) {
+    cache->bucket_count = 1024;
+    cache->count = 0;
+    cache->buckets = calloc(cache->bucket_count, sizeof(struct STAT_CACHE_ENTRY*));
+    assert(cache->buckets != NULL);
+}
+
+static void stat_cache_free(struct STAT_CACHE *cache) {
+    unsigned int i;
+    for (i = 0; i < cache->bucket_count; i++) {
+        struct STAT_CACHE_ENTRY *e = cache->buckets[i];
+        while (e != NULL) {
+            struct STAT_CACHE_ENTRY *next = e->next;
+            free(e->path);
+            free(e->chunks);
+            free(e);
+            e = next;
         }
+    }
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->bucket_count = 0;
+    cache->count = 0;
+}
 
-        *out = *line;
-        out++;
-        line++;
+static void stat_cache_add(struct STAT_CACHE *cache, const struct DEDUPE_MANIFEST_ENTRY *entry) {
+    if (cache->count >= cache->bucket_count * 2) {
+        // grow
+        unsigned int new_count = cache->bucket_count * 4;
+        struct STAT_CACHE_ENTRY **buckets = calloc(new_count, sizeof(struct STAT_CACHE_ENTRY*));
+        assert(buckets != NULL);
+        unsigned int i;
+        for (i = 0; i < cache->bucket_count; i++) {
+            struct STAT_CACHE_ENTRY *e = cache->buckets[i];
+            while (e != NULL) {
+                struct STAT_CACHE_ENTRY *next = e->next;
+                unsigned int b = hash_string(e->path) & (new_count - 1);
+                e->next = buckets[b];
+                buckets[b] = e;
+                e = next;
+            }
+        }
+        free(cache->buckets);
+        cache->buckets = buckets;
+        cache->bucket_count = new_count;
     }
 
-    *out = '\0';
-    // resume at the next char
-    return ++line;
+    struct STAT_CACHE_ENTRY *e = malloc(sizeof(struct STAT_CACHE_ENTRY));
+    assert(e != NULL);
+    e->path = strdup(entry->path);
+    e->size = entry->size;
+    e->ino = entry->ino;
+    e->mtime = entry->mtime;
+    e->ctime = entry->ctime;
+    memcpy(e->digest, entry->digest, SHA256_DIGEST_LENGTH);
+    e->codec = entry->codec;
+    e->chunks = NULL;
+    e->chunk_count = entry->chunk_count;
+    if (e->chunk_count > 0) {
+        // the entry's chunk list points into the reader's buffers
+        e->chunks = malloc(sizeof(struct DEDUPE_MANIFEST_CHUNK) * e->chunk_count);
+        assert(e->chunks != NULL);
+        memcpy(e->chunks, entry->chunks, sizeof(struct DEDUPE_MANIFEST_CHUNK) * e->chunk_count);
+    }
+    unsigned int b = hash_string(e->path) & (cache->bucket_count - 1);
+    e->next = cache->buckets[b];
+    cache->buckets[b] = e;
+    cache->count++;
 }
 
-static int dec_to_oct(int dec) {
+static int stat_cache_load(struct STAT_CACHE *cache, const char *manifest) {
+    struct DEDUPE_MANIFEST_READER reader;
+    struct DEDUPE_MANIFEST_ENTRY entry;
+    if (manifest_open(&reader, manifest))
+        return 1;
+
+    // version 1 manifests do not record times, so nothing can be reused.
     int ret = 0;
-    int mult = 1;
-    while (dec != 0) {
-        int rem = dec % 10;
-        ret += (rem * mult);
-        dec /= 10;
-        mult *= 8;
+    if (reader.version >= 2) {
+        while ((ret = manifest_next(&reader, &entry)) > 0) {
+            if (entry.type == 'f')
+                stat_cache_add(cache, &entry);
+        }
     }
+    manifest_close(&reader);
+    return ret < 0;
+}
 
-    return ret;
+// fills in the entry's digest (and chunks) and returns 1 if the file is
+// unchanged since the reference manifest and its blobs are still in the
+// store.
+static int stat_cache_lookup(struct DEDUPE_STORE_CONTEXT *context, struct STORE_ENTRY *se) {
+    struct STAT_CACHE *cache = context->stat_cache;
+    struct stat *st = &se->st;
+    if (cache == NULL || cache->count == 0)
+        return 0;
+
+    struct STAT_CACHE_ENTRY *e = cache->buckets[hash_string(se->path) & (cache->bucket_count - 1)];
+    while (e != NULL && strcmp(e->path, se->path) != 0)
+        e = e->next;
+    if (e == NULL)
+        return 0;
+    if (e->size != (unsigned long long)st->st_size || e->mtime != st->st_mtime || e->ctime != st->st_ctime)
+        return 0;
+    // older manifests do not record the inode
+    if (e->ino != 0 && e->ino != (unsigned long long)st->st_ino)
+        return 0;
+
+    unsigned int i;
+    if (e->chunk_count == 0) {
+        if (!blob_exists(context, e->digest, e->codec, st->st_size))
+            return 0;
+    }
+    else {
+        for (i = 0; i < e->chunk_count; i++) {
+            if (!blob_exists(context, e->chunks[i].digest, e->chunks[i].codec, e->chunks[i].length))
+                return 0;
+        }
+    }
+
+    memcpy(se->entry.digest, e->digest, SHA256_DIGEST_LENGTH);
+    se->entry.codec = e->codec;
+    for (i = 0; i < e->chunk_count; i++)
+        add_chunk(se, e->chunks[i].digest, e->chunks[i].codec, e->chunks[i].length);
+    return 1;
 }
 
-struct array {
-    void** data;
-    int size;
-    int capacity;
+// an open addressing set of sha256 digests. digests are already
+// uniformly distributed, so their leading bytes are used as the hash.
+struct DIGEST_SET {
+    unsigned char *digests;
+    unsigned char *used;
+    size_t capacity;
+    size_t count;
 };
 
-static void array_init(struct array* arr, int capacity) {
-    arr->data = malloc(sizeof(void*) * capacity);
-    assert(arr->data != NULL);
-    arr->size = 0;
-    arr->capacity = capacity;
+static void digest_set_init(struct DIGEST_SET *set, size_t capacity) {
+    set->capacity = capacity;
+    set->count = 0;
+    set->digests = malloc(capacity * SHA256_DIGEST_LENGTH);
+    set->used = calloc(capacity, 1);
+    assert(set->digests != NULL && set->used != NULL);
 }
 
-static void array_free(struct array* arr, int free_members) {
-    if (free_members) {
-        int i;
-        for (i = 0; i < arr->size; i++) {
-            free(arr->data[i]);
+static void digest_set_free(struct DIGEST_SET *set) {
+    free(set->digests);
+    free(set->used);
+    set->digests = NULL;
+    set->used = NULL;
+    set->capacity = 0;
+    set->count = 0;
+}
+
+// returns the slot holding digest, or the empty slot where it belongs.
+static size_t digest_set_slot(const struct DIGEST_SET *set, const unsigned char *digest) {
+    size_t i;
+    memcpy(&i, digest, sizeof(i));
+    i &= set->capacity - 1;
+    while (set->used[i] && memcmp(set->digests + i * SHA256_DIGEST_LENGTH, digest, SHA256_DIGEST_LENGTH) != 0)
+        i = (i + 1) & (set->capacity - 1);
+    return i;
+}
+
+static int digest_set_contains(const struct DIGEST_SET *set, const unsigned char *digest) {
+    return set->used[digest_set_slot(set, digest)];
+}
+
+static void digest_set_add(struct DIGEST_SET *set, const unsigned char *digest) {
+    // keep the load factor under one half
+    if ((set->count + 1) * 2 > set->capacity) {
+        struct DIGEST_SET grown;
+        digest_set_init(&grown, set->capacity * 2);
+        size_t i;
+        for (i = 0; i < set->capacity; i++) {
+            if (set->used[i])
+                digest_set_add(&grown, set->digests + i * SHA256_DIGEST_LENGTH);
+        }
+        digest_set_free(set);
+        *set = grown;
+    }
+
+    size_t i = digest_set_slot(set, digest);
+    if (!set->used[i]) {
+        memcpy(set->digests + i * SHA256_DIGEST_LENGTH, digest, SHA256_DIGEST_LENGTH);
+        set->used[i] = 1;
+        set->count++;
+    }
+}
+
+struct GC_CONTEXT {
+    struct DEDUPE_CONTEXT *dedupe;
+    struct DIGEST_SET used;
+    int dry_run;
+    unsigned long blob_count;
+    unsigned long unused_count;
+    unsigned long long unused_bytes;
+};
+
+// walk the blob store, removing every file that is not a blob referenced
+// by one of the manifests. name is the path relative to the blob dir.
+static void gc_dir(struct GC_CONTEXT *gc, const char *d, const char *name) {
+    DIR *dp = opendir(d);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", d);
+        return;
+    }
+    struct dirent *ep;
+    while ((ep = readdir(dp)) && !gc->dedupe->cancel) {
+        if (strcmp(ep->d_name, ".") == 0)
+            continue;
+        if (strcmp(ep->d_name, "..") == 0)
+            continue;
+        struct stat cst;
+        char blob[PATH_MAX];
+        char rel[PATH_MAX];
+        sprintf(blob, "%s/%s", d, ep->d_name);
+        sprintf(rel, "%s%s", name, ep->d_name);
+        if (lstat(blob, &cst)) {
+            fprintf(stderr, "Error opening: %s\n", ep->d_name);
+            continue;
+        }
+
+        if (S_ISDIR(cst.st_mode)) {
+            strcat(rel, "/");
+            gc_dir(gc, blob, rel);
+            continue;
+        }
+
+        // the index is rebuilt from whatever is left
+        if (strcmp(rel, BLOB_INDEX_NAME) == 0)
+            continue;
+
+        // anything that is not named after a digest (left over temporary
+        // blobs) is unused as well.
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        gc->blob_count++;
+        if (parse_blob_name(rel, digest, NULL) == 0 && digest_set_contains(&gc->used, digest))
+            continue;
+
+        gc->unused_count++;
+        gc->unused_bytes += cst.st_size;
+        if (gc->dry_run) {
+            printf("Unused: %s\n", blob);
+            continue;
+        }
+        if (remove(blob)) {
+            fprintf(stderr, "Error removing: %s\n", blob);
+        }
+        printf("Delete: %s\n", blob);
+    }
+    closedir(dp);
+}
+
+// streams the contents of a blob, decompressed, to sink.
+typedef int (*blob_sink)(const unsigned char *data, size_t len, void *cookie);
+
+static int read_blob(const char *blob, int codec, blob_sink sink, void *cookie) {
+    unsigned char in[STORE_BUFFER_SIZE];
+    unsigned char out[STORE_BUFFER_SIZE];
+    z_stream zs;
+    int fd, bytes_read, ret = 0, zret = Z_OK;
+
+    fd = open(blob, O_RDONLY);
+    if (fd < 0)
+        return 3;
+    if (codec == DEDUPE_CODEC_ZLIB) {
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit(&zs) != Z_OK) {
+            close(fd);
+            return 1;
+        }
+    }
+    while (ret == 0 && zret != Z_STREAM_END && (bytes_read = read(fd, in, sizeof(in))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = 1;
+            break;
+        }
+        if (codec == DEDUPE_CODEC_NONE) {
+            ret = sink(in, bytes_read, cookie);
+            continue;
         }
+        zs.next_in = in;
+        zs.avail_in = bytes_read;
+        do {
+            zs.next_out = out;
+            zs.avail_out = sizeof(out);
+            zret = inflate(&zs, Z_NO_FLUSH);
+            if (zret != Z_OK && zret != Z_STREAM_END) {
+                ret = 1;
+                break;
+            }
+            if ((ret = sink(out, sizeof(out) - zs.avail_out, cookie)))
+                break;
+        } while (zs.avail_out == 0 && zret != Z_STREAM_END);
+    }
+    if (codec == DEDUPE_CODEC_ZLIB) {
+        // a truncated stream is as bad as a corrupt one
+        if (zret != Z_STREAM_END)
+            ret = 1;
+        inflateEnd(&zs);
     }
+    close(fd);
+    return ret;
+}
+
+static int write_sink(const unsigned char *data, size_t len, void *cookie) {
+    return write_fully(*(int*)cookie, data, len);
+}
+
+static int inflate_file(const char *blob, const char *dst) {
+    int dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (dstfd < 0)
+        return 4;
+    int ret = read_blob(blob, DEDUPE_CODEC_ZLIB, write_sink, &dstfd);
+    if (close(dstfd) || ret)
+        return 5;
+    return 0;
+}
 
-    if (arr->data != NULL) {
-        free(arr->data);
-        arr->data = NULL;
+// concatenate a chunked file's blobs into dst.
+static int restore_chunks(const char *blob_dir, const struct DEDUPE_MANIFEST_CHUNK *chunks, unsigned int count, const char *dst) {
+    char key[BLOB_NAME_MAX];
+    char blob_file[PATH_MAX];
+    int dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (dstfd < 0)
+        return 4;
+    int ret = 0;
+    unsigned int i;
+    for (i = 0; i < count && ret == 0; i++) {
+        blob_name(chunks[i].digest, chunks[i].codec, key);
+        sprintf(blob_file, "%s/%s", blob_dir, key);
+        ret = read_blob(blob_file, chunks[i].codec, write_sink, &dstfd);
     }
-    arr->size = 0;
-    arr->capacity = 0;
+    if (close(dstfd) || ret)
+        return 5;
+    return 0;
+}
+
+// a regular file to be materialized from its blob during restore
+struct RESTORE_JOB {
+    char *path;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned char codec;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    long atime;
+    long mtime;
+    int set_times;
+    unsigned long long size;
+    // the file's chunks in order, if it was stored chunked
+    struct DEDUPE_MANIFEST_CHUNK *chunks;
+    unsigned int chunk_count;
+};
+
+struct RESTORE_CONTEXT {
+    struct DEDUPE_CONTEXT *dedupe;
+    char blob_dir[PATH_MAX];
+    int copy_method;
+    // serializes progress reports from the workers
+    pthread_mutex_t lock;
+};
+
+static void restore_times(const char *filename, long atime, long mtime) {
+    struct timeval times[2];
+    times[0].tv_sec = atime;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = mtime;
+    times[1].tv_usec = 0;
+    utimes(filename, times);
+}
+
+// a hardlink shares the blob's inode, so it is only made when the blob
+// already has the owner, mode and mtime the file is restored with.
+// setting them on the link would change every other file using the blob.
+static int link_blob(const char *blob_file, struct RESTORE_JOB *j) {
+    struct stat st;
+    if (lstat(blob_file, &st) || !S_ISREG(st.st_mode))
+        return 1;
+    if (st.st_uid != j->uid || st.st_gid != j->gid ||
+            (st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID)) != j->mode)
+        return 1;
+    if (j->set_times && st.st_mtime != j->mtime)
+        return 1;
+    return link(blob_file, j->path);
 }
 
-static void array_add(struct array* arr, void* val) {
-    if (arr->size == arr->capacity) {
-        // Expand array
-        arr->capacity *= 2;
-        arr->data = realloc(arr->data, sizeof(void*) * arr->capacity);
-        assert(arr->data != NULL);
+static int restore_file(void *job, void *cookie) {
+    struct RESTORE_JOB *j = (struct RESTORE_JOB*)job;
+    struct RESTORE_CONTEXT *context = (struct RESTORE_CONTEXT*)cookie;
+    char key[BLOB_NAME_MAX];
+    char blob_file[PATH_MAX];
+    int linked = 0;
+    int ret;
+
+    if (context->dedupe->cancel) {
+        free(j->path);
+        free(j->chunks);
+        free(j);
+        return ECANCELED;
+    }
+    blob_name(j->digest, j->codec, key);
+    sprintf(blob_file, "%s/%s", context->blob_dir, key);
+    if (j->chunk_count > 0)
+        ret = restore_chunks(context->blob_dir, j->chunks, j->chunk_count, j->path);
+    else if (j->codec != DEDUPE_CODEC_NONE)
+        ret = inflate_file(blob_file, j->path);
+    else if (context->copy_method == DEDUPE_COPY_LINK && link_blob(blob_file, j) == 0) {
+        ret = 0;
+        linked = 1;
+    }
+    else {
+        // links fall back to copying, e.g. across filesystems
+        ret = copy_file(blob_file, j->path, context->copy_method == DEDUPE_COPY_LINK ? DEDUPE_COPY_AUTO : context->copy_method);
     }
-    arr->data[arr->size++] = val;
+    if (ret) {
+        fprintf(stderr, "Unable to copy file %s\n", j->path);
+    }
+    else {
+        if (!linked) {
+            chown(j->path, j->uid, j->gid);
+            chmod(j->path, j->mode);
+            if (j->set_times)
+                restore_times(j->path, j->atime, j->mtime);
+        }
+        pthread_mutex_lock(&context->lock);
+        report_progress(context->dedupe, j->path, j->size);
+        pthread_mutex_unlock(&context->lock);
+    }
+
+    free(j->path);
+    free(j->chunks);
+    free(j);
+    return ret;
 }
 
-static int string_compare(const void* a, const void* b) {
-    return strcmp(*(char**) a, *(char **) b);
+// restore in three passes over the manifest: create the directory
+// skeleton and symlinks, materialize the files on the worker threads,
+// then apply the directory metadata last, since creating files in a
+// directory would otherwise disturb its mtime.
+static int restore_manifest(struct DEDUPE_MANIFEST_READER *input_manifest, struct RESTORE_CONTEXT *context, int threads) {
+    struct DEDUPE_MANIFEST_ENTRY entry;
+    int ret;
+    int set_times = input_manifest->version >= 2;
+
+    while ((ret = manifest_next(input_manifest, &entry)) > 0) {
+        const char *filename = entry.path;
+        if (entry.type == 'd') {
+            // writable until the final pass
+            mkdir(filename, S_IRWXU);
+        }
+        else if (entry.type == 'l') {
+            report_progress(context->dedupe, filename, 0);
+            symlink(entry.link, filename);
+
+            // Android has no lchmod, and chmod follows symlinks
+            //chmod(filename, entry.mode);
+            lchown(filename, entry.uid, entry.gid);
+        }
+        else if (entry.type != 'f') {
+            fprintf(stderr, "Unknown type %c\n", entry.type);
+            return 1;
+        }
+    }
+    if (ret < 0)
+        return 1;
+
+    struct WORK_QUEUE queue;
+    work_queue_start(&queue, threads, threads * 64, restore_file, context);
+    manifest_rewind(input_manifest);
+    while ((ret = manifest_next(input_manifest, &entry)) > 0) {
+        if (entry.type != 'f')
+            continue;
+        struct RESTORE_JOB *job = malloc(sizeof(struct RESTORE_JOB));
+        assert(job != NULL);
+        job->path = strdup(entry.path);
+        memcpy(job->digest, entry.digest, SHA256_DIGEST_LENGTH);
+        job->codec = entry.codec;
+        job->mode = entry.mode;
+        job->uid = entry.uid;
+        job->gid = entry.gid;
+        job->atime = entry.atime;
+        job->mtime = entry.mtime;
+        job->set_times = set_times;
+        job->size = entry.size;
+        job->chunks = NULL;
+        job->chunk_count = entry.chunk_count;
+        if (entry.chunk_count > 0) {
+            job->chunks = malloc(sizeof(struct DEDUPE_MANIFEST_CHUNK) * entry.chunk_count);
+            assert(job->chunks != NULL);
+            memcpy(job->chunks, entry.chunks, sizeof(struct DEDUPE_MANIFEST_CHUNK) * entry.chunk_count);
+        }
+        if (work_queue_push(&queue, job))
+            break;
+    }
+    int failure = work_queue_finish(&queue);
+    if (failure)
+        return failure;
+    if (ret < 0)
+        return 1;
+
+    manifest_rewind(input_manifest);
+    while ((ret = manifest_next(input_manifest, &entry)) > 0) {
+        if (entry.type != 'd')
+            continue;
+        const char *filename = entry.path;
+        report_progress(context->dedupe, filename, 0);
+        chown(filename, entry.uid, entry.gid);
+        chmod(filename, entry.mode);
+        if (set_times)
+            restore_times(filename, entry.atime, entry.mtime);
+    }
+    return ret < 0;
+}
+
+// scrubbing: every blob is rehashed (decompressed, for compressed blobs)
+// and compared against its name.
+struct VERIFY_CONTEXT {
+    struct DEDUPE_CONTEXT *dedupe;
+    char blob_dir[PATH_MAX];
+    pthread_mutex_t lock;
+    // blobs that hash to their name, by codec
+    struct DIGEST_SET present[2];
+    struct DIGEST_SET corrupt;
+    unsigned long blob_count;
+    unsigned long corrupt_count;
+    unsigned long long bytes;
+    // bytes per second to hash across all threads, 0 for no limit
+    unsigned long long rate;
+    struct timespec start;
+    unsigned long long budget_used;
+};
+
+struct VERIFY_JOB {
+    char *path;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int codec;
+};
+
+struct VERIFY_SINK {
+    struct VERIFY_CONTEXT *context;
+    SHA256_CTX sha;
+};
+
+// keeps the scrub under its rate, so the device stays usable while
+// it runs. the budget is shared by all threads.
+static void verify_throttle(struct VERIFY_CONTEXT *context, size_t len) {
+    if (context->rate == 0)
+        return;
+    pthread_mutex_lock(&context->lock);
+    context->budget_used += len;
+    double due = (double)context->budget_used / context->rate;
+    pthread_mutex_unlock(&context->lock);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - context->start.tv_sec) + (now.tv_nsec - context->start.tv_nsec) / 1e9;
+    if (due > elapsed)
+        usleep((useconds_t)((due - elapsed) * 1e6));
+}
+
+static int verify_sink(const unsigned char *data, size_t len, void *cookie) {
+    struct VERIFY_SINK *sink = (struct VERIFY_SINK*)cookie;
+    verify_throttle(sink->context, len);
+    SHA256_Update(&sink->sha, data, len);
+    return 0;
+}
+
+static int verify_blob(void *job, void *cookie) {
+    struct VERIFY_JOB *j = (struct VERIFY_JOB*)job;
+    struct VERIFY_CONTEXT *context = (struct VERIFY_CONTEXT*)cookie;
+    struct VERIFY_SINK sink;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    struct stat st;
+
+    if (context->dedupe->cancel) {
+        free(j->path);
+        free(j);
+        return ECANCELED;
+    }
+    sink.context = context;
+    SHA256_Init(&sink.sha);
+    int ok = read_blob(j->path, j->codec, verify_sink, &sink) == 0;
+    SHA256_Final(digest, &sink.sha);
+    ok = ok && memcmp(digest, j->digest, SHA256_DIGEST_LENGTH) == 0;
+
+    pthread_mutex_lock(&context->lock);
+    context->blob_count++;
+    if (stat(j->path, &st) == 0)
+        context->bytes += st.st_size;
+    if (ok) {
+        digest_set_add(&context->present[j->codec], j->digest);
+    }
+    else {
+        context->corrupt_count++;
+        digest_set_add(&context->corrupt, j->digest);
+        printf("Corrupt: %s\n", j->path);
+    }
+    pthread_mutex_unlock(&context->lock);
+
+    free(j->path);
+    free(j);
+    // a corrupt blob is reported, it does not stop the scrub
+    return 0;
 }
 
-static void recursive_list_dir(char* d, struct array *arr) {
+// queue every blob under d. name is the path relative to the blob dir.
+static void verify_dir(struct WORK_QUEUE *queue, const char *d, const char *name) {
     DIR *dp = opendir(d);
     if (dp == NULL) {
         fprintf(stderr, "Error opening directory: %s\n", d);
@@ -319,294 +1440,470 @@ static void recursive_list_dir(char* d, struct array *arr) {
         if (strcmp(ep->d_name, "..") == 0)
             continue;
         struct stat cst;
-        int ret;
         char blob[PATH_MAX];
+        char rel[PATH_MAX];
         sprintf(blob, "%s/%s", d, ep->d_name);
-        if ((ret = lstat(blob, &cst))) {
+        sprintf(rel, "%s%s", name, ep->d_name);
+        if (lstat(blob, &cst)) {
             fprintf(stderr, "Error opening: %s\n", ep->d_name);
             continue;
         }
-
         if (S_ISDIR(cst.st_mode)) {
-            recursive_list_dir(blob, arr);
+            strcat(rel, "/");
+            verify_dir(queue, blob, rel);
             continue;
         }
 
-        array_add(arr, strdup(blob));
+        // temporary blobs and the index are not blobs
+        struct VERIFY_JOB *job = malloc(sizeof(struct VERIFY_JOB));
+        assert(job != NULL);
+        if (parse_blob_name(rel, job->digest, &job->codec)) {
+            free(job);
+            continue;
+        }
+        job->path = strdup(blob);
+        // only fails once cancelled
+        if (work_queue_push(queue, job))
+            break;
     }
     closedir(dp);
 }
 
+// report every file in the manifest whose content is corrupt or missing
+// from the store. returns the number of such files, or -1 if the
+// manifest itself could not be read.
+static int verify_manifest(struct VERIFY_CONTEXT *context, const char *manifest, unsigned long *missing_count) {
+    struct DEDUPE_MANIFEST_READER reader;
+    struct DEDUPE_MANIFEST_ENTRY entry;
+    if (manifest_open(&reader, manifest)) {
+        fprintf(stderr, "Unable to open input manifest %s\n", manifest);
+        return -1;
+    }
+
+    int bad = 0;
+    int ret;
+    while ((ret = manifest_next(&reader, &entry)) > 0) {
+        if (entry.type != 'f')
+            continue;
+        unsigned int count = entry.chunk_count > 0 ? entry.chunk_count : 1;
+        unsigned int c;
+        for (c = 0; c < count; c++) {
+            const unsigned char *digest = entry.chunk_count > 0 ? entry.chunks[c].digest : entry.digest;
+            int codec = entry.chunk_count > 0 ? entry.chunks[c].codec : entry.codec;
+            char key[BLOB_NAME_MAX];
+            if (codec > DEDUPE_CODEC_ZLIB || !digest_set_contains(&context->present[codec], digest)) {
+                int corrupt = digest_set_contains(&context->corrupt, digest);
+                blob_name(digest, codec, key);
+                printf("%s: %s/%s referenced by %s: %s\n", corrupt ? "Corrupt" : "Missing",
+                        context->blob_dir, key, manifest, entry.path);
+                if (!corrupt)
+                    (*missing_count)++;
+                bad++;
+                break;
+            }
+        }
+    }
+    manifest_close(&reader);
+    if (ret < 0) {
+        fprintf(stderr, "Corrupt manifest: %s\n", manifest);
+        return -1;
+    }
+    return bad;
+}
+
 static int check_file(const char* f) {
     struct stat cst;
     return lstat(f, &cst);
 }
 
-int dedupe_main(int argc, char** argv) {
-    if (argc < 3) {
-        usage(argv);
+
+void dedupe_init(struct DEDUPE_CONTEXT *dedupe) {
+    memset(dedupe, 0, sizeof(*dedupe));
+    dedupe->copy_method = DEDUPE_COPY_AUTO;
+}
+
+static int thread_count(struct DEDUPE_CONTEXT *dedupe) {
+    return dedupe->threads > 0 ? dedupe->threads : default_thread_count();
+}
+
+int dedupe_store(struct DEDUPE_CONTEXT *dedupe, const char *input_dir, const char *blob_dir, const char *output_manifest) {
+    struct DEDUPE_STORE_CONTEXT context;
+    struct STAT_CACHE stat_cache;
+    struct stat st;
+    int ret;
+    if (0 != (ret = lstat(input_dir, &st))) {
+        fprintf(stderr, "Error opening input_file/input_directory.\n");
+        return ret;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s must be a directory.\n", input_dir);
         return 1;
     }
 
-    if (strcmp(argv[1], "c") == 0) {
-        if (argc < 5) {
-            usage(argv);
-            return 1;
-        }
+    context.dedupe = dedupe;
+    context.compress = dedupe->compress;
+    context.chunking = dedupe->chunking;
+    context.threads = thread_count(dedupe);
+    context.excludes = dedupe->excludes;
+    context.exclude_count = dedupe->exclude_count;
+    context.reused_count = 0;
+    context.index = NULL;
+    if (context.chunking)
+        pthread_once(&gear_once, gear_init);
+
+    if (realpath(input_dir, context.input_dir) == NULL) {
+        fprintf(stderr, "Unable to resolve %s\n", input_dir);
+        return 1;
+    }
+    mkdir(blob_dir, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (realpath(blob_dir, context.blob_dir) == NULL) {
+        fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir);
+        return 1;
+    }
+    if (manifest_writer_open(&context.output_manifest, output_manifest)) {
+        fprintf(stderr, "Unable to open output file %s\n", output_manifest);
+        return 1;
+    }
 
-        struct stat st;
-        int ret;
-        if (0 != (ret = lstat(argv[2], &st))) {
-            fprintf(stderr, "Error opening input_file/input_directory.\n");
-            return ret;
-        }
+    stat_cache_init(&stat_cache);
+    context.stat_cache = &stat_cache;
+    // a missing reference only means everything gets hashed
+    if (dedupe->reference_manifest != NULL)
+        stat_cache_load(&stat_cache, dedupe->reference_manifest);
+
+    struct BLOB_INDEX index;
+    blob_index_init(&index, context.blob_dir);
+    context.index = blob_index_load(&index) ? NULL : &index;
+
+    start_workers(&context);
+    ret = store_dir(&context, st, ".");
+    int failure = finish_workers(&context);
+    if (manifest_writer_close(&context.output_manifest) && !failure) {
+        fprintf(stderr, "Error writing manifest %s\n", output_manifest);
+        failure = 1;
+    }
+    if (dedupe->cancel) {
+        fprintf(stderr, "Cancelled\n");
+        // it may have come after the last file was read
+        if (ret == 0)
+            ret = ECANCELED;
+    }
+    // a manifest missing files must not pass for a backup
+    if (ret || failure)
+        unlink(output_manifest);
+
+    // only a cache, a stale or missing index costs a stat per blob
+    if (context.index != NULL && blob_index_save(context.index))
+        fprintf(stderr, "Unable to save the blob index\n");
+    blob_index_free(&index);
+    if (stat_cache.count > 0)
+        fprintf(stderr, "Reused %d unchanged files from the reference manifest.\n", context.reused_count);
+    stat_cache_free(&stat_cache);
+    return ret ? ret : failure;
+}
 
-        if (!S_ISDIR(st.st_mode)) {
-            fprintf(stderr, "%s must be a directory.\n", argv[2]);
-            return 1;
-        }
+int dedupe_manifest_size(const char *manifest, unsigned long *files, unsigned long long *bytes) {
+    struct DEDUPE_MANIFEST_READER reader;
+    struct DEDUPE_MANIFEST_ENTRY entry;
+    int ret;
+    *files = 0;
+    *bytes = 0;
+    if (manifest_open(&reader, manifest))
+        return 1;
+    while ((ret = manifest_next(&reader, &entry)) > 0) {
+        (*files)++;
+        if (entry.type == 'f')
+            *bytes += entry.size;
+    }
+    manifest_close(&reader);
+    return ret < 0;
+}
 
-        struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        fprintf(context.output_manifest, "dedupe\t%d\n", DEDUPE_VERSION);
-        if (context.output_manifest == NULL) {
-            fprintf(stderr, "Unable to open output file %s\n", argv[4]);
-            return 1;
+int dedupe_manifest_present(const char *manifest, const char *blob_dir, unsigned long long *bytes, unsigned long long *present) {
+    struct DEDUPE_MANIFEST_READER reader;
+    struct DEDUPE_MANIFEST_ENTRY entry;
+    struct BLOB_INDEX index;
+    char real_blob_dir[PATH_MAX];
+    off_t size;
+    int ret;
+    *bytes = 0;
+    *present = 0;
+    if (realpath(blob_dir, real_blob_dir) == NULL || manifest_open(&reader, manifest))
+        return 1;
+    blob_index_init(&index, real_blob_dir);
+    if (blob_index_load(&index)) {
+        blob_index_free(&index);
+        manifest_close(&reader);
+        return 1;
+    }
+    while ((ret = manifest_next(&reader, &entry)) > 0) {
+        unsigned int c;
+        if (entry.type != 'f')
+            continue;
+        *bytes += entry.size;
+        if (entry.chunk_count == 0 && blob_index_lookup(&index, entry.digest, entry.codec, &size))
+            *present += entry.size;
+        for (c = 0; c < entry.chunk_count; c++) {
+            if (blob_index_lookup(&index, entry.chunks[c].digest, entry.chunks[c].codec, &size))
+                *present += entry.chunks[c].length;
         }
-        mkdir(argv[3], S_IRWXU | S_IRWXG | S_IRWXO);
-        realpath(argv[3], context.blob_dir);
-        chdir(argv[2]);
-        context.excludes = argv + 5;
-        context.exclude_count = argc - 5;
+    }
+    blob_index_free(&index);
+    manifest_close(&reader);
+    return ret < 0;
+}
 
-        return store_dir(&context, st, ".");
+int dedupe_restore(struct DEDUPE_CONTEXT *dedupe, const char *manifest, const char *blob_dir, const char *output_dir) {
+    struct RESTORE_CONTEXT context;
+    struct DEDUPE_MANIFEST_READER input_manifest;
+    context.dedupe = dedupe;
+    context.copy_method = dedupe->copy_method;
+    if (manifest_open(&input_manifest, manifest)) {
+        fprintf(stderr, "Unable to open input manifest %s\n", manifest);
+        return 1;
+    }
+    if (realpath(blob_dir, context.blob_dir) == NULL) {
+        fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir);
+        manifest_close(&input_manifest);
+        return 1;
     }
-    else if (strcmp(argv[1], "x") == 0) {
-        if (argc != 5) {
-            usage(argv);
-            return 1;
-        }
 
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
-            return 1;
-        }
+    int cwd = open(".", O_RDONLY);
+    if (cwd < 0) {
+        fprintf(stderr, "Unable to open the current directory\n");
+        manifest_close(&input_manifest);
+        return 1;
+    }
+    report_progress(dedupe, output_dir, 0);
+    mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
+    if (chdir(output_dir)) {
+        fprintf(stderr, "Unable to open output directory %s\n", output_dir);
+        manifest_close(&input_manifest);
+        close(cwd);
+        return 1;
+    }
 
-        char blob_dir[PATH_MAX];
-        char *output_dir = argv[4];
-        realpath(argv[3], blob_dir);
+    pthread_mutex_init(&context.lock, NULL);
+    int ret = restore_manifest(&input_manifest, &context, thread_count(dedupe));
+    pthread_mutex_destroy(&context.lock);
+    manifest_close(&input_manifest);
+    fchdir(cwd);
+    close(cwd);
+    if (dedupe->cancel)
+        fprintf(stderr, "Cancelled\n");
+    if (ret)
+        fprintf(stderr, "Error restoring %s\n", manifest);
+    return ret;
+}
 
-        printf("%s\n" , output_dir);
-        mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
-        if (chdir(output_dir)) {
-            fprintf(stderr, "Unable to open output directory %s\n", output_dir);
+int dedupe_gc(struct DEDUPE_CONTEXT *dedupe, const char *blob_dir_path, const char **manifests, int manifest_count) {
+    struct GC_CONTEXT gc;
+    memset(&gc, 0, sizeof(gc));
+    gc.dedupe = dedupe;
+    gc.dry_run = dedupe->dry_run;
+
+    char blob_dir[PATH_MAX];
+    if (realpath(blob_dir_path, blob_dir) == NULL || check_file(blob_dir)) {
+        fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir_path);
+        return 1;
+    }
+
+    // mark
+    digest_set_init(&gc.used, DIGEST_SET_CAPACITY);
+    int i;
+    for (i = 0; i < manifest_count; i++) {
+        struct DEDUPE_MANIFEST_READER input_manifest;
+        struct DEDUPE_MANIFEST_ENTRY entry;
+        if (manifest_open(&input_manifest, manifests[i])) {
+            fprintf(stderr, "Unable to open input manifest %s\n", manifests[i]);
+            digest_set_free(&gc.used);
             return 1;
         }
 
-        char line[PATH_MAX];
-        fgets(line, PATH_MAX, input_manifest);
-        int version = 1;
-        if (sscanf(line, "dedupe\t%d", &version) != 1) {
-            fseek(input_manifest, 0, SEEK_SET);
+        int ret;
+        while ((ret = manifest_next(&input_manifest, &entry)) > 0) {
+            if (entry.type != 'f')
+                continue;
+            if (entry.chunk_count == 0)
+                digest_set_add(&gc.used, entry.digest);
+            unsigned int c;
+            for (c = 0; c < entry.chunk_count; c++)
+                digest_set_add(&gc.used, entry.chunks[c].digest);
         }
-        if (version > DEDUPE_VERSION) {
-            fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", argv[2]);
+        manifest_close(&input_manifest);
+        // never delete anything based on a partially read manifest
+        if (ret < 0) {
+            fprintf(stderr, "Corrupt manifest: %s\n", manifests[i]);
+            digest_set_free(&gc.used);
             return 1;
         }
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char at[32];
-            char mt[32];
-            char ct[32];
-            char filename[PATH_MAX];
-
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            if (version >= 2) {
-                token = tokenize(at, token, '\t');
-                token = tokenize(mt, token, '\t');
-                token = tokenize(ct, token, '\t');
-            }
-            token = tokenize(filename, token, '\t');
-
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            //printf("%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, filename);
-            printf("%s\n", filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                // printf("%s\t%d\n", sha256, size);
-
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(blob_file, filename)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
+    }
 
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                // printf("%s\n", link);
+    // sweep
+    gc_dir(&gc, blob_dir, "");
+    digest_set_free(&gc.used);
 
-                symlink(link, filename);
+    fprintf(stderr, "%s %lu of %lu blobs, %llu bytes.\n", gc.dry_run ? "Reclaimable:" : "Reclaimed:",
+            gc.unused_count, gc.blob_count, gc.unused_bytes);
+    dedupe->files = gc.unused_count;
+    dedupe->bytes = gc.unused_bytes;
+    return dedupe->cancel ? ECANCELED : 0;
+}
 
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                // printf("\n");
+int dedupe_verify(struct DEDUPE_CONTEXT *dedupe, const char *blob_dir, const char **manifests, int manifest_count) {
+    struct VERIFY_CONTEXT context;
+    int threads = thread_count(dedupe);
+    memset(&context, 0, sizeof(context));
+    context.dedupe = dedupe;
+    context.rate = dedupe->rate_limit;
+
+    if (realpath(blob_dir, context.blob_dir) == NULL || check_file(context.blob_dir)) {
+        fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir);
+        return 1;
+    }
 
-                mkdir(filename, mode_oct);
+    pthread_mutex_init(&context.lock, NULL);
+    digest_set_init(&context.present[DEDUPE_CODEC_NONE], DIGEST_SET_CAPACITY);
+    digest_set_init(&context.present[DEDUPE_CODEC_ZLIB], DIGEST_SET_CAPACITY);
+    digest_set_init(&context.corrupt, DIGEST_SET_CAPACITY);
+    clock_gettime(CLOCK_MONOTONIC, &context.start);
+
+    struct WORK_QUEUE queue;
+    work_queue_start(&queue, threads, threads * 64, verify_blob, &context);
+    verify_dir(&queue, context.blob_dir, "");
+    int failure = work_queue_finish(&queue);
+
+    unsigned long bad_files = 0;
+    unsigned long missing_count = 0;
+    if (context.corrupt_count > 0)
+        failure = 1;
+    int i;
+    for (i = 0; i < manifest_count && !dedupe->cancel; i++) {
+        int bad = verify_manifest(&context, manifests[i], &missing_count);
+        if (bad != 0)
+            failure = 1;
+        if (bad > 0)
+            bad_files += bad;
+    }
 
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
-            }
-            if (version >= 2) {
-                struct timeval times[2];
-                times[0].tv_sec = atol(at);
-                times[1].tv_sec = atol(mt);
-                utimes(filename, times);
-            }
-        }
+    fprintf(stderr, "Verified %lu blobs, %llu bytes: %lu corrupt, %lu missing, %lu damaged files.\n",
+            context.blob_count, context.bytes, context.corrupt_count, missing_count, bad_files);
+    digest_set_free(&context.present[DEDUPE_CODEC_NONE]);
+    digest_set_free(&context.present[DEDUPE_CODEC_ZLIB]);
+    digest_set_free(&context.corrupt);
+    pthread_mutex_destroy(&context.lock);
+    return failure;
+}
 
-        fclose(input_manifest);
-        return 0;
+static void print_path(const char *path, void *cookie) {
+    printf("%s\n", path);
+}
+
+int dedupe_main(int argc, char** argv) {
+    if (argc < 3) {
+        usage(argv);
+        return 1;
     }
-    else if (strcmp(argv[1], "gc") == 0) {
-        if (argc < 3) {
+
+    struct DEDUPE_CONTEXT dedupe;
+    dedupe_init(&dedupe);
+    dedupe.callback = print_path;
+    int opt;
+    optind = 2;
+
+    if (strcmp(argv[1], "c") == 0) {
+        while ((opt = getopt(argc, argv, "+j:r:zc")) != -1) {
+            switch (opt) {
+                case 'z':
+                    dedupe.compress = Z_BEST_SPEED;
+                    break;
+                case 'c':
+                    dedupe.chunking = 1;
+                    break;
+                case 'j':
+                    dedupe.threads = atoi(optarg);
+                    break;
+                case 'r':
+                    dedupe.reference_manifest = optarg;
+                    break;
+                default:
+                    usage(argv);
+                    return 1;
+            }
+        }
+        if (argc - optind < 3) {
             usage(argv);
             return 1;
         }
-        
-        char blob_dir[PATH_MAX];
-        realpath(argv[2], blob_dir);
-        if (check_file(blob_dir)) {
-            fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir);
+        dedupe.excludes = (const char**)(argv + optind + 3);
+        dedupe.exclude_count = argc - optind - 3;
+        return dedupe_store(&dedupe, argv[optind], argv[optind + 1], argv[optind + 2]);
+    }
+    else if (strcmp(argv[1], "x") == 0) {
+        while ((opt = getopt(argc, argv, "+j:m:")) != -1) {
+            switch (opt) {
+                case 'j':
+                    dedupe.threads = atoi(optarg);
+                    break;
+                case 'm':
+                    if (strcmp(optarg, "auto") == 0)
+                        dedupe.copy_method = DEDUPE_COPY_AUTO;
+                    else if (strcmp(optarg, "copy") == 0)
+                        dedupe.copy_method = DEDUPE_COPY_BUFFERED;
+                    else if (strcmp(optarg, "link") == 0)
+                        dedupe.copy_method = DEDUPE_COPY_LINK;
+                    else {
+                        usage(argv);
+                        return 1;
+                    }
+                    break;
+                default:
+                    usage(argv);
+                    return 1;
+            }
+        }
+        if (argc - optind != 3) {
+            usage(argv);
             return 1;
         }
-
-        struct array used_files;
-        struct array all_files;
-        array_init(&used_files, ARRAY_CAPACITY);
-        array_init(&all_files, ARRAY_CAPACITY);
-
-        char blob[PATH_MAX];
-        int i;
-        int failure = 0;
-        for (i = 3; i < argc; i++) {
-            FILE *input_manifest = fopen(argv[i], "rb");
-            if (input_manifest == NULL) {
-                fprintf(stderr, "Unable to open input manifest %s\n", argv[i]);
-                failure = 1;
-                goto out;
-            }
-
-            char line[PATH_MAX];
-            fgets(line, PATH_MAX, input_manifest);
-            int version = 1;
-            if (sscanf(line, "dedupe\t%d", &version) != 1) {
-                fseek(input_manifest, 0, SEEK_SET);
-            }
-            if (version > DEDUPE_VERSION) {
-                fprintf(stderr, "Attempting to gc newer dedupe file: %s\n", argv[2]);
-                failure = 1;
-                fclose(input_manifest);
-                break;
-            }
-            while (fgets(line, PATH_MAX, input_manifest)) {
-                char type[4];
-                char mode[8];
-                char uid[32];
-                char gid[32];
-                char at[32];
-                char mt[32];
-                char ct[32];
-                char filename[PATH_MAX];
-
-                char *token = line;
-                token = tokenize(type, token, '\t');
-                token = tokenize(mode, token, '\t');
-                token = tokenize(uid, token, '\t');
-                token = tokenize(gid, token, '\t');
-                if (version >= 2) {
-                    token = tokenize(at, token, '\t');
-                    token = tokenize(mt, token, '\t');
-                    token = tokenize(ct, token, '\t');
-                }
-                token = tokenize(filename, token, '\t');
-
-                int mode_oct = dec_to_oct(atoi(mode));
-                int uid_int = atoi(uid);
-                int gid_int = atoi(gid);
-                int ret;
-                // printf("%s\n", filename);
-                if (strcmp(type, "f") == 0) {
-                    char key[128];
-                    token = tokenize(key, token, '\t');
-                    char sizeStr[32];
-                    token = tokenize(sizeStr, token, '\t');
-                    int size = atoi(sizeStr);
-
-                    sprintf(blob, "%s/%s", blob_dir, key);
-                    array_add(&used_files, strdup(blob));
-                }
+        return dedupe_restore(&dedupe, argv[optind], argv[optind + 1], argv[optind + 2]);
+    }
+    else if (strcmp(argv[1], "gc") == 0) {
+        while ((opt = getopt(argc, argv, "+n")) != -1) {
+            switch (opt) {
+                case 'n':
+                    dedupe.dry_run = 1;
+                    break;
+                default:
+                    usage(argv);
+                    return 1;
             }
-            fclose(input_manifest);
         }
-
-        recursive_list_dir(blob_dir, &all_files);
-
-        qsort(used_files.data, used_files.size, sizeof(void*), string_compare);
-        qsort(all_files.data, all_files.size, sizeof(void*), string_compare);
-
-        // Search for unused files
-        int j = 0;
-        for (i = 0; i < all_files.size; i++) {
-            int cmp;
-            while (j < used_files.size &&
-                (cmp = strcmp(used_files.data[j], all_files.data[i])) < 0) {
-                j++;
-            }
-
-            if (cmp > 0 || j >= used_files.size) {
-                if (remove(all_files.data[i])) {
-                    fprintf(stderr, "Error removing: %s\n", all_files.data[i]);
-                }
-                printf("Delete: %s\n", all_files.data[i]);
+        if (argc - optind < 1) {
+            usage(argv);
+            return 1;
+        }
+        return dedupe_gc(&dedupe, argv[optind], (const char**)(argv + optind + 1), argc - optind - 1);
+    }
+    else if (strcmp(argv[1], "verify") == 0) {
+        while ((opt = getopt(argc, argv, "+j:l:")) != -1) {
+            switch (opt) {
+                case 'j':
+                    dedupe.threads = atoi(optarg);
+                    break;
+                case 'l':
+                    dedupe.rate_limit = strtoull(optarg, NULL, 10) * 1024;
+                    break;
+                default:
+                    usage(argv);
+                    return 1;
             }
         }
-
-        out:
-        array_free(&used_files, 1);
-        array_free(&all_files, 1);
-
-        return failure;
+        if (argc - optind < 1) {
+            usage(argv);
+            return 1;
+        }
+        return dedupe_verify(&dedupe, argv[optind], (const char**)(argv + optind + 1), argc - optind - 1);
     }
     else {
         usage(argv);
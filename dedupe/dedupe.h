@@ -1,6 +1,68 @@
 #ifndef DEDUPE_H
 #define DEDUPE_H
 
+// how restore materializes a file from its blob
+enum {
+    // reflink, then an in-kernel copy, then a buffered copy
+    DEDUPE_COPY_AUTO,
+    // the plain read/write loop only
+    DEDUPE_COPY_BUFFERED,
+    // hardlink to the blob when it is on the same filesystem and already
+    // has the file's owner, mode and mtime, otherwise copy as AUTO does.
+    // a linked file shares its inode with the blob, so this is opt-in.
+    DEDUPE_COPY_LINK,
+};
+
+// called once for every path stored or restored. calls never overlap,
+// but may come from a worker thread.
+typedef void (*dedupe_progress_callback)(const char *path, void *cookie);
+
+// options and progress of one dedupe operation. set it up with
+// dedupe_init, then change whatever differs from the defaults.
+struct DEDUPE_CONTEXT {
+    // worker threads, 0 for one per cpu
+    int threads;
+    // store: zlib level for compressible blobs, 0 stores everything raw
+    int compress;
+    // store: split large files into content defined chunks
+    int chunking;
+    // store: manifest of an earlier backup of the same tree, whose keys
+    // are reused for unchanged files. may be NULL.
+    const char *reference_manifest;
+    // store: paths to skip, relative to the input directory ("./media")
+    const char **excludes;
+    int exclude_count;
+    // restore: one of DEDUPE_COPY_*
+    int copy_method;
+    // gc: only report what would be removed
+    int dry_run;
+    // verify: bytes per second to hash, 0 for no limit
+    unsigned long long rate_limit;
+
+    dedupe_progress_callback callback;
+    void *cookie;
+
+    // updated as files are stored or restored. gc: the blobs removed, or
+    // with dry_run the blobs that would be
+    volatile unsigned long long bytes;
+    volatile unsigned long files;
+    // set from any thread (or the callback) to stop early. the
+    // operation then fails.
+    volatile int cancel;
+};
+
+void dedupe_init(struct DEDUPE_CONTEXT *dedupe);
+int dedupe_store(struct DEDUPE_CONTEXT *dedupe, const char *input_dir, const char *blob_dir, const char *output_manifest);
+int dedupe_restore(struct DEDUPE_CONTEXT *dedupe, const char *input_manifest, const char *blob_dir, const char *output_dir);
+int dedupe_gc(struct DEDUPE_CONTEXT *dedupe, const char *blob_dir, const char **manifests, int manifest_count);
+int dedupe_verify(struct DEDUPE_CONTEXT *dedupe, const char *blob_dir, const char **manifests, int manifest_count);
+// count the entries of a manifest and add up the file sizes, without
+// touching the blobs. cheap enough to size a progress bar with.
+int dedupe_manifest_size(const char *manifest, unsigned long *files, unsigned long long *bytes);
+// add up the file data of a manifest, and how much of it the blob store
+// still holds. an unchanged tree stored again only writes the rest.
+int dedupe_manifest_present(const char *manifest, const char *blob_dir, unsigned long long *bytes, unsigned long long *present);
+
 int dedupe_main(int argc, char** argv);
 
-#endif
\ No newline at end of file
+#endif
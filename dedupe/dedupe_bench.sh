@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# Times dedupe restores with each copy method.  Run it once with the
+# scratch directory on ext4 and once on tmpfs (or on the sdcard and
+# /data of a device) to compare reflink/copy_file_range/sendfile,
+# the buffered loop and hardlinks.
+#
+# usage: dedupe_bench.sh dedupe_binary scratch_dir [source_dir]
+#
+# Without a source_dir a synthetic tree of small and large files is
+# generated.  Everything under scratch_dir/dedupe_bench is removed.
+
+DEDUPE=$1
+SCRATCH=$2/dedupe_bench
+SOURCE=$3
+
+if [ -z "$DEDUPE" -o -z "$2" ]; then
+  echo "usage: $0 dedupe_binary scratch_dir [source_dir]"
+  exit 1
+fi
+
+rm -rf $SCRATCH
+mkdir -p $SCRATCH || exit 1
+
+if [ -z "$SOURCE" ]; then
+  SOURCE=$SCRATCH/source
+  for d in 0 1 2 3 4 5 6 7; do
+    mkdir -p $SOURCE/small/$d
+    for f in $(seq 1 250); do
+      head -c $((RANDOM % 16384 + 1)) /dev/urandom > $SOURCE/small/$d/$f
+    done
+  done
+  mkdir -p $SOURCE/large
+  for f in 1 2 3 4; do
+    head -c $((64 * 1024 * 1024)) /dev/urandom > $SOURCE/large/$f
+  done
+fi
+
+# seconds elapsed running the rest of the arguments
+timed() {
+  local start=$(date +%s.%N)
+  "$@" > /dev/null || echo "FAIL: $*" 1>&2
+  local end=$(date +%s.%N)
+  awk "BEGIN { print $end - $start }"
+}
+
+echo "source:  $SOURCE"
+echo "scratch: $SCRATCH ($(stat -f -c %T $SCRATCH))"
+echo "backup:        $(timed $DEDUPE c $SOURCE $SCRATCH/blobs $SCRATCH/bench.dup)s"
+
+for method in copy auto link; do
+  sync
+  echo 3 > /proc/sys/vm/drop_caches 2> /dev/null
+  echo "restore $method: $(timed $DEDUPE x -m $method $SCRATCH/bench.dup $SCRATCH/blobs $SCRATCH/restore.$method)s"
+  diff -r $SOURCE $SCRATCH/restore.$method > /dev/null || echo "FAIL: restore.$method differs"
+  rm -rf $SCRATCH/restore.$method
+done
+
+# gc must keep the blobs of hidden manifests, like the
+# .android_secure.vfat.dup of a nandroid backup
+mkdir -p $SCRATCH/backup/1
+mv $SCRATCH/bench.dup $SCRATCH/backup/1/.android_secure.vfat.dup
+$DEDUPE gc $SCRATCH/blobs $(find $SCRATCH/backup -name '*.dup') > /dev/null || echo "FAIL: gc"
+$DEDUPE x $SCRATCH/backup/1/.android_secure.vfat.dup $SCRATCH/blobs $SCRATCH/restore.gc > /dev/null
+diff -r $SOURCE $SCRATCH/restore.gc > /dev/null || echo "FAIL: gc removed blobs of a hidden manifest"
+rm -rf $SCRATCH/restore.gc
+
+# many workers storing into an empty blob directory race to create the
+# same fan-out directories
+for i in $(seq 1 10); do
+  rm -rf $SCRATCH/blobs.j
+  $DEDUPE c -j 16 $SOURCE $SCRATCH/blobs.j $SCRATCH/jobs.dup > /dev/null || echo "FAIL: store -j 16 run $i"
+  $DEDUPE x $SCRATCH/jobs.dup $SCRATCH/blobs.j $SCRATCH/restore.j > /dev/null
+  diff -r $SOURCE $SCRATCH/restore.j > /dev/null || echo "FAIL: restore of store -j 16 run $i differs"
+  rm -rf $SCRATCH/restore.j
+done
+
+rm -rf $SCRATCH
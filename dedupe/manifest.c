@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+
+#define STRINGS_INITIAL_CAPACITY (64 * 1024)
+
+void blob_name(const unsigned char *digest, int codec, char *name) {
+    char psum[SHA256_DIGEST_LENGTH * 2 + 1];
+    int j;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
+        sprintf(&psum[(j*2)], "%02x", (int)digest[j]);
+    memcpy(name, psum, 3);
+    name[3] = '/';
+    strcpy(name + 4, psum + 3);
+    if (codec == DEDUPE_CODEC_ZLIB)
+        strcat(name, ".z");
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int parse_blob_name(const char *name, unsigned char *digest, int *codec) {
+    int nibbles = 0;
+    for (; *name && nibbles < SHA256_DIGEST_LENGTH * 2; name++) {
+        if (*name == '/')
+            continue;
+        int v = hex_value(*name);
+        if (v < 0)
+            return -1;
+        if (nibbles % 2 == 0)
+            digest[nibbles / 2] = v << 4;
+        else
+            digest[nibbles / 2] |= v;
+        nibbles++;
+    }
+    if (nibbles != SHA256_DIGEST_LENGTH * 2)
+        return -1;
+
+    int c;
+    if (*name == '\0')
+        c = DEDUPE_CODEC_NONE;
+    else if (strcmp(name, ".z") == 0)
+        c = DEDUPE_CODEC_ZLIB;
+    else
+        return -1;
+    if (codec != NULL)
+        *codec = c;
+    return 0;
+}
+
+// split the next tab separated field off the line in place
+static char* next_field(char **line) {
+    if (*line == NULL)
+        return NULL;
+    char *field = *line;
+    char *tab = strchr(field, '\t');
+    if (tab == NULL) {
+        *line = NULL;
+        return NULL;
+    }
+    *tab = '\0';
+    *line = tab + 1;
+    return field;
+}
+
+static int dec_to_oct(int dec) {
+    int ret = 0;
+    int mult = 1;
+    while (dec != 0) {
+        int rem = dec % 10;
+        ret += (rem * mult);
+        dec /= 10;
+        mult *= 8;
+    }
+
+    return ret;
+}
+
+static int open_text(struct DEDUPE_MANIFEST_READER *reader, const char *filename) {
+    reader->file = fopen(filename, "rb");
+    if (reader->file == NULL)
+        return -1;
+
+    reader->version = 1;
+    if (fgets(reader->line, sizeof(reader->line), reader->file) == NULL ||
+            sscanf(reader->line, "dedupe\t%d", &reader->version) != 1) {
+        fseek(reader->file, 0, SEEK_SET);
+    }
+    return 0;
+}
+
+static int open_binary(struct DEDUPE_MANIFEST_READER *reader, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct DEDUPE_MANIFEST_HEADER)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const struct DEDUPE_MANIFEST_HEADER *header = map;
+    uint64_t records_end = header->records_offset + (uint64_t)header->record_size * header->record_count;
+    if (header->record_size < sizeof(struct DEDUPE_MANIFEST_RECORD) ||
+            records_end > (uint64_t)st.st_size ||
+            header->strings_offset + header->strings_size > (uint64_t)st.st_size) {
+        fprintf(stderr, "Corrupt manifest: %s\n", filename);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    reader->map = map;
+    reader->map_size = st.st_size;
+    reader->header = header;
+    reader->next_record = 0;
+    // hint the kernel that the records are about to be walked front to back
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+int manifest_open(struct DEDUPE_MANIFEST_READER *reader, const char *filename) {
+    memset(reader, 0, sizeof(*reader));
+
+    char magic[sizeof(((struct DEDUPE_MANIFEST_HEADER*)0)->magic)];
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open manifest %s\n", filename);
+        return -1;
+    }
+    size_t magic_size = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+
+    int ret;
+    // text manifests are never empty or start with a NUL, a binary one
+    // that was never finished is or does
+    if (magic_size == 0 || magic[0] == '\0') {
+        fprintf(stderr, "Manifest is incomplete: %s\n", filename);
+        return -1;
+    }
+    if (magic_size == sizeof(magic) && memcmp(magic, DEDUPE_MANIFEST_MAGIC, strlen(DEDUPE_MANIFEST_MAGIC)) == 0) {
+        reader->version = DEDUPE_VERSION;
+        ret = open_binary(reader, filename);
+    }
+    else {
+        ret = open_text(reader, filename);
+        if (ret == 0 && reader->version > DEDUPE_VERSION) {
+            fprintf(stderr, "Manifest is from a newer dedupe: %s\n", filename);
+            manifest_close(reader);
+            return -1;
+        }
+    }
+    if (ret)
+        fprintf(stderr, "Unable to open manifest %s\n", filename);
+    return ret;
+}
+
+static const char* string_at(struct DEDUPE_MANIFEST_READER *reader, uint32_t offset, uint32_t length) {
+    const struct DEDUPE_MANIFEST_HEADER *header = reader->header;
+    if ((uint64_t)offset + length >= header->strings_size)
+        return NULL;
+    const char *s = (const char*)reader->map + header->strings_offset + offset;
+    // strings are stored NUL terminated so they can be used in place
+    if (s[length] != '\0')
+        return NULL;
+    return s;
+}
+
+static const void* data_at(struct DEDUPE_MANIFEST_READER *reader, uint32_t offset, uint32_t length) {
+    const struct DEDUPE_MANIFEST_HEADER *header = reader->header;
+    if ((uint64_t)offset + length > header->strings_size || offset % 8 != 0)
+        return NULL;
+    return reader->map + header->strings_offset + offset;
+}
+
+static int next_binary(struct DEDUPE_MANIFEST_READER *reader, struct DEDUPE_MANIFEST_ENTRY *entry) {
+    const struct DEDUPE_MANIFEST_HEADER *header = reader->header;
+    if (reader->next_record >= header->record_count)
+        return 0;
+
+    const struct DEDUPE_MANIFEST_RECORD *r = (const struct DEDUPE_MANIFEST_RECORD*)
+        (reader->map + header->records_offset + (uint64_t)header->record_size * reader->next_record);
+    reader->next_record++;
+
+    entry->type = r->type;
+    entry->mode = r->mode;
+    entry->uid = r->uid;
+    entry->gid = r->gid;
+    entry->atime = r->atime;
+    entry->mtime = r->mtime;
+    entry->ctime = r->ctime;
+    entry->size = r->size;
+    entry->ino = r->ino;
+    entry->codec = r->codec;
+    memcpy(entry->digest, r->digest, SHA256_DIGEST_LENGTH);
+    entry->path = string_at(reader, r->path_offset, r->path_length);
+    entry->link = NULL;
+    entry->chunks = NULL;
+    entry->chunk_count = 0;
+    if (entry->path == NULL)
+        return -1;
+    if (entry->type == 'f' && (r->flags & DEDUPE_FLAG_CHUNKED)) {
+        entry->chunks = data_at(reader, r->data_offset, r->data_length);
+        entry->chunk_count = r->data_length / sizeof(struct DEDUPE_MANIFEST_CHUNK);
+        if (entry->chunks == NULL)
+            return -1;
+    }
+    if (entry->type == 'l' && (entry->link = string_at(reader, r->data_offset, r->data_length)) == NULL)
+        return -1;
+    return 1;
+}
+
+static int next_text(struct DEDUPE_MANIFEST_READER *reader, struct DEDUPE_MANIFEST_ENTRY *entry) {
+    if (fgets(reader->line, sizeof(reader->line), reader->file) == NULL)
+        return 0;
+    // text manifests predate chunking
+    entry->chunks = NULL;
+    entry->chunk_count = 0;
+
+    char *line = reader->line;
+    char *type = next_field(&line);
+    char *mode = next_field(&line);
+    char *uid = next_field(&line);
+    char *gid = next_field(&line);
+    char *at = "0";
+    char *mt = "0";
+    char *ct = "0";
+    if (reader->version >= 2) {
+        at = next_field(&line);
+        mt = next_field(&line);
+        ct = next_field(&line);
+    }
+    char *filename = next_field(&line);
+    if (filename == NULL || at == NULL || mt == NULL || ct == NULL || strlen(filename) >= PATH_MAX)
+        return -1;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->type = type[0];
+    entry->mode = dec_to_oct(atoi(mode));
+    entry->uid = atoi(uid);
+    entry->gid = atoi(gid);
+    entry->atime = atol(at);
+    entry->mtime = atol(mt);
+    entry->ctime = atol(ct);
+    strcpy(reader->path, filename);
+    entry->path = reader->path;
+
+    if (entry->type == 'f') {
+        char *key = next_field(&line);
+        char *size = next_field(&line);
+        if (size == NULL || parse_blob_name(key, entry->digest, NULL))
+            return -1;
+        entry->size = strtoull(size, NULL, 10);
+    }
+    else if (entry->type == 'l') {
+        char *link = next_field(&line);
+        if (link == NULL || strlen(link) >= PATH_MAX)
+            return -1;
+        strcpy(reader->link, link);
+        entry->link = reader->link;
+    }
+    return 1;
+}
+
+int manifest_next(struct DEDUPE_MANIFEST_READER *reader, struct DEDUPE_MANIFEST_ENTRY *entry) {
+    if (reader->map != NULL)
+        return next_binary(reader, entry);
+    return next_text(reader, entry);
+}
+
+void manifest_rewind(struct DEDUPE_MANIFEST_READER *reader) {
+    if (reader->map != NULL) {
+        reader->next_record = 0;
+        return;
+    }
+    fseek(reader->file, 0, SEEK_SET);
+    if (reader->version >= 2)
+        fgets(reader->line, sizeof(reader->line), reader->file);
+}
+
+void manifest_close(struct DEDUPE_MANIFEST_READER *reader) {
+    if (reader->map != NULL)
+        munmap((void*)reader->map, reader->map_size);
+    if (reader->file != NULL)
+        fclose(reader->file);
+    reader->map = NULL;
+    reader->file = NULL;
+}
+
+int manifest_writer_open(struct DEDUPE_MANIFEST_WRITER *writer, const char *filename) {
+    memset(writer, 0, sizeof(*writer));
+    writer->file = fopen(filename, "wb");
+    if (writer->file == NULL)
+        return -1;
+
+    writer->header.record_size = sizeof(struct DEDUPE_MANIFEST_RECORD);
+    writer->header.records_offset = sizeof(struct DEDUPE_MANIFEST_HEADER);
+    // the real header, magic and all, is written once the record count
+    // is known. until then the zeroed magic marks the file incomplete.
+    if (fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1) {
+        fclose(writer->file);
+        writer->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t add_bytes(struct DEDUPE_MANIFEST_WRITER *writer, const void *data, size_t len) {
+    if (writer->strings_size + len > writer->strings_capacity) {
+        size_t capacity = writer->strings_capacity ? writer->strings_capacity : STRINGS_INITIAL_CAPACITY;
+        while (writer->strings_size + len > capacity)
+            capacity *= 2;
+        char *strings = realloc(writer->strings, capacity);
+        if (strings == NULL)
+            return UINT32_MAX;
+        writer->strings = strings;
+        writer->strings_capacity = capacity;
+    }
+    uint32_t offset = writer->strings_size;
+    memcpy(writer->strings + offset, data, len);
+    writer->strings_size += len;
+    return offset;
+}
+
+static uint32_t add_string(struct DEDUPE_MANIFEST_WRITER *writer, const char *s, uint32_t *length) {
+    *length = strlen(s);
+    return add_bytes(writer, s, *length + 1);
+}
+
+static uint32_t add_data(struct DEDUPE_MANIFEST_WRITER *writer, const void *data, uint32_t length) {
+    static const char padding[8];
+    while (writer->strings_size % 8 != 0) {
+        if (add_bytes(writer, padding, 1) == UINT32_MAX)
+            return UINT32_MAX;
+    }
+    return add_bytes(writer, data, length);
+}
+
+int manifest_write(struct DEDUPE_MANIFEST_WRITER *writer, const struct DEDUPE_MANIFEST_ENTRY *entry) {
+    struct DEDUPE_MANIFEST_RECORD r;
+    memset(&r, 0, sizeof(r));
+    r.type = entry->type;
+    r.mode = entry->mode;
+    r.uid = entry->uid;
+    r.gid = entry->gid;
+    r.atime = entry->atime;
+    r.mtime = entry->mtime;
+    r.ctime = entry->ctime;
+    r.size = entry->size;
+    r.ino = entry->ino;
+    r.codec = entry->codec;
+    memcpy(r.digest, entry->digest, SHA256_DIGEST_LENGTH);
+    if ((r.path_offset = add_string(writer, entry->path, &r.path_length)) == UINT32_MAX)
+        return -1;
+    if (entry->type == 'l' && (r.data_offset = add_string(writer, entry->link, &r.data_length)) == UINT32_MAX)
+        return -1;
+    if (entry->type == 'f' && entry->chunk_count > 0) {
+        r.flags |= DEDUPE_FLAG_CHUNKED;
+        r.data_length = entry->chunk_count * sizeof(struct DEDUPE_MANIFEST_CHUNK);
+        if ((r.data_offset = add_data(writer, entry->chunks, r.data_length)) == UINT32_MAX)
+            return -1;
+    }
+
+    if (fwrite(&r, sizeof(r), 1, writer->file) != 1)
+        return -1;
+    writer->header.record_count++;
+    return 0;
+}
+
+int manifest_writer_close(struct DEDUPE_MANIFEST_WRITER *writer) {
+    int ret = 0;
+    writer->header.strings_offset = writer->header.records_offset +
+        (uint64_t)writer->header.record_size * writer->header.record_count;
+    writer->header.strings_size = writer->strings_size;
+    memcpy(writer->header.magic, DEDUPE_MANIFEST_MAGIC, strlen(DEDUPE_MANIFEST_MAGIC));
+    if (writer->strings_size > 0 &&
+            fwrite(writer->strings, writer->strings_size, 1, writer->file) != 1)
+        ret = -1;
+    if (fseek(writer->file, 0, SEEK_SET) ||
+            fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1)
+        ret = -1;
+    if (fclose(writer->file))
+        ret = -1;
+    free(writer->strings);
+    writer->strings = NULL;
+    writer->file = NULL;
+    return ret;
+}
@@ -0,0 +1,130 @@
+#ifndef DEDUPE_MANIFEST_H
+#define DEDUPE_MANIFEST_H
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+#define DEDUPE_VERSION 3
+
+// version 3 manifests are binary:
+//   header, record_count fixed width records, string table
+// all integers are little endian. strings (paths, symlink targets) live
+// in the string table, are NUL terminated, and are referenced from the
+// records by offset and length. file contents are referenced by their
+// raw sha256 digest.
+#define DEDUPE_MANIFEST_MAGIC "dedupe\t3\n"
+
+// how a blob is stored. the codec is part of the blob's file name.
+#define DEDUPE_CODEC_NONE 0
+#define DEDUPE_CODEC_ZLIB 1
+
+// record flags
+// the file is stored as a list of content defined chunks, each its own
+// blob. the record's digest is still that of the whole file.
+#define DEDUPE_FLAG_CHUNKED 1
+
+struct DEDUPE_MANIFEST_HEADER {
+    char magic[16];
+    uint32_t record_size;
+    uint32_t record_count;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint8_t reserved[16];
+};
+
+struct DEDUPE_MANIFEST_RECORD {
+    uint8_t type;
+    uint8_t codec;
+    uint16_t flags;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t size;
+    uint64_t ino;
+    uint32_t path_offset;
+    uint32_t path_length;
+    uint32_t data_offset;
+    uint32_t data_length;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+};
+
+// chunk lists are stored in the string table, 8 byte aligned.
+struct DEDUPE_MANIFEST_CHUNK {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    uint32_t length;
+    uint8_t codec;
+    uint8_t reserved[3];
+};
+
+// a manifest entry as handed out by the reader, whatever the version.
+// path and link point into reader owned memory and are only valid until
+// the next call to manifest_next.
+struct DEDUPE_MANIFEST_ENTRY {
+    char type;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    long atime;
+    long mtime;
+    long ctime;
+    unsigned long long size;
+    unsigned long long ino;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    unsigned char codec;
+    const char *path;
+    const char *link;
+    // chunked files only
+    const struct DEDUPE_MANIFEST_CHUNK *chunks;
+    unsigned int chunk_count;
+};
+
+struct DEDUPE_MANIFEST_READER {
+    int version;
+    // versions 1 and 2
+    FILE *file;
+    char line[PATH_MAX * 2];
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+    // version 3
+    const unsigned char *map;
+    size_t map_size;
+    const struct DEDUPE_MANIFEST_HEADER *header;
+    uint32_t next_record;
+};
+
+struct DEDUPE_MANIFEST_WRITER {
+    FILE *file;
+    struct DEDUPE_MANIFEST_HEADER header;
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+};
+
+// returns 0 on success. fails on unreadable or newer manifests.
+int manifest_open(struct DEDUPE_MANIFEST_READER *reader, const char *filename);
+// returns 1 and fills entry, 0 at the end of the manifest, -1 on a corrupt manifest.
+int manifest_next(struct DEDUPE_MANIFEST_READER *reader, struct DEDUPE_MANIFEST_ENTRY *entry);
+void manifest_rewind(struct DEDUPE_MANIFEST_READER *reader);
+void manifest_close(struct DEDUPE_MANIFEST_READER *reader);
+
+int manifest_writer_open(struct DEDUPE_MANIFEST_WRITER *writer, const char *filename);
+int manifest_write(struct DEDUPE_MANIFEST_WRITER *writer, const struct DEDUPE_MANIFEST_ENTRY *entry);
+// writes out the string table and header. returns 0 on success.
+int manifest_writer_close(struct DEDUPE_MANIFEST_WRITER *writer);
+
+// blob names are the hex digest with a slash after the third character,
+// abc/defg..., to stay clear of the vfat directory size limit.
+// compressed blobs have a suffix naming the codec, abc/defg....z
+#define BLOB_NAME_MAX (SHA256_DIGEST_LENGTH * 2 + 8)
+void blob_name(const unsigned char *digest, int codec, char *name);
+// parses a blob name back into its digest and codec, ignoring slashes.
+// returns 0 on success. codec may be NULL.
+int parse_blob_name(const char *name, unsigned char *digest, int *codec);
+
+#endif
@@ -0,0 +1,106 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "workqueue.h"
+
+int default_thread_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+static void record_failure(struct WORK_QUEUE *queue, int ret) {
+    if (ret && !queue->failure)
+        queue->failure = ret;
+}
+
+static void* work_queue_thread(void *cookie) {
+    struct WORK_QUEUE *queue = (struct WORK_QUEUE*)cookie;
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        while (queue->count == 0 && !queue->shutdown)
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        if (queue->count == 0)
+            break;
+        void *job = queue->jobs[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
+
+        int ret = queue->func(job, queue->cookie);
+
+        pthread_mutex_lock(&queue->lock);
+        record_failure(queue, ret);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+void work_queue_start(struct WORK_QUEUE *queue, int threads, int capacity, work_func func, void *cookie) {
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    queue->capacity = capacity;
+    queue->jobs = malloc(sizeof(void*) * capacity);
+    assert(queue->jobs != NULL);
+    queue->head = 0;
+    queue->count = 0;
+    queue->shutdown = 0;
+    queue->failure = 0;
+    queue->func = func;
+    queue->cookie = cookie;
+    queue->threads = NULL;
+    queue->thread_count = 0;
+    if (threads <= 1)
+        return;
+
+    queue->threads = malloc(sizeof(pthread_t) * threads);
+    assert(queue->threads != NULL);
+    int i;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&queue->threads[i], NULL, work_queue_thread, queue)) {
+            fprintf(stderr, "Unable to start worker thread, continuing with %d.\n", i);
+            break;
+        }
+    }
+    queue->thread_count = i;
+}
+
+int work_queue_push(struct WORK_QUEUE *queue, void *job) {
+    int ret;
+    if (queue->thread_count == 0) {
+        record_failure(queue, queue->func(job, queue->cookie));
+        return queue->failure;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    ret = queue->failure;
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+int work_queue_finish(struct WORK_QUEUE *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->shutdown = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+
+    int i;
+    for (i = 0; i < queue->thread_count; i++)
+        pthread_join(queue->threads[i], NULL);
+    free(queue->threads);
+    free(queue->jobs);
+    queue->threads = NULL;
+    queue->jobs = NULL;
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    return queue->failure;
+}
@@ -0,0 +1,36 @@
+#ifndef DEDUPE_WORKQUEUE_H
+#define DEDUPE_WORKQUEUE_H
+
+#include <pthread.h>
+
+// runs one job, returns 0 on success. the job is owned by the callee.
+typedef int (*work_func)(void *job, void *cookie);
+
+// a bounded queue of jobs serviced by a fixed pool of threads.
+// with a single thread, jobs run inline on the caller's thread.
+struct WORK_QUEUE {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void **jobs;
+    int capacity;
+    int head;
+    int count;
+    int shutdown;
+    int failure;
+    work_func func;
+    void *cookie;
+    pthread_t *threads;
+    int thread_count;
+};
+
+void work_queue_start(struct WORK_QUEUE *queue, int threads, int capacity, work_func func, void *cookie);
+// blocks while the queue is full. returns the first failure so far, so
+// the producer can stop early.
+int work_queue_push(struct WORK_QUEUE *queue, void *job);
+// runs the remaining jobs, stops the threads and returns the first failure.
+int work_queue_finish(struct WORK_QUEUE *queue);
+
+int default_thread_count();
+
+#endif
@@ -4,7 +4,7 @@ ifneq ($(TARGET_SIMULATOR),true)
 ifeq ($(TARGET_ARCH),arm)
 
 include $(CLEAR_VARS)
-LOCAL_SRC_FILES := flashutils.c
+LOCAL_SRC_FILES := flashutils.c sparse.c
 LOCAL_MODULE := libflashutils
 LOCAL_MODULE_TAGS := optional
 LOCAL_C_INCLUDES += bootable/recovery
@@ -8,6 +8,15 @@ int erase_partition(const char *partition, const char *filesystem);
 int mount_partition(const char *partition, const char *mount_point, const char *filesystem, int read_only);
 int get_partition_device(const char *partition, char *device);
 
+// raw images of block devices in Android's sparse format (sparse.c)
+int backup_sparse_partition(const char *partition, const char *filename);
+int restore_sparse_partition(const char *partition, const char *filename);
+int is_sparse_image(const char *filename);
+// only the blocks an ext4 filesystem has in use, from its block bitmaps.
+// the filesystem must not change meanwhile. returns 1 if the partition
+// does not hold an ext4 filesystem this can read.
+int backup_sparse_ext4(const char *partition, const char *filename);
+
 #define FLASH_MTD 0
 #define FLASH_MMC 1
 #define FLASH_BML 2
@@ -0,0 +1,564 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flashutils/flashutils.h"
+#include "mmcutils/mmcutils.h"
+
+// Android's sparse image format, as written by make_ext4fs and read by
+// fastboot and simg2img. Runs of blocks that hold a single repeated
+// 32 bit value (zeroed emmc, 0xff filled padding) become one small fill
+// chunk, everything else is stored as raw chunks.
+
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define CHUNK_TYPE_RAW 0xCAC1
+#define CHUNK_TYPE_FILL 0xCAC2
+#define CHUNK_TYPE_DONT_CARE 0xCAC3
+#define CHUNK_TYPE_CRC32 0xCAC4
+
+// restore writes fill chunks and copies raw ones this many bytes at a time
+#define SPARSE_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} sparse_header_t;
+
+typedef struct {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;
+    uint32_t total_sz;
+} chunk_header_t;
+
+static int read_all(int fd, void *data, size_t len)
+{
+    char *p = (char *) data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_chunk_header(int fd, uint16_t type, uint32_t blocks, uint32_t data_size)
+{
+    chunk_header_t chunk;
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.chunk_type = type;
+    chunk.chunk_sz = blocks;
+    chunk.total_sz = sizeof(chunk) + data_size;
+    return write_all(fd, &chunk, sizeof(chunk));
+}
+
+// the value a block is filled with, or -1 if it holds anything else
+static int64_t block_fill_value(const char *block, uint32_t size)
+{
+    const uint32_t *words = (const uint32_t *) block;
+    uint32_t i;
+    for (i = 1; i < size / sizeof(uint32_t); i++) {
+        if (words[i] != words[0])
+            return -1;
+    }
+    return words[0];
+}
+
+int is_sparse_image(const char *filename)
+{
+    sparse_header_t header;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    int ret = read_all(fd, &header, sizeof(header)) == 0 && header.magic == SPARSE_HEADER_MAGIC;
+    close(fd);
+    return ret;
+}
+
+struct sparse_writer {
+    int out;
+    sparse_header_t header;
+    // the fill run in progress, which may span buffers
+    int64_t fill;
+    uint32_t fill_blocks;
+    // blocks classified so far
+    uint32_t blocks;
+};
+
+static int write_fill_chunk(struct sparse_writer *w)
+{
+    uint32_t fill_value = w->fill;
+    uint32_t blocks = w->fill_blocks;
+    w->header.total_chunks++;
+    w->fill = -1;
+    w->fill_blocks = 0;
+    return write_chunk_header(w->out, CHUNK_TYPE_FILL, blocks, sizeof(fill_value)) ||
+            write_all(w->out, &fill_value, sizeof(fill_value));
+}
+
+static int write_dont_care_chunk(struct sparse_writer *w, uint32_t blocks)
+{
+    if (w->fill >= 0 && write_fill_chunk(w))
+        return -1;
+    if (blocks > w->header.total_blks - w->blocks)
+        return -1;
+    w->blocks += blocks;
+    w->header.total_chunks++;
+    return write_chunk_header(w->out, CHUNK_TYPE_DONT_CARE, blocks, 0);
+}
+
+static int sparse_writer_open(struct sparse_writer *w, const char *filename, uint32_t block_size, uint32_t blocks)
+{
+    memset(w, 0, sizeof(*w));
+    w->out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (w->out < 0) {
+        printf("error opening %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    w->header.magic = SPARSE_HEADER_MAGIC;
+    w->header.major_version = 1;
+    w->header.minor_version = 0;
+    w->header.file_hdr_sz = sizeof(sparse_header_t);
+    w->header.chunk_hdr_sz = sizeof(chunk_header_t);
+    w->header.blk_sz = block_size;
+    w->header.total_blks = blocks;
+    w->fill = -1;
+    if (write_all(w->out, &w->header, sizeof(w->header))) {
+        printf("error writing %s\n", filename);
+        close(w->out);
+        unlink(filename);
+        return -1;
+    }
+    return 0;
+}
+
+// ends the last chunk and puts the counts in the header. the image is
+// removed if anything went wrong.
+static int sparse_writer_close(struct sparse_writer *w, const char *filename, int ret)
+{
+    if (ret == 0 && w->fill >= 0)
+        ret = write_fill_chunk(w);
+    if (ret == 0 && w->blocks != w->header.total_blks)
+        ret = -1;
+    // now that the chunks are counted
+    if (ret == 0 && (lseek(w->out, 0, SEEK_SET) != 0 || write_all(w->out, &w->header, sizeof(w->header))))
+        ret = -1;
+    if (close(w->out) || ret) {
+        printf("error writing %s\n", filename);
+        unlink(filename);
+        return -1;
+    }
+    return 0;
+}
+
+// turns the partition into chunks as the raw copy reads it. every
+// buffer but the last is a whole number of blocks.
+static int write_sparse_blocks(const char *buffer, size_t len, void *cookie)
+{
+    struct sparse_writer *w = (struct sparse_writer *) cookie;
+    uint32_t blocks = len / w->header.blk_sz;
+    uint32_t i = 0;
+    if (len % w->header.blk_sz || blocks > w->header.total_blks - w->blocks)
+        return -1;
+    w->blocks += blocks;
+    while (i < blocks) {
+        int64_t value = block_fill_value(buffer + i * w->header.blk_sz, w->header.blk_sz);
+        if (value >= 0 && (w->fill < 0 || value == w->fill)) {
+            w->fill = value;
+            w->fill_blocks++;
+            i++;
+            continue;
+        }
+        if (w->fill >= 0) {
+            if (write_fill_chunk(w))
+                return -1;
+            continue;
+        }
+        // raw blocks, up to the next fill block or the end of the buffer
+        uint32_t start = i;
+        while (i < blocks && block_fill_value(buffer + i * w->header.blk_sz, w->header.blk_sz) < 0)
+            i++;
+        w->header.total_chunks++;
+        if (write_chunk_header(w->out, CHUNK_TYPE_RAW, i - start, (i - start) * w->header.blk_sz) ||
+                write_all(w->out, buffer + start * w->header.blk_sz, (i - start) * w->header.blk_sz))
+            return -1;
+    }
+    return 0;
+}
+
+int backup_sparse_partition(const char *partition, const char *filename)
+{
+    struct sparse_writer w;
+    int in = open(partition, O_RDONLY);
+    if (in < 0) {
+        printf("error opening %s: %s\n", partition, strerror(errno));
+        return -1;
+    }
+    off_t size = lseek(in, 0, SEEK_END);
+    close(in);
+    if (size <= 0 || size % 512) {
+        printf("can't get the size of %s\n", partition);
+        return -1;
+    }
+    uint32_t block_size = size % 4096 == 0 ? 4096 : 512;
+    if (sparse_writer_open(&w, filename, block_size, size / block_size))
+        return -1;
+    // the partition is read on a thread of its own, in large direct
+    // reads, while the chunks are written out here
+    int ret = mmc_copy_file(partition, NULL, 1, write_sparse_blocks, &w);
+    if (ret == 0 && w.blocks != w.header.total_blks) {
+        printf("error reading %s\n", partition);
+        ret = -1;
+    }
+    return sparse_writer_close(&w, filename, ret);
+}
+
+// ext4, as far as finding the blocks in use goes
+#define EXT4_SUPER_MAGIC 0xEF53
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_BIGALLOC 0x0200
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+
+static uint32_t le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// whether a block group starts with a copy of the superblock and the
+// group descriptors: all of them, or with sparse_super groups 0, 1 and
+// powers of 3, 5 and 7
+static int ext4_group_has_super(uint32_t group, int sparse_super)
+{
+    static const uint32_t bases[] = { 3, 5, 7 };
+    int i;
+    if (!sparse_super || group <= 1)
+        return 1;
+    for (i = 0; i < 3; i++) {
+        uint64_t n = bases[i];
+        while (n < group)
+            n *= bases[i];
+        if (n == group)
+            return 1;
+    }
+    return 0;
+}
+
+static void mark_blocks(unsigned char *used, uint64_t blocks, uint64_t start, uint64_t count)
+{
+    for (; count > 0 && start < blocks; start++, count--)
+        used[start / 8] |= 1 << (start % 8);
+}
+
+static int pread_all(int fd, void *data, size_t len, off_t offset)
+{
+    char *p = (char *) data;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// the blocks of the filesystem that are in use, one bit each, from the
+// block bitmaps. the bitmaps of uninitialized groups are not read, only
+// the backup superblock and descriptors those groups may hold are in
+// use there. the group metadata is marked from the descriptors too.
+static unsigned char *ext4_used_blocks(int fd, const unsigned char *sb, uint64_t *total, uint32_t *block_size)
+{
+    uint32_t incompat = le32(sb + 96);
+    uint32_t ro_compat = le32(sb + 100);
+    uint32_t log_block_size = le32(sb + 24);
+    uint64_t blocks = le32(sb + 4);
+    uint32_t first_data_block = le32(sb + 20);
+    uint32_t blocks_per_group = le32(sb + 32);
+    uint32_t inodes_per_group = le32(sb + 40);
+    uint32_t inode_size = le32(sb + 76) >= 1 ? le16(sb + 88) : 128;
+    uint32_t reserved_gdt = le16(sb + 206);
+    uint32_t desc_size = 32;
+    if (incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        blocks |= (uint64_t) le32(sb + 336) << 32;
+        if (le16(sb + 254) > desc_size)
+            desc_size = le16(sb + 254);
+    }
+    if (log_block_size > 6 || (incompat & EXT4_FEATURE_INCOMPAT_META_BG) ||
+            (ro_compat & EXT4_FEATURE_RO_COMPAT_BIGALLOC)) {
+        printf("unsupported ext4 features\n");
+        return NULL;
+    }
+    uint32_t bs = 1024 << log_block_size;
+    if (blocks_per_group == 0 || blocks_per_group > 8 * bs || blocks <= first_data_block || blocks > UINT32_MAX) {
+        printf("bad ext4 superblock\n");
+        return NULL;
+    }
+    uint32_t groups = (blocks - first_data_block + blocks_per_group - 1) / blocks_per_group;
+    uint32_t gdt_blocks = ((uint64_t) groups * desc_size + bs - 1) / bs;
+    uint64_t inode_table_blocks = ((uint64_t) inodes_per_group * inode_size + bs - 1) / bs;
+
+    unsigned char *descs = malloc((size_t) gdt_blocks * bs);
+    unsigned char *bitmap = malloc(bs);
+    unsigned char *used = calloc(1, (blocks + 7) / 8);
+    if (descs == NULL || bitmap == NULL || used == NULL ||
+            pread_all(fd, descs, (size_t) gdt_blocks * bs, (off_t) (first_data_block + 1) * bs)) {
+        printf("error reading the ext4 group descriptors\n");
+        goto ERROR;
+    }
+    // the boot block, the superblock and the descriptors
+    mark_blocks(used, blocks, 0, first_data_block + 1 + gdt_blocks + reserved_gdt);
+
+    uint32_t g;
+    for (g = 0; g < groups; g++) {
+        const unsigned char *d = descs + (size_t) g * desc_size;
+        uint64_t block_bitmap = le32(d);
+        uint64_t inode_bitmap = le32(d + 4);
+        uint64_t inode_table = le32(d + 8);
+        if (desc_size >= 64) {
+            block_bitmap |= (uint64_t) le32(d + 32) << 32;
+            inode_bitmap |= (uint64_t) le32(d + 36) << 32;
+            inode_table |= (uint64_t) le32(d + 40) << 32;
+        }
+        uint64_t start = first_data_block + (uint64_t) g * blocks_per_group;
+        uint64_t count = blocks - start < blocks_per_group ? blocks - start : blocks_per_group;
+        if (le16(d + 18) & EXT4_BG_BLOCK_UNINIT) {
+            if (ext4_group_has_super(g, ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER))
+                mark_blocks(used, blocks, start, 1 + gdt_blocks + reserved_gdt);
+        }
+        else {
+            uint64_t i;
+            if (block_bitmap >= blocks || pread_all(fd, bitmap, bs, (off_t) block_bitmap * bs)) {
+                printf("error reading the block bitmap of group %u\n", g);
+                goto ERROR;
+            }
+            for (i = 0; i < count; i++) {
+                if (bitmap[i / 8] & (1 << (i % 8)))
+                    mark_blocks(used, blocks, start + i, 1);
+            }
+        }
+        mark_blocks(used, blocks, block_bitmap, 1);
+        mark_blocks(used, blocks, inode_bitmap, 1);
+        mark_blocks(used, blocks, inode_table, inode_table_blocks);
+    }
+    free(descs);
+    free(bitmap);
+    *total = blocks;
+    *block_size = bs;
+    return used;
+
+ERROR:
+    free(descs);
+    free(bitmap);
+    free(used);
+    return NULL;
+}
+
+int backup_sparse_ext4(const char *partition, const char *filename)
+{
+    struct sparse_writer w;
+    unsigned char sb[1024];
+    uint64_t blocks;
+    uint32_t block_size;
+    int fd = open(partition, O_RDONLY);
+    if (fd < 0) {
+        printf("error opening %s: %s\n", partition, strerror(errno));
+        return -1;
+    }
+    if (pread_all(fd, sb, sizeof(sb), 1024) || le16(sb + 56) != EXT4_SUPER_MAGIC) {
+        printf("%s is not ext4\n", partition);
+        close(fd);
+        return 1;
+    }
+    unsigned char *used = ext4_used_blocks(fd, sb, &blocks, &block_size);
+    if (used == NULL) {
+        close(fd);
+        return 1;
+    }
+    // the image covers the whole partition, past the filesystem too
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t) (blocks * block_size) || size / block_size > UINT32_MAX) {
+        printf("%s is smaller than its filesystem\n", partition);
+        free(used);
+        close(fd);
+        return -1;
+    }
+    uint64_t total = size / block_size;
+    char *buffer = malloc(SPARSE_BUFFER_SIZE);
+    if (buffer == NULL || sparse_writer_open(&w, filename, block_size, total)) {
+        free(buffer);
+        free(used);
+        close(fd);
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    // runs of blocks in use are read and stored, a buffer at a time,
+    // the free ones in between are left out
+    uint64_t b = 0;
+    int ret = 0;
+    while (ret == 0 && b < total) {
+        int in_use = b < blocks && (used[b / 8] & (1 << (b % 8)));
+        uint64_t end = b + 1;
+        while (end < total && (end < blocks && (used[end / 8] & (1 << (end % 8)))) == in_use &&
+                (!in_use || (end - b) * block_size < SPARSE_BUFFER_SIZE))
+            end++;
+        if (!in_use) {
+            ret = write_dont_care_chunk(&w, end - b);
+        }
+        else if (pread_all(fd, buffer, (end - b) * block_size, (off_t) (b * block_size))) {
+            printf("error reading %s\n", partition);
+            ret = -1;
+        }
+        else {
+            ret = write_sparse_blocks(buffer, (end - b) * block_size, &w);
+        }
+        b = end;
+    }
+    free(buffer);
+    free(used);
+    close(fd);
+    return sparse_writer_close(&w, filename, ret);
+}
+
+int restore_sparse_partition(const char *partition, const char *filename)
+{
+    sparse_header_t header;
+    chunk_header_t chunk;
+    int in = open(filename, O_RDONLY);
+    if (in < 0) {
+        printf("error opening %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (read_all(in, &header, sizeof(header)) || header.magic != SPARSE_HEADER_MAGIC ||
+            header.major_version != 1 || header.file_hdr_sz < sizeof(header) ||
+            header.chunk_hdr_sz < sizeof(chunk) || header.blk_sz == 0 || header.blk_sz % 4 ||
+            lseek(in, header.file_hdr_sz, SEEK_SET) != header.file_hdr_sz) {
+        printf("%s is not a sparse image\n", filename);
+        close(in);
+        return -1;
+    }
+    // nothing is written unless the whole image fits
+    int probe = open(partition, O_RDONLY);
+    off_t size = probe < 0 ? -1 : lseek(probe, 0, SEEK_END);
+    if (probe >= 0)
+        close(probe);
+    if (size < 0 || (uint64_t) header.total_blks * header.blk_sz > (uint64_t) size) {
+        printf("%s does not fit on %s\n", filename, partition);
+        close(in);
+        return -1;
+    }
+    int out = open(partition, O_WRONLY);
+    if (out < 0) {
+        printf("error opening %s: %s\n", partition, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    char *buffer = malloc(SPARSE_BUFFER_SIZE);
+    uint32_t blocks = 0;
+    uint32_t i;
+    int ret = buffer == NULL ? -1 : 0;
+    for (i = 0; ret == 0 && i < header.total_chunks; i++) {
+        if (read_all(in, &chunk, sizeof(chunk)) ||
+                lseek(in, header.chunk_hdr_sz - sizeof(chunk), SEEK_CUR) < 0 ||
+                chunk.chunk_sz > header.total_blks - blocks) {
+            ret = -1;
+            break;
+        }
+        uint64_t len = (uint64_t) chunk.chunk_sz * header.blk_sz;
+        switch (chunk.chunk_type) {
+            case CHUNK_TYPE_RAW:
+                while (ret == 0 && len > 0) {
+                    size_t n = len > SPARSE_BUFFER_SIZE ? SPARSE_BUFFER_SIZE : len;
+                    ret = read_all(in, buffer, n) || write_all(out, buffer, n) ? -1 : 0;
+                    len -= n;
+                }
+                break;
+            case CHUNK_TYPE_FILL: {
+                // written from memory, nothing more to read from the backup
+                uint32_t value;
+                size_t j;
+                if (read_all(in, &value, sizeof(value))) {
+                    ret = -1;
+                    break;
+                }
+                for (j = 0; j < SPARSE_BUFFER_SIZE / sizeof(value); j++)
+                    ((uint32_t *) buffer)[j] = value;
+                while (ret == 0 && len > 0) {
+                    size_t n = len > SPARSE_BUFFER_SIZE ? SPARSE_BUFFER_SIZE : len;
+                    ret = write_all(out, buffer, n);
+                    len -= n;
+                }
+                break;
+            }
+            case CHUNK_TYPE_DONT_CARE:
+                if (lseek(out, len, SEEK_CUR) < 0)
+                    ret = -1;
+                break;
+            case CHUNK_TYPE_CRC32:
+                if (lseek(in, chunk.total_sz - header.chunk_hdr_sz, SEEK_CUR) < 0)
+                    ret = -1;
+                break;
+            default:
+                printf("unknown chunk type 0x%04x in %s\n", chunk.chunk_type, filename);
+                ret = -1;
+                break;
+        }
+        blocks += chunk.chunk_sz;
+    }
+    if (ret == 0 && blocks != header.total_blks) {
+        printf("%s is truncated\n", filename);
+        ret = -1;
+    }
+    free(buffer);
+    close(in);
+    if (fsync(out) && ret == 0)
+        ret = -1;
+    if (close(out) && ret == 0)
+        ret = -1;
+    if (ret)
+        printf("error writing %s\n", partition);
+    return ret;
+}
@@ -33,6 +33,8 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
@@ -418,106 +420,212 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
     return rv;
 }
 
-int
-mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
+/* Raw copies of partitions and images. The input is read into a ring of
+ * large, page aligned buffers on a thread of its own while the calling
+ * thread writes the previous ones out, so the source and the target are
+ * both kept busy. Block devices are opened O_DIRECT when asked to, which
+ * keeps a whole partition from going through (and flushing) the page
+ * cache. */
+#define MMC_COPY_BUFFER_SIZE (1024 * 1024)
+#define MMC_COPY_BUFFERS 4
+#define MMC_COPY_ALIGN 4096
+
+struct MmcCopy {
+    int in;
+    char *buffers[MMC_COPY_BUFFERS];
+    ssize_t lengths[MMC_COPY_BUFFERS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    // buffers read and buffers written so far
+    unsigned filled;
+    unsigned emptied;
+    int done;
+    int failed;
+};
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+static int
+mmc_copy_open (const char *path, int flags, int direct) {
+    struct stat st;
+    int fd;
+#ifdef O_DIRECT
+    if (direct && stat(path, &st) == 0 && S_ISBLK(st.st_mode)) {
+        fd = open(path, flags | O_DIRECT, 0666);
+        if (fd >= 0)
+            return fd;
+    }
+#endif
+    return open(path, flags, 0666);
+}
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+#ifdef O_DIRECT
+// not every driver takes O_DIRECT, and the tail of an image may not be
+// a whole sector
+static int
+mmc_copy_buffered (int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || !(flags & O_DIRECT))
+        return -1;
+    return fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+}
+#endif
+
+static void *
+mmc_copy_reader (void *cookie) {
+    struct MmcCopy *c = (struct MmcCopy *) cookie;
+    for (;;) {
+        pthread_mutex_lock(&c->lock);
+        while (c->filled - c->emptied == MMC_COPY_BUFFERS && !c->failed)
+            pthread_cond_wait(&c->changed, &c->lock);
+        unsigned i = c->filled % MMC_COPY_BUFFERS;
+        int failed = c->failed;
+        pthread_mutex_unlock(&c->lock);
+        if (failed)
+            break;
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+        ssize_t length = 0;
+        while (length < MMC_COPY_BUFFER_SIZE) {
+            ssize_t n = read(c->in, c->buffers[i] + length, MMC_COPY_BUFFER_SIZE - length);
+            if (n < 0 && errno == EINTR)
+                continue;
+#ifdef O_DIRECT
+            if (n < 0 && errno == EINVAL && mmc_copy_buffered(c->in) == 0)
+                continue;
+#endif
+            if (n <= 0) {
+                if (n < 0) {
+                    printf("error reading raw image: %s\n", strerror(errno));
+                    length = -1;
+                }
+                break;
+            }
+            length += n;
+        }
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
+        pthread_mutex_lock(&c->lock);
+        if (length < 0)
+            c->failed = 1;
+        else if (length == 0)
+            c->done = 1;
+        else {
+            c->lengths[i] = length;
+            c->filled++;
+            if (length < MMC_COPY_BUFFER_SIZE)
+                c->done = 1;
         }
+        pthread_cond_broadcast(&c->changed);
+        int stop = c->done || c->failed;
+        pthread_mutex_unlock(&c->lock);
+        if (stop)
+            break;
     }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return NULL;
 }
 
+static int
+mmc_copy_write (int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+#ifdef O_DIRECT
+        if (n < 0 && errno == EINVAL && mmc_copy_buffered(fd) == 0)
+            continue;
+#endif
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
 
 int
-mmc_raw_dump_internal (const char* in_file, const char *out_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
+mmc_copy_file (const char *in_file, const char *out_file, int direct, mmc_copy_callback callback, void *cookie) {
+    struct MmcCopy c;
+    pthread_t reader;
+    int out = -1;
     int ret = -1;
+    int i;
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+    memset(&c, 0, sizeof(c));
+    c.in = mmc_copy_open(in_file, O_RDONLY, direct);
+    if (c.in < 0) {
+        printf("error opening %s: %s\n", in_file, strerror(errno));
+        return -1;
     }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
+    if (out_file != NULL) {
+        out = mmc_copy_open(out_file, O_WRONLY | O_CREAT | O_TRUNC, direct);
+        if (out < 0) {
+            printf("error opening %s: %s\n", out_file, strerror(errno));
+            close(c.in);
+            return -1;
         }
     }
+    for (i = 0; i < MMC_COPY_BUFFERS; i++) {
+        if (posix_memalign((void **) &c.buffers[i], MMC_COPY_ALIGN, MMC_COPY_BUFFER_SIZE))
+            goto ERROR;
+    }
+    pthread_mutex_init(&c.lock, NULL);
+    pthread_cond_init(&c.changed, NULL);
+    if (pthread_create(&reader, NULL, mmc_copy_reader, &c)) {
+        pthread_cond_destroy(&c.changed);
+        pthread_mutex_destroy(&c.lock);
+        goto ERROR;
+    }
 
-    fsync(out);
     ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
+    for (;;) {
+        pthread_mutex_lock(&c.lock);
+        while (c.emptied == c.filled && !c.done && !c.failed)
+            pthread_cond_wait(&c.changed, &c.lock);
+        int more = c.emptied != c.filled && !c.failed;
+        if (c.failed)
+            ret = -1;
+        pthread_mutex_unlock(&c.lock);
+        if (!more)
+            break;
+
+        unsigned b = c.emptied % MMC_COPY_BUFFERS;
+        if ((out >= 0 && mmc_copy_write(out, c.buffers[b], c.lengths[b])) ||
+                (callback != NULL && callback(c.buffers[b], c.lengths[b], cookie))) {
+            if (out >= 0)
+                printf("error writing %s: %s\n", out_file, strerror(errno));
+            ret = -1;
+        }
+
+        pthread_mutex_lock(&c.lock);
+        if (ret)
+            c.failed = 1;
+        c.emptied++;
+        pthread_cond_broadcast(&c.changed);
+        pthread_mutex_unlock(&c.lock);
+        if (ret)
+            break;
+    }
+    pthread_join(reader, NULL);
+    pthread_cond_destroy(&c.changed);
+    pthread_mutex_destroy(&c.lock);
+
+    if (out >= 0 && ret == 0 && fsync(out))
+        ret = -1;
+ERROR:
+    for (i = 0; i < MMC_COPY_BUFFERS; i++)
+        free(c.buffers[i]);
+    if (out >= 0 && close(out))
+        ret = -1;
+    close(c.in);
     return ret;
+}
+
+int
+mmc_raw_copy (const MmcPartition *partition, char *in_file) {
+    return mmc_copy_file(in_file, partition->device_index, 1, NULL, NULL);
+}
 
+
+int
+mmc_raw_dump_internal (const char* in_file, const char *out_file) {
+    return mmc_copy_file(in_file, out_file, 1, NULL, NULL);
 }
 
 // TODO: refactor this to not be a giant copy paste mess
@@ -30,6 +30,8 @@
 #ifndef MMCUTILS_H_
 #define MMCUTILS_H_
 
+#include <sys/types.h>
+
 /* Some useful define used to access the MBR/EBR table */
 #define BLOCK_SIZE                0x200
 #define TABLE_ENTRY_0             0x1BE
@@ -80,6 +82,13 @@ int mmc_format_ext3 (MmcPartition *partition);
 int mmc_mount_partition(const MmcPartition *partition, const char *mount_point, \
                         int read_only);
 int mmc_raw_copy (const MmcPartition *partition, char *in_file);
+/* Called with the data of a raw copy, in order, as it is written out.
+ * Returning nonzero stops the copy. */
+typedef int (*mmc_copy_callback)(const char *data, size_t len, void *cookie);
+/* Copy in_file to out_file in large buffers, reading and writing on two
+ * threads. out_file may be NULL when the callback consumes the data.
+ * direct opens block devices O_DIRECT. */
+int mmc_copy_file (const char *in_file, const char *out_file, int direct, mmc_copy_callback callback, void *cookie);
 int mmc_raw_read (const MmcPartition *partition, char *data, int data_size);
 int mmc_raw_write (const MmcPartition *partition, char *data, int data_size);
 
@@ -213,3 +213,40 @@ remount_read_only(const MountedVolume* volume)
                  MS_NOATIME | MS_NODEV | MS_NODIRATIME |
                  MS_RDONLY | MS_REMOUNT, 0);
 }
+
+/* Back to the flags the volume had when it was scanned, less "ro".
+ * Filesystem specific options stay as they are across a remount. */
+int
+remount_read_write(const MountedVolume* volume)
+{
+    static const struct {
+        const char *name;
+        unsigned long flag;
+    } mount_flags[] = {
+        { "nosuid", MS_NOSUID },
+        { "nodev", MS_NODEV },
+        { "noexec", MS_NOEXEC },
+        { "sync", MS_SYNCHRONOUS },
+        { "dirsync", MS_DIRSYNC },
+        { "mand", MS_MANDLOCK },
+        { "noatime", MS_NOATIME },
+        { "nodiratime", MS_NODIRATIME },
+        { NULL, 0 },
+    };
+    unsigned long flags = MS_REMOUNT;
+    const char *p = volume->flags != NULL ? volume->flags : "";
+    while (*p != '\0') {
+        size_t len = strcspn(p, ",");
+        int i;
+        for (i = 0; mount_flags[i].name != NULL; i++) {
+            if (strlen(mount_flags[i].name) == len &&
+                    strncmp(p, mount_flags[i].name, len) == 0)
+                flags |= mount_flags[i].flag;
+        }
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    return mount(volume->device, volume->mount_point, volume->filesystem,
+                 flags, 0);
+}
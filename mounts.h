@@ -35,4 +35,7 @@ int unmount_mounted_volume(const MountedVolume *volume);
 
 int remount_read_only(const MountedVolume* volume);
 
+// with the flags volume->flags lists
+int remount_read_write(const MountedVolume* volume);
+
 #endif  // MTDUTILS_MOUNTS_H_
@@ -397,6 +397,15 @@ static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
 }
 
+static int block_is_erased(const char *data, ssize_t size)
+{
+    ssize_t i;
+    for (i = 0; i < size; ++i) {
+        if (data[i] != (char) 0xff) return 0;
+    }
+    return 1;
+}
+
 static int write_block(MtdWriteContext *ctx, const char *data)
 {
     const MtdPartition *partition = ctx->partition;
@@ -433,8 +442,10 @@ static int write_block(MtdWriteContext *ctx, const char *data)
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            // an erased block already reads back as all 0xff
+            if (!block_is_erased(data, size) &&
+                (lseek(fd, pos, SEEK_SET) != pos ||
+                write(fd, data, size) != size)) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
             }
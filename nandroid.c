@@ -4,6 +4,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <linux/input.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +41,10 @@
 #include <libgen.h>
 #include "eraseandformat.h"
 #include "settingshandler.h"
+#include "dedupe/dedupe.h"
+#include "nandroid_md5.h"
+#include "nandroid_tar.h"
+#include "nandroid_incremental.h"
 
 static char forced_backup_format[5] = "";
 
@@ -133,40 +138,196 @@ static int print_and_error(const char* message) {
 
 static int nandroid_backup_bitfield = 0;
 #define NANDROID_FIELD_DEDUPE_CLEARED_SPACE 1
-static int nandroid_files_total = 0;
-static int nandroid_files_count = 0;
-static void nandroid_callback(const char* filename)
+// progress is measured in bytes of file data
+static unsigned long long nandroid_bytes_total = 0;
+static unsigned long long nandroid_bytes_done = 0;
+// partitions are backed up concurrently, all reporting to one progress bar
+static pthread_mutex_t nandroid_callback_lock = PTHREAD_MUTEX_INITIALIZER;
+static void nandroid_progress(const char* filename, unsigned long long bytes)
 {
     if (filename == NULL)
         return;
-    const char* justfile = basename(filename);
+    pthread_mutex_lock(&nandroid_callback_lock);
     char tmp[PATH_MAX];
-    strcpy(tmp, justfile);
+    path_basename(filename, tmp);
     if (tmp[strlen(tmp) - 1] == '\n')
         tmp[strlen(tmp) - 1] = NULL;
     tmp[ui_get_text_cols() - 1] = '\0';
-    nandroid_files_count++;
+    nandroid_bytes_done += bytes;
     ui_increment_frame();
     ui_nice_print("%s\n", tmp);
-    if (!ui_was_niced() && nandroid_files_total != 0)
-        ui_set_progress((float)nandroid_files_count / (float)nandroid_files_total);
+    if (!ui_was_niced() && nandroid_bytes_total != 0) {
+        // the total is an estimate
+        float progress = (float)nandroid_bytes_done / (float)nandroid_bytes_total;
+        ui_set_progress(progress < 1 ? progress : 1);
+    }
     if (!ui_was_niced())
         ui_delete_line();
+    pthread_mutex_unlock(&nandroid_callback_lock);
 }
 
-static void compute_directory_stats(const char* directory)
+static void nandroid_callback(const char* filename)
 {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "find %s | %s wc -l > /tmp/dircount", directory, strcmp(directory, "/data") == 0 && is_data_media() ? "grep -v /data/media |" : "");
-    __system(tmp);
-    char count_text[100];
-    FILE* f = fopen("/tmp/dircount", "r");
-    fread(count_text, 1, sizeof(count_text), f);
+    nandroid_progress(filename, 0);
+}
+
+/* A backup lists the partitions it has finished in nandroid.journal, and
+ * removes it once it is complete. A backup that was cut short is picked
+ * up again by the next one to the same folder, or to another folder if
+ * the user agrees: finished partitions are skipped, tar keeps the
+ * finished volumes of the partition it was in, and dedupe only stores
+ * the blobs that are not in the store yet. A backup that fails rather
+ * than being cut short marks its journal failed, and is not resumed. */
+#define NANDROID_JOURNAL "nandroid.journal"
+// set while a backup is journaled
+static char nandroid_journal[PATH_MAX] = "";
+// partitions finish on their own threads
+static pthread_mutex_t nandroid_journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void nandroid_journal_format(char* format)
+{
+    if (strlen(forced_backup_format) > 0)
+        sprintf(format, "format %s\n", forced_backup_format);
+    else
+        sprintf(format, "format %d\n", backupfmt);
+}
+
+static int nandroid_journal_begin(int resume)
+{
+    char format[PATH_MAX];
+    struct stat st;
+    if (resume && stat(nandroid_journal, &st) == 0)
+        return 0;
+    FILE* f = fopen(nandroid_journal, "w");
+    if (f == NULL) {
+        ui_print("Unable to create %s\n", nandroid_journal);
+        nandroid_journal[0] = '\0';
+        return 1;
+    }
+    nandroid_journal_format(format);
+    fputs(format, f);
     fclose(f);
-    nandroid_files_count = 0;
-    nandroid_files_total = atoi(count_text);
-    ui_reset_progress();
-    ui_show_progress(1, 0);
+    return 0;
+}
+
+static void nandroid_journal_end()
+{
+    if (nandroid_journal[0] != '\0')
+        unlink(nandroid_journal);
+    nandroid_journal[0] = '\0';
+}
+
+/* The folder still counts as unfinished, so nothing takes it for a
+ * complete backup, but it is not resumed. */
+static void nandroid_journal_fail()
+{
+    if (nandroid_journal[0] == '\0')
+        return;
+    int fd = open(nandroid_journal, O_WRONLY | O_APPEND);
+    if (fd >= 0) {
+        write(fd, "failed\n", 7);
+        fsync(fd);
+        close(fd);
+    }
+    nandroid_journal[0] = '\0';
+}
+
+static int nandroid_journal_has(const char* root)
+{
+    char line[PATH_MAX];
+    char done[PATH_MAX];
+    int found = 0;
+    if (nandroid_journal[0] == '\0')
+        return 0;
+    sprintf(done, "done %s\n", root);
+    pthread_mutex_lock(&nandroid_journal_lock);
+    FILE* f = fopen(nandroid_journal, "r");
+    if (f != NULL) {
+        while (!found && fgets(line, sizeof(line), f) != NULL)
+            found = strcmp(line, done) == 0;
+        fclose(f);
+    }
+    pthread_mutex_unlock(&nandroid_journal_lock);
+    return found;
+}
+
+static void nandroid_journal_add(const char* root)
+{
+    if (nandroid_journal[0] == '\0')
+        return;
+    // once the partition's files are on the card
+    sync();
+    pthread_mutex_lock(&nandroid_journal_lock);
+    FILE* f = fopen(nandroid_journal, "a");
+    if (f != NULL) {
+        fprintf(f, "done %s\n", root);
+        fflush(f);
+        fsync(fileno(f));
+        fclose(f);
+    }
+    pthread_mutex_unlock(&nandroid_journal_lock);
+}
+
+/* Whether the backup in folder was cut short, in the format this one
+ * would be made in. */
+static int nandroid_journal_resumable(const char* folder)
+{
+    char format[PATH_MAX];
+    char line[PATH_MAX];
+    char journal[PATH_MAX];
+    snprintf(journal, sizeof(journal), "%s/%s", folder, NANDROID_JOURNAL);
+    FILE* f = fopen(journal, "r");
+    if (f == NULL)
+        return 0;
+    nandroid_journal_format(format);
+    int resumable = fgets(line, sizeof(line), f) != NULL && strcmp(line, format) == 0;
+    while (resumable && fgets(line, sizeof(line), f) != NULL)
+        resumable = strcmp(line, "failed\n") != 0;
+    fclose(f);
+    return resumable;
+}
+
+/* The newest other backup next to backup_path that was cut short. */
+static int find_interrupted_backup(const char* backup_path, char* interrupted)
+{
+    char dir[PATH_MAX];
+    char folder[PATH_MAX];
+    char journal[PATH_MAX];
+    time_t newest = 0;
+    struct stat st;
+    path_dirname(backup_path, dir);
+    interrupted[0] = '\0';
+
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return 0;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(folder, sizeof(folder), "%s/%s", dir, de->d_name);
+        snprintf(journal, sizeof(journal), "%s/%s", folder, NANDROID_JOURNAL);
+        if (strcmp(folder, backup_path) == 0 || stat(journal, &st) != 0 ||
+                (newest != 0 && st.st_mtime <= newest) || !nandroid_journal_resumable(folder))
+            continue;
+        newest = st.st_mtime;
+        strcpy(interrupted, folder);
+    }
+    closedir(d);
+    return interrupted[0] != '\0';
+}
+
+/* Resuming into another folder puts this backup under that folder's
+ * older name, so the user decides. */
+static int confirm_resume(const char* interrupted)
+{
+    char name[PATH_MAX];
+    char resume[PATH_MAX];
+    path_basename(interrupted, name);
+    snprintf(resume, sizeof(resume), "Yes - Resume %s", name);
+    char* headers[] = { "An earlier backup was interrupted:", name, "", NULL };
+    char* items[] = { "No - Start a new backup", resume, NULL };
+    return get_menu_selection(headers, items, 0, 0) == 1;
 }
 
 typedef void (*file_event_callback)(const char* filename);
@@ -183,80 +344,328 @@ static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_fil
 
     while (fgets(tmp, PATH_MAX, fp) != NULL) {
         tmp[PATH_MAX - 1] = NULL;
-        if (callback)
-            nandroid_callback(tmp);
+        if (callback) {
+            // mkyaffs2image prints the paths it adds, relative to backup_path
+            char path[PATH_MAX];
+            struct stat st;
+            int len = strlen(tmp);
+            if (len > 0 && tmp[len - 1] == '\n')
+                tmp[len - 1] = '\0';
+            snprintf(path, sizeof(path), "%s/%s", backup_path, tmp);
+            nandroid_progress(tmp, lstat(path, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0);
+        }
     }
 
     return __pclose(fp);
 }
 
+static const char* tar_media_exclude[] = { "data/media" };
+
+static void tar_options_init(struct NANDROID_TAR_OPTIONS* options, const char* backup_path, int compress, int callback) {
+    memset(options, 0, sizeof(*options));
+    options->excludes = tar_media_exclude;
+    options->exclude_count = strcmp(backup_path, "/data") == 0 && is_data_media() ? 1 : 0;
+    options->compress = compress;
+    options->callback = callback ? nandroid_progress : NULL;
+    options->journal = nandroid_journal[0] != '\0';
+}
+
+static int tar_backup(const char* backup_path, const char* backup_file_image, int compress, int callback) {
+    struct NANDROID_TAR_OPTIONS options;
+    tar_options_init(&options, backup_path, compress, callback);
+    return nandroid_tar_backup(backup_path, backup_file_image, &options);
+}
+
 static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar ; (tar cv %s $(basename %s) | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude 'media'" : "", backup_path, backup_file_image);
+    return tar_backup(backup_path, backup_file_image, 0, callback);
+}
 
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar.\n");
-        return -1;
-    }
+static int tar_gzip_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    return tar_backup(backup_path, backup_file_image, 1, callback);
+}
 
-    while (fgets(tmp, PATH_MAX, fp) != NULL) {
-        tmp[PATH_MAX - 1] = NULL;
-        if (callback)
-            nandroid_callback(tmp);
-    }
+struct DEDUPE_PROGRESS {
+    struct DEDUPE_CONTEXT* dedupe;
+    unsigned long long reported;
+};
 
-    return __pclose(fp);
+static void dedupe_progress(const char* path, void* cookie)
+{
+    struct DEDUPE_PROGRESS* progress = (struct DEDUPE_PROGRESS*)cookie;
+    unsigned long long bytes = progress->dedupe->bytes;
+    nandroid_progress(path, bytes - progress->reported);
+    progress->reported = bytes;
 }
 
-void nandroid_dedupe_gc(const char* blob_dir) {
+/* Collect every dedupe manifest (*.dup) under dir. */
+static void find_dedupe_manifests(const char* dir, char*** manifests, int* count, int* capacity)
+{
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        // .android_secure.vfat.dup is a manifest too
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        char path[PATH_MAX];
+        struct stat st;
+        sprintf(path, "%s/%s", dir, de->d_name);
+        if (lstat(path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            find_dedupe_manifests(path, manifests, count, capacity);
+            continue;
+        }
+        int len = strlen(de->d_name);
+        if (len < 4 || strcmp(de->d_name + len - 4, ".dup") != 0)
+            continue;
+        if (*count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 32;
+            *manifests = realloc(*manifests, *capacity * sizeof(char*));
+        }
+        (*manifests)[(*count)++] = strdup(path);
+    }
+    closedir(d);
+}
+
+/* Remove the blobs no backup uses any more, or with dry_run only add
+ * them up. Returns their size. */
+static unsigned long long dedupe_gc_backups(const char* blob_dir, int dry_run) {
     char backup_dir[PATH_MAX];
-    strcpy(backup_dir, blob_dir);
-    char *d = dirname(backup_dir);
-    strcpy(backup_dir, d);
+    path_dirname(blob_dir, backup_dir);
     strcat(backup_dir, "/backup");
+
+    char** manifests = NULL;
+    int count = 0;
+    int capacity = 0;
+    find_dedupe_manifests(backup_dir, &manifests, &count, &capacity);
+
+    struct DEDUPE_CONTEXT dedupe;
+    dedupe_init(&dedupe);
+    dedupe.dry_run = dry_run;
+    int ret = dedupe_gc(&dedupe, blob_dir, (const char**)manifests, count);
+
+    int i;
+    for (i = 0; i < count; i++)
+        free(manifests[i]);
+    free(manifests);
+    return ret ? 0 : dedupe.bytes;
+}
+
+void nandroid_dedupe_gc(const char* blob_dir) {
     ui_print("Freeing space...\n");
-    char tmp[PATH_MAX];
-    sprintf(tmp, "dedupe gc %s $(find %s -name '*.dup')", blob_dir, backup_dir);
-    __system(tmp);
+    dedupe_gc_backups(blob_dir, 0);
     ui_print("Done freeing space.\n");
 }
 
-static int dedupe_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
-    char tmp[PATH_MAX];
-    char blob_dir[PATH_MAX];
-    strcpy(blob_dir, backup_file_image);
-    char *d = dirname(blob_dir);
-    strcpy(blob_dir, d);
-    d = dirname(blob_dir);
-    strcpy(blob_dir, d);
-    d = dirname(blob_dir);
-    strcpy(blob_dir, d);
+/* Find the newest backup_file_image plus extension (a dedupe manifest,
+ * an incremental list) of the same partition in the other backups next
+ * to this one, so unchanged files need not be hashed or stored again.
+ * Returns 0 and fills manifest if one was found. */
+static int find_previous_backup(const char* backup_file_image, const char* extension, char* manifest)
+{
+    char backup_dir[PATH_MAX];
+    char current[PATH_MAX];
+    char name[PATH_MAX];
+    path_basename(backup_file_image, name);
+    path_dirname(backup_file_image, current);
+    path_dirname(current, backup_dir);
+    path_basename(current, current);
+
+    DIR *dir = opendir(backup_dir);
+    if (dir == NULL)
+        return -1;
+
+    time_t newest = 0;
+    manifest[0] = '\0';
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' || strcmp(de->d_name, current) == 0)
+            continue;
+        char tmp[PATH_MAX];
+        struct stat st;
+        // an interrupted backup may hold half written files
+        sprintf(tmp, "%s/%s/%s", backup_dir, de->d_name, NANDROID_JOURNAL);
+        if (stat(tmp, &st) == 0)
+            continue;
+        sprintf(tmp, "%s/%s/%s%s", backup_dir, de->d_name, name, extension);
+        if (stat(tmp, &st) == 0 && st.st_mtime >= newest) {
+            newest = st.st_mtime;
+            strcpy(manifest, tmp);
+        }
+    }
+    closedir(dir);
+    return manifest[0] == '\0' ? -1 : 0;
+}
+
+/* The blob store shared by every backup, next to the backup folder:
+ * .../backup/<timestamp>/system.ext4 -> .../blobs */
+static void get_dedupe_blob_dir(const char* backup_file_image, char* blob_dir)
+{
+    path_dirname(backup_file_image, blob_dir);
+    path_dirname(blob_dir, blob_dir);
+    path_dirname(blob_dir, blob_dir);
     strcat(blob_dir, "/blobs");
-    ensure_directory(blob_dir);
+}
 
+/* Free the space of deleted backups, once per nandroid backup. */
+static void dedupe_clear_space(const char* blob_dir)
+{
     if (!(nandroid_backup_bitfield & NANDROID_FIELD_DEDUPE_CLEARED_SPACE)) {
         nandroid_backup_bitfield |= NANDROID_FIELD_DEDUPE_CLEARED_SPACE;
         nandroid_dedupe_gc(blob_dir);
     }
+}
 
-    sprintf(tmp, "dedupe c %s %s %s.dup %s", backup_path, blob_dir, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "./media" : "");
+/* Size the progress bar without walking the partition: the files in the
+ * last dedupe backup of it, or else the space in use on it. */
+static unsigned long long estimate_backup_bytes(const char* mount_point, const char* backup_file_image)
+{
+    char manifest[PATH_MAX];
+    unsigned long files;
+    unsigned long long bytes;
+    if (0 == find_previous_backup(backup_file_image, ".dup", manifest) &&
+            0 == dedupe_manifest_size(manifest, &files, &bytes))
+        return bytes;
+
+    // statfs describes the whole filesystem, which for .android_secure
+    // would be the whole sd card
+    Volume *v = volume_for_path(mount_point);
+    if (v == NULL || strcmp(v->mount_point, mount_point) != 0)
+        return 0;
+    struct statfs s;
+    if (0 != statfs(mount_point, &s))
+        return 0;
+    return (unsigned long long)(s.f_blocks - s.f_bfree) * s.f_bsize;
+}
 
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute dedupe.\n");
-        return -1;
+static int dedupe_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    char reference[PATH_MAX];
+    char blob_dir[PATH_MAX];
+    get_dedupe_blob_dir(backup_file_image, blob_dir);
+    ensure_directory(blob_dir);
+    dedupe_clear_space(blob_dir);
+
+    struct DEDUPE_CONTEXT dedupe;
+    dedupe_init(&dedupe);
+    // compress blobs, skipping content that already looks compressed
+    dedupe.compress = 1;
+    dedupe.chunking = 1;
+    // reuse the keys of unchanged files from the last backup of this partition
+    if (0 == find_previous_backup(backup_file_image, ".dup", reference))
+        dedupe.reference_manifest = reference;
+    const char* media_exclude[] = { "./media" };
+    if (strcmp(backup_path, "/data") == 0 && is_data_media()) {
+        dedupe.excludes = media_exclude;
+        dedupe.exclude_count = 1;
+    }
+    struct DEDUPE_PROGRESS progress = { &dedupe, 0 };
+    if (callback) {
+        dedupe.callback = dedupe_progress;
+        dedupe.cookie = &progress;
     }
 
-    while (fgets(tmp, PATH_MAX, fp) != NULL) {
-        tmp[PATH_MAX - 1] = NULL;
-        if (callback)
-            nandroid_callback(tmp);
+    sprintf(tmp, "%s.dup", backup_file_image);
+    return dedupe_store(&dedupe, backup_path, blob_dir, tmp);
+}
+
+static int incremental_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char base[PATH_MAX];
+    struct NANDROID_TAR_OPTIONS options;
+    tar_options_init(&options, backup_path, 0, callback);
+    // the chain restarts from a full backup when there is no earlier one
+    if (0 != find_previous_backup(backup_file_image, ".inc", base))
+        return nandroid_incremental_backup(backup_path, backup_file_image, NULL, &options);
+    return nandroid_incremental_backup(backup_path, backup_file_image, base, &options);
+}
+
+/* While backup jobs run, the scheduler only scans, mounts and unmounts
+ * under this lock, and so must anything else that does it then. */
+static pthread_mutex_t nandroid_mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A partition's entry in the mount table, copied out of it: the table
+ * is freed and rebuilt by every scan_mounted_volumes. */
+struct BACKUP_MOUNT {
+    char device[PATH_MAX];
+    char filesystem[PATH_MAX];
+    char flags[PATH_MAX];
+};
+
+// zeroes mount when the partition is not mounted where the fstab says
+static void get_backup_mount(const char* backup_path, struct BACKUP_MOUNT* mount)
+{
+    memset(mount, 0, sizeof(*mount));
+    Volume *v = volume_for_path(backup_path);
+    scan_mounted_volumes();
+    const MountedVolume *mv = v == NULL ? NULL : find_mounted_volume_by_mount_point(v->mount_point);
+    if (mv == NULL || strcmp(mv->mount_point, backup_path) != 0)
+        return;
+    snprintf(mount->device, sizeof(mount->device), "%s", mv->device);
+    snprintf(mount->filesystem, sizeof(mount->filesystem), "%s", mv->filesystem);
+    snprintf(mount->flags, sizeof(mount->flags), "%s", mv->flags != NULL ? mv->flags : "");
+}
+
+/* Block images of ext4 partitions: only the blocks the filesystem has
+ * in use, read in disk order rather than file by file, go into a sparse
+ * image. The partition is remounted read only while it is imaged so the
+ * image is consistent. Where that can't be done, or the filesystem is
+ * not one the block bitmaps can be read from, it falls back to tar.
+ * This runs on a backup job thread, so mount comes from the job. */
+static int ext4_image_backup(const struct BACKUP_MOUNT* mount, const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    int len = strlen(backup_path);
+    if (strcmp(mount->filesystem, "ext4") != 0 || mount->device[0] != '/' ||
+            (strcmp(backup_path, "/data") == 0 && is_data_media()) ||
+            // the image can't be written to the partition it is made of
+            (strncmp(backup_file_image, backup_path, len) == 0 && backup_file_image[len] == '/'))
+        return tar_compress_wrapper(backup_path, backup_file_image, callback);
+
+    MountedVolume volume;
+    volume.device = mount->device;
+    volume.mount_point = backup_path;
+    volume.filesystem = "ext4";
+    volume.flags = mount->flags;
+
+    unsigned long long used = estimate_backup_bytes(backup_path, backup_file_image);
+    int read_write = strncmp(mount->flags, "rw", 2) == 0;
+    sync();
+    pthread_mutex_lock(&nandroid_mounts_lock);
+    int remounted = !read_write || 0 == remount_read_only(&volume);
+    pthread_mutex_unlock(&nandroid_mounts_lock);
+    if (!remounted) {
+        printf("Unable to remount %s read only: %s\n", backup_path, strerror(errno));
+        return tar_compress_wrapper(backup_path, backup_file_image, callback);
     }
+    sprintf(tmp, "%s.simg", backup_file_image);
+    int ret = backup_sparse_ext4(mount->device, tmp);
+    // the rest of the backup, and of the session, needs it writable
+    pthread_mutex_lock(&nandroid_mounts_lock);
+    remounted = !read_write || 0 == remount_read_write(&volume);
+    pthread_mutex_unlock(&nandroid_mounts_lock);
+    if (!remounted) {
+        ui_print("Unable to remount %s read-write: %s\n", backup_path, strerror(errno));
+        return -1;
+    }
+    if (ret == 1)
+        return tar_compress_wrapper(backup_path, backup_file_image, callback);
+    if (ret == 0 && callback)
+        nandroid_progress(tmp, used);
+    return ret;
+}
 
-    return __pclose(fp);
+static int ext4_image_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    struct BACKUP_MOUNT mount;
+    get_backup_mount(backup_path, &mount);
+    return ext4_image_backup(&mount, backup_path, backup_file_image, callback);
 }
 
+/* Handlers run on backup job threads (see backup_jobs_run) while the
+ * main thread mounts and unmounts other partitions, so they must not
+ * use the mount table of mounts.c: no scan_mounted_volumes, no
+ * find_mounted_volume_* and no ensure_path_(un)mounted. What they need
+ * from it is copied into the job by backup_job_prepare. */
 typedef int (*nandroid_backup_handler)(const char* backup_path, const char* backup_file_image, int callback);
 nandroid_backup_handler default_backup_handler;
 
@@ -264,6 +673,15 @@ void nandroid_switch_backup_handler(int bfmt) {
 	if (bfmt == 0) {
 		printf("Switching to dedupe!\n");
 		default_backup_handler = dedupe_compress_wrapper;
+	} else if (bfmt == 2) {
+		printf("Switching to tar.gz!\n");
+		default_backup_handler = tar_gzip_compress_wrapper;
+	} else if (bfmt == 3) {
+		printf("Switching to incremental tar!\n");
+		default_backup_handler = incremental_compress_wrapper;
+	} else if (bfmt == 4) {
+		printf("Switching to ext4 image!\n");
+		default_backup_handler = ext4_image_compress_wrapper;
 	} else {
 		printf("Switching to tar!\n");
 		default_backup_handler = tar_compress_wrapper;
@@ -313,10 +731,222 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
     return default_backup_handler;
 }
 
+static const char* get_backup_handler_extension(nandroid_backup_handler handler) {
+    if (handler == mkyaffs2image_wrapper)
+        return ".img";
+    if (handler == dedupe_compress_wrapper)
+        return ".dup";
+    if (handler == tar_gzip_compress_wrapper)
+        return ".tar.gz";
+    if (handler == incremental_compress_wrapper)
+        return ".inc";
+    if (handler == ext4_image_compress_wrapper)
+        return ".simg";
+    return ".tar";
+}
+
+/* Where a mounted partition is backed up: <backup_path>/<name>.<fs> */
+static void get_backup_image(const char* backup_path, const char* mount_point, char* image)
+{
+    char name[PATH_MAX];
+    path_basename(mount_point, name);
+    scan_mounted_volumes();
+    Volume *v = volume_for_path(mount_point);
+    MountedVolume *mv = NULL;
+    if (v != NULL)
+        mv = find_mounted_volume_by_mount_point(v->mount_point);
+    if (mv == NULL || mv->filesystem == NULL)
+        sprintf(image, "%s/%s.auto", backup_path, name);
+    else
+        sprintf(image, "%s/%s.%s", backup_path, name, mv->filesystem);
+}
+
+/* Every backup notes in nandroid.stats what each partition was and what
+ * its backup came to, one "<image> <bytes in use> <bytes written>" line
+ * each, so the next backup in that format can predict its size. */
+#define NANDROID_STATS "nandroid.stats"
+
+// the files of a backup are named after its image
+static unsigned long long get_backup_image_bytes(const char* image)
+{
+    char dir[PATH_MAX];
+    char name[PATH_MAX];
+    char path[PATH_MAX];
+    unsigned long long bytes = 0;
+    struct stat st;
+    path_dirname(image, dir);
+    path_basename(image, name);
+    int len = strlen(name);
+
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return 0;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, name, len) != 0 || de->d_name[len] != '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (0 == lstat(path, &st) && S_ISREG(st.st_mode))
+            bytes += st.st_size;
+    }
+    closedir(d);
+    return bytes;
+}
+
+static void nandroid_stats_add(const char* image, unsigned long long used)
+{
+    char path[PATH_MAX];
+    char name[PATH_MAX];
+    path_dirname(image, path);
+    strcat(path, "/" NANDROID_STATS);
+    path_basename(image, name);
+    FILE* f = fopen(path, "a");
+    if (f == NULL)
+        return;
+    fprintf(f, "%s %llu %llu\n", name, used, get_backup_image_bytes(image));
+    fclose(f);
+}
+
+/* What the backup of image in the folder of previous came to, for each
+ * byte in use on the partition. */
+static int nandroid_stats_ratio(const char* previous, const char* image, double* ratio)
+{
+    char path[PATH_MAX];
+    char name[PATH_MAX];
+    char line[PATH_MAX];
+    char entry[PATH_MAX];
+    unsigned long long used;
+    unsigned long long written;
+    int found = 0;
+    path_dirname(previous, path);
+    strcat(path, "/" NANDROID_STATS);
+    path_basename(image, name);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    // the last line wins
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%s %llu %llu", entry, &used, &written) == 3 && strcmp(entry, name) == 0 && used > 0) {
+            *ratio = (double)written / (double)used;
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found ? 0 : -1;
+}
+
+/* Predict what backing up root adds to the backup volume, without
+ * writing anything. A raw image takes what its last image took, or the
+ * size of the partition. Dedupe stores whatever of the partition's last
+ * backup the blob store no longer holds, plus whatever changed. Other
+ * formats take the space in use on the partition, scaled by what the
+ * last backup in the same format came to. */
+static unsigned long long predict_mounted_bytes(const char* backup_path, const char* root)
+{
+    char image[PATH_MAX];
+    char previous[PATH_MAX];
+    get_backup_image(backup_path, root, image);
+    nandroid_backup_handler handler = get_backup_handler(root);
+    if (handler == NULL)
+        return 0;
+    unsigned long long used = estimate_backup_bytes(root, image);
+    if (handler == dedupe_compress_wrapper) {
+        char blob_dir[PATH_MAX];
+        unsigned long long bytes;
+        unsigned long long present;
+        get_dedupe_blob_dir(image, blob_dir);
+        if (0 == find_previous_backup(image, ".dup", previous) &&
+                0 == dedupe_manifest_present(previous, blob_dir, &bytes, &present))
+            return used > present ? used - present : 0;
+        return used;
+    }
+    double ratio;
+    if (0 == find_previous_backup(image, get_backup_handler_extension(handler), previous) &&
+            0 == nandroid_stats_ratio(previous, image, &ratio))
+        return used * ratio;
+    return used;
+}
+
+static unsigned long long predict_backup_bytes(const char* backup_path, const char* root)
+{
+    char image[PATH_MAX];
+    char previous[PATH_MAX];
+    struct stat st;
+    Volume *vol = volume_for_path(root);
+    if (vol == NULL || vol->fs_type == NULL || nandroid_journal_has(root))
+        return 0;
+
+    if (strcmp(vol->fs_type, "mtd") == 0 ||
+            strcmp(vol->fs_type, "bml") == 0 ||
+            strcmp(vol->fs_type, "emmc") == 0) {
+        char name[PATH_MAX];
+        path_basename(root, name);
+        sprintf(image, "%s/%s", backup_path, name);
+        if ((0 == find_previous_backup(image, ".simg", previous) ||
+                0 == find_previous_backup(image, ".img", previous)) && 0 == stat(previous, &st))
+            return st.st_size;
+        int fd = open(vol->device, O_RDONLY);
+        if (fd < 0)
+            return 0;
+        off_t size = lseek(fd, 0, SEEK_END);
+        close(fd);
+        return size > 0 ? size : 0;
+    }
+
+    // whatever is mounted only to be measured is unmounted again, the
+    // backup mounts and unmounts partitions itself
+    scan_mounted_volumes();
+    int mounted = find_mounted_volume_by_mount_point(vol->mount_point) != NULL;
+    if (0 != ensure_path_mounted(root))
+        return 0;
+    unsigned long long bytes = predict_mounted_bytes(backup_path, root);
+    if (!mounted)
+        ensure_path_unmounted(root);
+    return bytes;
+}
+
+/* Check the predicted size of a backup against the free space before
+ * any of it is written. If the blobs no backup uses any more would make
+ * room, they are freed; otherwise the user decides. The blob store is
+ * only collected here, when it is short of space. Returns 1 to cancel. */
+static int admit_backup(const char* backup_path, const char** roots, int count)
+{
+    unsigned long long needed = 0;
+    int i;
+    for (i = 0; i < count; i++)
+        needed += predict_backup_bytes(backup_path, roots[i]);
+    uint64_t needed_mb = needed / (1024 * 1024);
+    uint64_t sdcard_free_mb = recalc_sdcard_space(backup_path);
+    ui_print("SD Card space free: %lluMB\n", sdcard_free_mb);
+    ui_print("Estimated backup size: %lluMB\n", needed_mb);
+    nandroid_backup_bitfield |= NANDROID_FIELD_DEDUPE_CLEARED_SPACE;
+    if (sdcard_free_mb >= minimum_storage && sdcard_free_mb >= needed_mb)
+        return 0;
+
+    char image[PATH_MAX];
+    char blob_dir[PATH_MAX];
+    struct stat st;
+    sprintf(image, "%s/boot", backup_path);
+    get_dedupe_blob_dir(image, blob_dir);
+    if (0 == stat(blob_dir, &st) && S_ISDIR(st.st_mode)) {
+        uint64_t unused_mb = dedupe_gc_backups(blob_dir, 1) / (1024 * 1024);
+        if (sdcard_free_mb + unused_mb >= minimum_storage && sdcard_free_mb + unused_mb >= needed_mb) {
+            ui_print("Freeing %lluMB of unused backup data...\n", unused_mb);
+            dedupe_gc_backups(blob_dir, 0);
+            sdcard_free_mb = recalc_sdcard_space(backup_path);
+            if (sdcard_free_mb >= minimum_storage && sdcard_free_mb >= needed_mb)
+                return 0;
+        }
+    }
+    if (sdcard_free_mb < needed_mb)
+        ui_print("The backup will need about %lluMB more than is free.\n", needed_mb - sdcard_free_mb);
+    return show_lowspace_menu(sdcard_free_mb, backup_path) == 1;
+}
 
 int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
     int ret = 0;
-    char* name = basename(mount_point);
+    char name[PATH_MAX];
+    path_basename(mount_point, name);
 
     struct stat file_info;
     int callback = stat("/sdcard/cotrecovery/.hidenandroidprogress", &file_info) != 0;
@@ -326,17 +956,12 @@ int nandroid_backup_partition_extended(const char* backup_path, const char* moun
         ui_print("Can't mount %s!\n", mount_point);
         return ret;
     }
-    compute_directory_stats(mount_point);
     char tmp[PATH_MAX];
-    scan_mounted_volumes();
-    Volume *v = volume_for_path(mount_point);
-    MountedVolume *mv = NULL;
-    if (v != NULL)
-        mv = find_mounted_volume_by_mount_point(v->mount_point);
-    if (mv == NULL || mv->filesystem == NULL)
-        sprintf(tmp, "%s/%s.auto", backup_path, name);
-    else
-        sprintf(tmp, "%s/%s.%s", backup_path, name, mv->filesystem);
+    get_backup_image(backup_path, mount_point, tmp);
+    nandroid_bytes_done = 0;
+    nandroid_bytes_total = estimate_backup_bytes(mount_point, tmp);
+    ui_reset_progress();
+    ui_show_progress(1, 0);
     nandroid_backup_handler backup_handler = get_backup_handler(mount_point);
     if (backup_handler == NULL) {
         ui_print("Error finding an appropriate backup handler.\n");
@@ -350,31 +975,88 @@ int nandroid_backup_partition_extended(const char* backup_path, const char* moun
         ui_print("Error while making a backup image of %s!\n", mount_point);
         return ret;
     }
+    nandroid_stats_add(tmp, nandroid_bytes_total);
     return 0;
 }
 
+/* Raw images of emmc partitions are written in Android's sparse format,
+ * leaving out the runs of zeroed or erased blocks, as <image>.simg so
+ * that nothing which flashes a .img as is (dd, fastboot on some
+ * bootloaders, older recoveries) writes a sparse file to the partition.
+ * Nand and bml images stay byte for byte in <image>.img, the tools that
+ * flash them expect that. image is the name without its extension. */
+static int backup_raw_image(Volume* vol, const char* image)
+{
+    char tmp[PATH_MAX];
+    if (strcmp(vol->fs_type, "emmc") == 0 && vol->device[0] == '/') {
+        sprintf(tmp, "%s.simg", image);
+        return backup_sparse_partition(vol->device, tmp);
+    }
+    sprintf(tmp, "%s.img", image);
+    return backup_raw_partition(vol->fs_type, vol->device, tmp);
+}
+
+/* The file a raw backup of image left, .simg or .img. Returns 0 if
+ * there is one. */
+static int find_raw_image(const char* image, char* file)
+{
+    struct stat st;
+    sprintf(file, "%s.simg", image);
+    if (0 == stat(file, &st))
+        return 0;
+    sprintf(file, "%s.img", image);
+    return stat(file, &st);
+}
+
+static int restore_raw_image(Volume* vol, const char* image)
+{
+    char file[PATH_MAX];
+    if (0 != find_raw_image(image, file)) {
+        ui_print("%s.img not found.\n", image);
+        return -1;
+    }
+    // backups made before sparse images are plain
+    if (!is_sparse_image(file))
+        return restore_raw_partition(vol->fs_type, vol->device, file);
+    if (vol->device[0] != '/') {
+        ui_print("Can't restore a sparse image to %s\n", vol->device);
+        return -1;
+    }
+    return restore_sparse_partition(vol->device, file);
+}
+
 int nandroid_backup_partition(const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists before attempting anything...
     if (vol == NULL || vol->fs_type == NULL)
         return NULL;
 
+    char name[PATH_MAX];
+    path_basename(root, name);
+    if (nandroid_journal_has(root)) {
+        ui_print("%s was backed up already.\n", name);
+        return 0;
+    }
+
     // see if we need a raw backup (mtd)
     char tmp[PATH_MAX];
     int ret;
     if (strcmp(vol->fs_type, "mtd") == 0 ||
             strcmp(vol->fs_type, "bml") == 0 ||
             strcmp(vol->fs_type, "emmc") == 0) {
-        const char* name = basename(root);
-        sprintf(tmp, "%s/%s.img", backup_path, name);
+        sprintf(tmp, "%s/%s", backup_path, name);
         ui_print("Backing up %s image...\n", name);
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->device, tmp))) {
+        if (0 != (ret = backup_raw_image(vol, tmp))) {
             ui_print("Error while backing up %s image!", name);
             return ret;
         }
+        nandroid_journal_add(root);
         return 0;
     }
-    return nandroid_backup_partition_extended(backup_path, root, 1);
+    if (0 != (ret = nandroid_backup_partition_extended(backup_path, root, 1)))
+        return ret;
+    nandroid_journal_add(root);
+    return 0;
 }
 
 int recalc_sdcard_space(const char* backup_path)
@@ -393,11 +1075,297 @@ int recalc_sdcard_space(const char* backup_path)
     return sdcard_free_mb;
 }
 
+/* Concurrent backup of the filesystem partitions.
+ *
+ * Partitions on different disks (internal emmc, sd card, mtd) are read
+ * at the same time. Partitions on the same disk take turns, unless
+ * ro.cwm.backup_jobs_per_device allows more than one at a time there.
+ * Raw images are still dumped one after another before the jobs start. */
+#define BACKUP_JOBS_MAX 16
+
+enum {
+    BACKUP_JOB_PENDING,
+    BACKUP_JOB_RUNNING,
+    // the thread is done, waiting to be joined
+    BACKUP_JOB_FINISHED,
+    BACKUP_JOB_DONE,
+};
+
+struct BACKUP_SCHEDULER;
+
+struct BACKUP_JOB {
+    char mount_point[PATH_MAX];
+    int umount_when_finished;
+    char image[PATH_MAX];
+    // the disk the partition is on, see get_backup_device
+    char device[PATH_MAX];
+    // its mount table entry, for handlers that need more than the path
+    struct BACKUP_MOUNT mount;
+    // the space in use on the partition
+    unsigned long long used;
+    nandroid_backup_handler handler;
+    int state;
+    int ret;
+    pthread_t thread;
+    struct BACKUP_SCHEDULER* scheduler;
+};
+
+struct BACKUP_SCHEDULER {
+    char backup_path[PATH_MAX];
+    struct BACKUP_JOB jobs[BACKUP_JOBS_MAX];
+    int count;
+    int callback;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+static void backup_jobs_init(struct BACKUP_SCHEDULER* s, const char* backup_path)
+{
+    struct stat file_info;
+    strcpy(s->backup_path, backup_path);
+    s->count = 0;
+    s->callback = stat("/sdcard/cotrecovery/.hidenandroidprogress", &file_info) != 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->finished, NULL);
+}
+
+static void backup_jobs_free(struct BACKUP_SCHEDULER* s)
+{
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->finished);
+}
+
+/* Queue a partition for backup_jobs_run. Raw partitions are not queued,
+ * they are dumped right away. */
+static int backup_jobs_add(struct BACKUP_SCHEDULER* s, const char* root, int umount_when_finished)
+{
+    Volume *vol = volume_for_path(root);
+    if (vol == NULL || vol->fs_type == NULL)
+        return 0;
+    if (strcmp(vol->fs_type, "mtd") == 0 ||
+            strcmp(vol->fs_type, "bml") == 0 ||
+            strcmp(vol->fs_type, "emmc") == 0)
+        return nandroid_backup_partition(s->backup_path, root);
+    if (nandroid_journal_has(root)) {
+        char name[PATH_MAX];
+        path_basename(root, name);
+        ui_print("%s was backed up already.\n", name);
+        return 0;
+    }
+    if (s->count == BACKUP_JOBS_MAX)
+        return print_and_error("Too many partitions to back up.\n");
+
+    struct BACKUP_JOB* job = &s->jobs[s->count++];
+    memset(job, 0, sizeof(*job));
+    strcpy(job->mount_point, root);
+    job->umount_when_finished = umount_when_finished;
+    job->state = BACKUP_JOB_PENDING;
+    job->scheduler = s;
+    return 0;
+}
+
+/* Name the disk a partition lives on: /dev/block/mmcblk0p12 -> mmcblk0,
+ * /dev/block/sda1 -> sda. All of nand is one disk, and .android_secure
+ * is on /data on data/media devices. */
+static void get_backup_device(const char* mount_point, char* device)
+{
+    Volume *v = volume_for_path(mount_point);
+    if (v != NULL && is_data_media_volume_path(v->mount_point))
+        v = volume_for_path("/data");
+    if (v == NULL || v->device == NULL) {
+        strcpy(device, mount_point);
+        return;
+    }
+    if (strcmp(v->fs_type, "yaffs2") == 0 || strcmp(v->fs_type, "mtd") == 0) {
+        strcpy(device, "mtd");
+        return;
+    }
+
+    char path[PATH_MAX];
+    // by-name links
+    if (realpath(v->device, path) == NULL)
+        strcpy(path, v->device);
+    path_basename(path, device);
+    int len = strlen(device);
+    while (len > 0 && isdigit(device[len - 1]))
+        len--;
+    if (len > 1 && device[len - 1] == 'p' && isdigit(device[len - 2]))
+        len--;
+    if (len > 0)
+        device[len] = '\0';
+}
+
+static void backup_job_unmount(struct BACKUP_JOB* job)
+{
+    if (!job->umount_when_finished)
+        return;
+    pthread_mutex_lock(&nandroid_mounts_lock);
+    ensure_path_unmounted(job->mount_point);
+    pthread_mutex_unlock(&nandroid_mounts_lock);
+}
+
+/* Mount the partition and work out where and how it is backed up. */
+static int backup_job_prepare(struct BACKUP_JOB* job)
+{
+    int ret = 0;
+    pthread_mutex_lock(&nandroid_mounts_lock);
+    if (0 != ensure_path_mounted(job->mount_point)) {
+        ui_print("Can't mount %s!\n", job->mount_point);
+        ret = 1;
+    }
+    else {
+        get_backup_image(job->scheduler->backup_path, job->mount_point, job->image);
+        job->handler = get_backup_handler(job->mount_point);
+        if (job->handler == NULL) {
+            ui_print("Error finding an appropriate backup handler.\n");
+            ret = -2;
+        }
+        else {
+            get_backup_device(job->mount_point, job->device);
+            get_backup_mount(job->mount_point, &job->mount);
+        }
+    }
+    pthread_mutex_unlock(&nandroid_mounts_lock);
+    return ret;
+}
+
+static void* backup_job_thread(void* cookie)
+{
+    struct BACKUP_JOB* job = (struct BACKUP_JOB*)cookie;
+    int ret;
+    if (job->handler == ext4_image_compress_wrapper)
+        ret = ext4_image_backup(&job->mount, job->mount_point, job->image, job->scheduler->callback);
+    else
+        ret = job->handler(job->mount_point, job->image, job->scheduler->callback);
+    if (ret == 0)
+        nandroid_journal_add(job->mount_point);
+    pthread_mutex_lock(&job->scheduler->lock);
+    job->ret = ret;
+    job->state = BACKUP_JOB_FINISHED;
+    pthread_cond_signal(&job->scheduler->finished);
+    pthread_mutex_unlock(&job->scheduler->lock);
+    return NULL;
+}
+
+static int backup_jobs_on_device(struct BACKUP_SCHEDULER* s, const char* device)
+{
+    int i;
+    int running = 0;
+    for (i = 0; i < s->count; i++) {
+        if ((s->jobs[i].state == BACKUP_JOB_RUNNING || s->jobs[i].state == BACKUP_JOB_FINISHED) &&
+                strcmp(s->jobs[i].device, device) == 0)
+            running++;
+    }
+    return running;
+}
+
+/* Back up every queued partition. Once one fails, the ones already
+ * running are finished but no more are started. */
+static int backup_jobs_run(struct BACKUP_SCHEDULER* s)
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.backup_jobs_per_device", value, "1");
+    int per_device = atoi(value);
+    if (per_device < 1)
+        per_device = 1;
+
+    // mount everything first, and size one progress bar for all of it
+    int ret = 0;
+    int i;
+    nandroid_bytes_done = 0;
+    nandroid_bytes_total = 0;
+    for (i = 0; i < s->count; i++) {
+        struct BACKUP_JOB* job = &s->jobs[i];
+        if (0 != (ret = backup_job_prepare(job)))
+            break;
+        job->used = estimate_backup_bytes(job->mount_point, job->image);
+        nandroid_bytes_total += job->used;
+        if (job->handler == dedupe_compress_wrapper) {
+            char blob_dir[PATH_MAX];
+            get_dedupe_blob_dir(job->image, blob_dir);
+            ensure_directory(blob_dir);
+            dedupe_clear_space(blob_dir);
+        }
+    }
+    if (ret != 0) {
+        for (; i >= 0; i--)
+            backup_job_unmount(&s->jobs[i]);
+        return ret;
+    }
+    ui_reset_progress();
+    ui_show_progress(1, 0);
+
+    int running = 0;
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        struct BACKUP_JOB* job = NULL;
+        for (i = 0; i < s->count && job == NULL; i++) {
+            if (s->jobs[i].state == BACKUP_JOB_FINISHED)
+                job = &s->jobs[i];
+        }
+        if (job != NULL) {
+            job->state = BACKUP_JOB_DONE;
+            running--;
+            pthread_mutex_unlock(&s->lock);
+            pthread_join(job->thread, NULL);
+            backup_job_unmount(job);
+            if (0 != job->ret) {
+                ui_print("Error while making a backup image of %s!\n", job->mount_point);
+                if (ret == 0)
+                    ret = job->ret;
+            }
+            else {
+                nandroid_stats_add(job->image, job->used);
+            }
+            pthread_mutex_lock(&s->lock);
+            continue;
+        }
+
+        for (i = 0; i < s->count && ret == 0; i++) {
+            job = &s->jobs[i];
+            if (job->state != BACKUP_JOB_PENDING || backup_jobs_on_device(s, job->device) >= per_device)
+                continue;
+            char name[PATH_MAX];
+            path_basename(job->mount_point, name);
+            ui_print("Backing up %s...\n", name);
+            job->state = BACKUP_JOB_RUNNING;
+            if (pthread_create(&job->thread, NULL, backup_job_thread, job)) {
+                job->state = BACKUP_JOB_PENDING;
+                ui_print("Error while making a backup image of %s!\n", job->mount_point);
+                ret = -1;
+                break;
+            }
+            running++;
+        }
+
+        if (running == 0)
+            break;
+        pthread_cond_wait(&s->finished, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    // partitions that were never started
+    for (i = 0; i < s->count; i++) {
+        if (s->jobs[i].state == BACKUP_JOB_PENDING)
+            backup_job_unmount(&s->jobs[i]);
+    }
+    return ret;
+}
+
 int nandroid_backup(const char* backup_path)
 {
+    char interrupted[PATH_MAX];
     nandroid_backup_bitfield = 0;
+    nandroid_md5_reset();
+    nandroid_journal[0] = '\0';
     if (backupfmt == 0) {
 		printf("Default Backup Handler: dedupe\n");
+	} else if (backupfmt == 2) {
+		printf("Default Backup Handler: tar.gz\n");
+	} else if (backupfmt == 3) {
+		printf("Default Backup Handler: incremental tar\n");
+	} else if (backupfmt == 4) {
+		printf("Default Backup Handler: ext4 image\n");
 	} else {
 		printf("Default Backup Handler: tar\n");
 	}
@@ -413,83 +1381,130 @@ int nandroid_backup(const char* backup_path)
     if (is_data_media_volume_path(volume->mount_point))
         volume = volume_for_path("/data");
         
+    int resume = nandroid_journal_resumable(backup_path);
+    if (resume) {
+        ui_print("Resuming interrupted backup...\n");
+    }
+    else if (find_interrupted_backup(backup_path, interrupted) && confirm_resume(interrupted)) {
+        char name[PATH_MAX];
+        path_basename(interrupted, name);
+        ui_print("Resuming interrupted backup %s...\n", name);
+        backup_path = interrupted;
+        resume = 1;
+    }
+    // created once the backup starts
+    sprintf(nandroid_journal, "%s/%s", backup_path, NANDROID_JOURNAL);
+
     int ret;
     struct statfs s;
+    Volume *vol;
     if (NULL != volume) {
         if (0 != (ret = statfs(volume->mount_point, &s)))
             return print_and_error("Unable to stat backup path.\n");
-            
-		uint64_t sdcard_free_mb = recalc_sdcard_space(backup_path);
-		ui_print("SD Card space free: %lluMB\n", sdcard_free_mb);
-		if (sdcard_free_mb < minimum_storage) {
-			if (show_lowspace_menu(sdcard_free_mb, backup_path) == 1) {
-				return 0;
-			}
-		}
+
+        const char* roots[BACKUP_JOBS_MAX];
+        int count = 0;
+        struct stat st;
+        roots[count++] = "/boot";
+        roots[count++] = "/recovery";
+        vol = volume_for_path("/wimax");
+        if (vol != NULL && 0 == stat(vol->device, &st))
+            roots[count++] = "/wimax";
+        roots[count++] = "/system";
+        roots[count++] = "/data";
+        if (has_datadata())
+            roots[count++] = "/datadata";
+        if (0 == stat("/sdcard/.android_secure", &st))
+            roots[count++] = "/sdcard/.android_secure";
+        roots[count++] = "/cache";
+        vol = volume_for_path("/sd-ext");
+        if (vol != NULL && 0 == stat(vol->device, &st))
+            roots[count++] = "/sd-ext";
+        if (admit_backup(backup_path, roots, count))
+            return 0;
 	}
 	ui_set_background(BACKGROUND_ICON_INSTALLING);
     char tmp[PATH_MAX];
     ensure_directory(backup_path);
+    nandroid_journal_begin(resume);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
+    if (0 != (ret = nandroid_backup_partition(backup_path, "/boot"))) {
+        nandroid_journal_fail();
         return ret;
+    }
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/recovery")))
+    if (0 != (ret = nandroid_backup_partition(backup_path, "/recovery"))) {
+        nandroid_journal_fail();
         return ret;
+    }
 
-    Volume *vol = volume_for_path("/wimax");
-    if (vol != NULL && 0 == stat(vol->device, &s))
+    vol = volume_for_path("/wimax");
+    if (vol != NULL && 0 == stat(vol->device, &s) && nandroid_journal_has("/wimax"))
+    {
+        ui_print("wimax was backed up already.\n");
+    }
+    else if (vol != NULL && 0 == stat(vol->device, &s))
     {
         char serialno[PROPERTY_VALUE_MAX];
         ui_print("Backing up WiMAX...\n");
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
-        sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
-        ret = backup_raw_partition(vol->fs_type, vol->device, tmp);
-        if (0 != ret)
+        sprintf(tmp, "%s/wimax.%s", backup_path, serialno);
+        ret = backup_raw_image(vol, tmp);
+        if (0 != ret) {
+            nandroid_journal_fail();
             return print_and_error("Error while dumping WiMAX image!\n");
+        }
+        nandroid_journal_add("/wimax");
     }
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/system")))
-        return ret;
+    struct BACKUP_SCHEDULER scheduler;
+    backup_jobs_init(&scheduler, backup_path);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/data")))
-        return ret;
+    ret = backup_jobs_add(&scheduler, "/system", 1);
 
-    if (has_datadata()) {
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/datadata")))
-            return ret;
-    }
+    if (0 == ret)
+        ret = backup_jobs_add(&scheduler, "/data", 1);
+
+    if (0 == ret && has_datadata())
+        ret = backup_jobs_add(&scheduler, "/datadata", 1);
 
     if (0 != stat("/sdcard/.android_secure", &s))
     {
         ui_print("No /sdcard/.android_secure found. Skipping backup of applications on external storage.\n");
     }
-    else
+    else if (0 == ret)
     {
-        if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/sdcard/.android_secure", 0)))
-            return ret;
+        ret = backup_jobs_add(&scheduler, "/sdcard/.android_secure", 0);
     }
 
-    if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
-        return ret;
+    if (0 == ret)
+        ret = backup_jobs_add(&scheduler, "/cache", 0);
 
     vol = volume_for_path("/sd-ext");
     if (vol == NULL || 0 != stat(vol->device, &s))
     {
         ui_print("No sd-ext found. Skipping backup of sd-ext.\n");
     }
-    else
+    else if (0 == ret)
     {
         if (0 != ensure_path_mounted("/sd-ext"))
             ui_print("Could not mount sd-ext. sd-ext backup may not be supported on this device. Skipping backup of sd-ext.\n");
-        else if (0 != (ret = nandroid_backup_partition(backup_path, "/sd-ext")))
-            return ret;
+        else
+            ret = backup_jobs_add(&scheduler, "/sd-ext", 1);
+    }
+
+    if (0 == ret)
+        ret = backup_jobs_run(&scheduler);
+    backup_jobs_free(&scheduler);
+    if (0 != ret) {
+        nandroid_journal_fail();
+        return ret;
     }
+    nandroid_journal_end();
 
     ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    if (0 != (ret = nandroid_md5_write(backup_path))) {
         ui_print("Error while generating md5 sum!\n");
         return ret;
     }
@@ -506,6 +1521,9 @@ int nandroid_backup(const char* backup_path)
 int nandroid_advanced_backup(const char* backup_path, int boot, int recovery, int system, int data, int cache, int sdext)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
+    nandroid_md5_reset();
+    // only full backups are journaled
+    nandroid_journal[0] = '\0';
 
 	char tmp[PATH_MAX];
 	if (ensure_path_mounted(backup_path) != 0) {
@@ -519,14 +1537,25 @@ int nandroid_advanced_backup(const char* backup_path, int boot, int recovery, in
     if (0 != (ret = statfs(volume->mount_point, &s)))
         return print_and_error("Unable to stat backup path.\n");
 
-    uint64_t sdcard_free_mb = recalc_sdcard_space(backup_path);
-
-    ui_print("SD Card space free: %lluMB\n", sdcard_free_mb);
-    if (sdcard_free_mb < minimum_storage) {
-        if (show_lowspace_menu(sdcard_free_mb, backup_path) == 1) {
-			return 0;
-		}
-	}
+    const char* roots[BACKUP_JOBS_MAX];
+    int count = 0;
+    struct stat st;
+    if (boot)
+        roots[count++] = "/boot";
+    if (recovery)
+        roots[count++] = "/recovery";
+    if (system)
+        roots[count++] = "/system";
+    if (data)
+        roots[count++] = "/data";
+    if (data && has_datadata())
+        roots[count++] = "/datadata";
+    if (0 == stat("/sdcard/.android_secure", &st))
+        roots[count++] = "/sdcard/.android_secure";
+    if (cache)
+        roots[count++] = "/cache";
+    if (admit_backup(backup_path, roots, count))
+        return 0;
 
 	ensure_directory(backup_path);
 
@@ -536,30 +1565,36 @@ int nandroid_advanced_backup(const char* backup_path, int boot, int recovery, in
     if (recovery && 0 != (ret = nandroid_backup_partition(backup_path, "/recovery")))
         return ret;
 
-    if (system && 0 != (ret = nandroid_backup_partition(backup_path, "/system")))
-        return ret;
+    struct BACKUP_SCHEDULER scheduler;
+    backup_jobs_init(&scheduler, backup_path);
 
-    if (data && 0 != (ret = nandroid_backup_partition(backup_path, "/data")))
-        return ret;
+    ret = 0;
+    if (system)
+        ret = backup_jobs_add(&scheduler, "/system", 1);
 
-    if (data && has_datadata()) {
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/datadata")))
-            return ret;
-    }
+    if (data && 0 == ret)
+        ret = backup_jobs_add(&scheduler, "/data", 1);
+
+    if (data && has_datadata() && 0 == ret)
+        ret = backup_jobs_add(&scheduler, "/datadata", 1);
 
     if (0 != stat("/sdcard/.android_secure", &s)) {
         ui_print("No /sdcard/.android_secure found. Skipping backup of applications on external storage.\n");
-    } else {
-        if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/sdcard/.android_secure", 0)))
-            return ret;
+    } else if (0 == ret) {
+        ret = backup_jobs_add(&scheduler, "/sdcard/.android_secure", 0);
     }
 
-    if (cache && 0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
+    if (cache && 0 == ret)
+        ret = backup_jobs_add(&scheduler, "/cache", 0);
+
+    if (0 == ret)
+        ret = backup_jobs_run(&scheduler);
+    backup_jobs_free(&scheduler);
+    if (0 != ret)
         return ret;
 
     ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    if (0 != (ret = nandroid_md5_write(backup_path))) {
         ui_print("Error while generating md5 sum!\n");
         return ret;
     }
@@ -592,47 +1627,42 @@ static int unyaffs_wrapper(const char* backup_file_image, const char* backup_pat
 }
 
 static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; cat %s* | tar xv ; exit $?", backup_path, backup_file_image);
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar.\n");
-        return -1;
-    }
-
-    while (fgets(tmp, PATH_MAX, fp) != NULL) {
-        tmp[PATH_MAX - 1] = NULL;
-        if (callback)
-            nandroid_callback(tmp);
-    }
+    return nandroid_tar_restore(backup_file_image, backup_path, callback ? nandroid_progress : NULL);
+}
 
-    return __pclose(fp);
+static int incremental_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return nandroid_incremental_restore(backup_file_image, backup_path, callback ? nandroid_progress : NULL);
 }
 
 static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
     char blob_dir[PATH_MAX];
-    strcpy(blob_dir, backup_file_image);
-    char *bd = dirname(blob_dir);
-    strcpy(blob_dir, bd);
-    bd = dirname(blob_dir);
-    strcpy(blob_dir, bd);
-    bd = dirname(blob_dir);
-    sprintf(tmp, "dedupe x %s %s/blobs %s; exit $?", backup_file_image, bd, backup_path);
+    get_dedupe_blob_dir(backup_file_image, blob_dir);
+
+    struct DEDUPE_CONTEXT dedupe;
+    dedupe_init(&dedupe);
+    struct DEDUPE_PROGRESS progress = { &dedupe, 0 };
+    if (callback) {
+        dedupe.callback = dedupe_progress;
+        dedupe.cookie = &progress;
+    }
+    return dedupe_restore(&dedupe, backup_file_image, blob_dir, backup_path);
+}
 
-    char path[PATH_MAX];
-    FILE *fp = __popen(tmp, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute dedupe.\n");
+/* The partition is written as a whole, unmounted. */
+static int ext4_image_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    Volume *vol = volume_for_path(backup_path);
+    if (vol == NULL || vol->device[0] != '/') {
+        ui_print("Can't restore a block image to %s\n", backup_path);
         return -1;
     }
-
-    while (fgets(path, PATH_MAX, fp) != NULL) {
-        if (callback)
-            nandroid_callback(path);
+    if (0 != ensure_path_unmounted(backup_path)) {
+        ui_print("Can't unmount %s!\n", backup_path);
+        return -1;
     }
-
-    return __pclose(fp);
+    int ret = restore_sparse_partition(vol->device, backup_file_image);
+    if (ret == 0 && callback)
+        nandroid_callback(backup_file_image);
+    return ret;
 }
 
 static nandroid_restore_handler get_restore_handler(const char *backup_path) {
@@ -701,12 +1731,30 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
                 restore_handler = tar_extract_wrapper;
                 break;
             }
+            sprintf(tmp, "%s/%s.%s.tar.gz", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = tar_extract_wrapper;
+                break;
+            }
             sprintf(tmp, "%s/%s.%s.dup", backup_path, name, filesystem);
             if (0 == (ret = statfs(tmp, &file_info))) {
                 backup_filesystem = filesystem;
                 restore_handler = dedupe_extract_wrapper;
                 break;
             }
+            sprintf(tmp, "%s/%s.%s.inc", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = incremental_extract_wrapper;
+                break;
+            }
+            sprintf(tmp, "%s/%s.%s.simg", backup_path, name, filesystem);
+            if (0 == (ret = statfs(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = ext4_image_extract_wrapper;
+                break;
+            }
             i++;
         }
 
@@ -739,6 +1787,16 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
     int callback = stat("/sdcard/cotrecovery/.hidenandroidprogress", &file_info) != 0;
 
     ui_print("Restoring %s...\n", name);
+    // a block image brings its own filesystem
+    if (restore_handler == ext4_image_extract_wrapper) {
+        if (0 != (ret = restore_handler(tmp, mount_point, callback))) {
+            ui_print("Error while restoring %s!\n", mount_point);
+            return ret;
+        }
+        if (!umount_when_finished)
+            ensure_path_mounted(mount_point);
+        return 0;
+    }
     if (backup_filesystem == NULL) {
         if (0 != (ret = format_volume(mount_point))) {
             ui_print("Error while formatting %s!\n", mount_point);
@@ -791,9 +1849,9 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
             ui_print("Error while erasing %s image!", name);
             return ret;
         }
-        sprintf(tmp, "%s%s.img", backup_path, root);
+        sprintf(tmp, "%s%s", backup_path, root);
         ui_print("Restoring %s image...\n", name);
-        if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp))) {
+        if (0 != (ret = restore_raw_image(vol, tmp))) {
             ui_print("Error while flashing %s image!", name);
             return ret;
         }
@@ -806,23 +1864,23 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_show_indeterminate_progress();
-    nandroid_files_total = 0;
+    nandroid_bytes_total = 0;
 
     if (ensure_path_mounted(backup_path) != 0)
         return print_and_error("Can't mount backup path\n");
     
     char tmp[PATH_MAX];
 
+    // tar volumes are checked as they are restored
     ui_print("Checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
+    if (0 != nandroid_md5_check(backup_path))
         return print_and_error("MD5 mismatch!\n");
     
     int ret;
-	struct stat st;
-	sprintf(tmp, "%s/boot.img", backup_path);
+	char image[PATH_MAX];
+	sprintf(image, "%s/boot", backup_path);
 	
-	if (restore_boot && (stat(tmp, &st) == 0)) {
+	if (restore_boot && find_raw_image(image, tmp) == 0) {
 		if (NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_partition(backup_path, "/boot"))) {
 			return ret;
 		}
@@ -838,10 +1896,10 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
         
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
-        sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
+        char image[PATH_MAX];
+        sprintf(image, "%s/wimax.%s", backup_path, serialno);
 
-        struct stat st;
-        if (0 != stat(tmp, &st))
+        if (0 != find_raw_image(image, tmp))
         {
             ui_print("WARNING: WiMAX partition exists, but nandroid\n");
             ui_print("         backup does not contain WiMAX image.\n");
@@ -854,7 +1912,7 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
             if (0 != (ret = format_volume("/wimax")))
                 return print_and_error("Error while formatting wimax!\n");
             ui_print("Restoring WiMAX image...\n");
-            if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp)))
+            if (0 != (ret = restore_raw_image(vol, image)))
                 return ret;
         }
     }
@@ -0,0 +1,371 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "nandroid_incremental.h"
+
+#define INC_MAGIC "nandroid-incremental 1"
+#define INC_BUCKETS 65536
+// restores recurse once per backup in the chain
+#define INC_MAX_CHAIN 64
+
+// one line of a .inc list:
+// "<type> <mode> <uid> <gid> <nlink> <size> <mtime> <ino> <name>"
+struct INC_ENTRY {
+    char* name;
+    char type;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    unsigned int nlink;
+    unsigned long long size;
+    long long mtime;
+    unsigned long long ino;
+    struct INC_ENTRY* next;
+};
+
+struct INC_LIST {
+    // the folder of the backup this one is based on, next to its own
+    char base[PATH_MAX];
+    char** excludes;
+    int exclude_count;
+    struct INC_ENTRY** buckets;
+};
+
+struct INC_BACKUP {
+    FILE* list;
+    const struct INC_LIST* base;
+    const struct NANDROID_TAR_OPTIONS* options;
+};
+
+static unsigned int inc_hash(const char* name) {
+    unsigned int h = 5381;
+    for (; *name; name++)
+        h = h * 33 + (unsigned char)*name;
+    return h % INC_BUCKETS;
+}
+
+static char inc_type(mode_t mode) {
+    if (S_ISDIR(mode))
+        return 'd';
+    if (S_ISLNK(mode))
+        return 'l';
+    if (S_ISCHR(mode))
+        return 'c';
+    if (S_ISBLK(mode))
+        return 'b';
+    if (S_ISFIFO(mode))
+        return 'p';
+    if (S_ISSOCK(mode))
+        return 's';
+    return 'f';
+}
+
+static void inc_entry_init(struct INC_ENTRY* e, const struct stat* st) {
+    e->type = inc_type(st->st_mode);
+    e->mode = st->st_mode & 07777;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->nlink = st->st_nlink;
+    // a directory's size depends on how its entries were created
+    e->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+    e->mtime = st->st_mtime;
+    e->ino = st->st_ino;
+}
+
+static void inc_list_init(struct INC_LIST* list) {
+    memset(list, 0, sizeof(*list));
+    list->buckets = calloc(INC_BUCKETS, sizeof(struct INC_ENTRY*));
+}
+
+static void inc_list_free(struct INC_LIST* list) {
+    int i;
+    for (i = 0; i < INC_BUCKETS; i++) {
+        struct INC_ENTRY* e = list->buckets[i];
+        while (e != NULL) {
+            struct INC_ENTRY* next = e->next;
+            free(e->name);
+            free(e);
+            e = next;
+        }
+    }
+    free(list->buckets);
+    for (i = 0; i < list->exclude_count; i++)
+        free(list->excludes[i]);
+    free(list->excludes);
+}
+
+static const struct INC_ENTRY* inc_find(const struct INC_LIST* list, const char* name) {
+    const struct INC_ENTRY* e;
+    for (e = list->buckets[inc_hash(name)]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static int inc_excluded(const struct INC_LIST* list, const char* name) {
+    int i;
+    for (i = 0; i < list->exclude_count; i++) {
+        if (strcmp(list->excludes[i], name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// names are the last field, with '\\' and newlines escaped
+static void inc_write_name(FILE* f, const char* name) {
+    for (; *name; name++) {
+        if (*name == '\\')
+            fputs("\\\\", f);
+        else if (*name == '\n')
+            fputs("\\n", f);
+        else
+            fputc(*name, f);
+    }
+    fputc('\n', f);
+}
+
+static void inc_read_name(const char* s, char* name) {
+    for (; *s; s++) {
+        if (*s == '\\' && s[1] != '\0') {
+            s++;
+            *name++ = *s == 'n' ? '\n' : *s;
+        }
+        else {
+            *name++ = *s;
+        }
+    }
+    *name = '\0';
+}
+
+static int inc_list_load(struct INC_LIST* list, const char* path) {
+    char line[PATH_MAX * 2 + 128];
+    char name[PATH_MAX * 2];
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return 1;
+    int ret = fgets(line, sizeof(line), f) == NULL || strncmp(line, INC_MAGIC "\n", sizeof(INC_MAGIC)) != 0;
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
+            ret = 1;
+            break;
+        }
+        line[--len] = '\0';
+        if (strncmp(line, "base ", 5) == 0) {
+            snprintf(list->base, sizeof(list->base), "%s", line + 5);
+            continue;
+        }
+        if (strncmp(line, "exclude ", 8) == 0) {
+            list->excludes = realloc(list->excludes, (list->exclude_count + 1) * sizeof(char*));
+            list->excludes[list->exclude_count++] = strdup(line + 8);
+            continue;
+        }
+
+        struct INC_ENTRY e;
+        int offset = 0;
+        if (sscanf(line, "%c %o %u %u %u %llu %lld %llu %n", &e.type, &e.mode, &e.uid, &e.gid,
+                &e.nlink, &e.size, &e.mtime, &e.ino, &offset) != 8 || offset == 0) {
+            ret = 1;
+            break;
+        }
+        inc_read_name(line + offset, name);
+        struct INC_ENTRY* entry = malloc(sizeof(struct INC_ENTRY));
+        *entry = e;
+        entry->name = strdup(name);
+        unsigned int h = inc_hash(name);
+        entry->next = list->buckets[h];
+        list->buckets[h] = entry;
+    }
+    fclose(f);
+    return ret;
+}
+
+static int incremental_filter(const char* name, const struct stat* st, void* cookie) {
+    struct INC_BACKUP* b = (struct INC_BACKUP*)cookie;
+    char entry_name[PATH_MAX];
+    struct INC_ENTRY e;
+
+    snprintf(entry_name, sizeof(entry_name), "%s", name);
+    size_t len = strlen(entry_name);
+    if (len > 1 && entry_name[len - 1] == '/')
+        entry_name[len - 1] = '\0';
+    inc_entry_init(&e, st);
+    fprintf(b->list, "%c %o %u %u %u %llu %lld %llu ", e.type, e.mode, e.uid, e.gid,
+            e.nlink, e.size, e.mtime, e.ino);
+    inc_write_name(b->list, entry_name);
+
+    const struct INC_ENTRY* old = b->base != NULL ? inc_find(b->base, entry_name) : NULL;
+    // the link count catches new links to unchanged files, which would
+    // otherwise be stored as copies
+    return old == NULL || old->type != e.type || old->mode != e.mode ||
+            old->uid != e.uid || old->gid != e.gid || old->nlink != e.nlink ||
+            old->size != e.size || old->mtime != e.mtime || old->ino != e.ino;
+}
+
+int nandroid_incremental_backup(const char* backup_path, const char* backup_file_image, const char* base, const struct NANDROID_TAR_OPTIONS* options) {
+    char list_path[PATH_MAX];
+    char tmp[PATH_MAX];
+    struct INC_LIST base_list;
+    struct INC_BACKUP b;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    b.options = options;
+    inc_list_init(&base_list);
+    if (base != NULL) {
+        if (inc_list_load(&base_list, base)) {
+            ui_print("Unable to read %s, making a full backup.\n", base);
+            base = NULL;
+        }
+        else {
+            b.base = &base_list;
+        }
+    }
+
+    snprintf(list_path, sizeof(list_path), "%s.inc", backup_file_image);
+    b.list = fopen(list_path, "w");
+    if (b.list == NULL) {
+        ui_print("Unable to create %s\n", list_path);
+        inc_list_free(&base_list);
+        return 1;
+    }
+    fprintf(b.list, "%s\n", INC_MAGIC);
+    if (base != NULL) {
+        path_dirname(base, tmp);
+        path_basename(tmp, tmp);
+        fprintf(b.list, "base %s\n", tmp);
+        ui_print("Backing up changes since %s...\n", tmp);
+    }
+    for (i = 0; i < options->exclude_count; i++)
+        fprintf(b.list, "exclude %s\n", options->excludes[i]);
+
+    struct NANDROID_TAR_OPTIONS tar_options = *options;
+    tar_options.filter = incremental_filter;
+    tar_options.cookie = &b;
+    int ret = nandroid_tar_backup(backup_path, list_path, &tar_options);
+    if (fclose(b.list) && ret == 0) {
+        ui_print("Error writing %s\n", list_path);
+        ret = 1;
+    }
+    inc_list_free(&base_list);
+    return ret;
+}
+
+static int remove_tree(const char* path) {
+    struct stat st;
+    if (lstat(path, &st))
+        return errno != ENOENT;
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path) != 0;
+
+    DIR* d = opendir(path);
+    if (d == NULL)
+        return 1;
+    int ret = 0;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        char child[PATH_MAX];
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        ret |= remove_tree(child);
+    }
+    closedir(d);
+    return ret || rmdir(path) != 0;
+}
+
+// remove what the base restored but the increment no longer has, or has
+// as another type, before extracting the increment over it
+static int incremental_prune(const struct INC_LIST* list, const char* path, const char* name) {
+    DIR* d = opendir(path);
+    if (d == NULL) {
+        ui_print("Unable to open %s\n", path);
+        return 1;
+    }
+    int ret = 0;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        char child_path[PATH_MAX];
+        char child_name[PATH_MAX];
+        struct stat st;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, de->d_name);
+        snprintf(child_name, sizeof(child_name), "%s/%s", name, de->d_name);
+        if (inc_excluded(list, child_name) || lstat(child_path, &st))
+            continue;
+        const struct INC_ENTRY* e = inc_find(list, child_name);
+        if (e == NULL || e->type != inc_type(st.st_mode)) {
+            if (remove_tree(child_path)) {
+                ui_print("Unable to remove %s\n", child_path);
+                ret = 1;
+            }
+        }
+        else if (S_ISDIR(st.st_mode)) {
+            ret |= incremental_prune(list, child_path, child_name);
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+static int incremental_restore(const char* backup_file_image, const char* backup_path, tar_event_callback callback, int depth) {
+    char tmp[PATH_MAX];
+    char name[PATH_MAX];
+    struct INC_LIST list;
+    struct stat st;
+    int ret = 0;
+
+    inc_list_init(&list);
+    if (inc_list_load(&list, backup_file_image)) {
+        ui_print("Unable to read %s\n", backup_file_image);
+        inc_list_free(&list);
+        return 1;
+    }
+
+    if (list.base[0] != '\0') {
+        // .../backup/<base>/system.ext4.inc, next to this backup
+        char base[PATH_MAX];
+        path_basename(backup_file_image, name);
+        path_dirname(backup_file_image, tmp);
+        path_dirname(tmp, tmp);
+        snprintf(base, sizeof(base), "%s/%s/%s", tmp, list.base, name);
+        if (depth >= INC_MAX_CHAIN) {
+            ui_print("Too many incremental backups in a row.\n");
+            ret = 1;
+        }
+        else if (stat(base, &st)) {
+            ui_print("Missing base backup %s\n", list.base);
+            ret = 1;
+        }
+        else {
+            ret = incremental_restore(base, backup_path, callback, depth + 1);
+        }
+        if (ret == 0) {
+            path_basename(backup_path, tmp);
+            ret = incremental_prune(&list, backup_path, tmp);
+        }
+    }
+
+    if (ret == 0) {
+        snprintf(tmp, sizeof(tmp), "%s.tar", backup_file_image);
+        if (stat(tmp, &st))
+            snprintf(tmp, sizeof(tmp), "%s.tar.gz", backup_file_image);
+        ret = nandroid_tar_restore(tmp, backup_path, callback);
+    }
+    inc_list_free(&list);
+    return ret;
+}
+
+int nandroid_incremental_restore(const char* backup_file_image, const char* backup_path, tar_event_callback callback) {
+    return incremental_restore(backup_file_image, backup_path, callback, 0);
+}
@@ -0,0 +1,22 @@
+#ifndef NANDROID_INCREMENTAL_H
+#define NANDROID_INCREMENTAL_H
+
+#include "nandroid_tar.h"
+
+// incremental tar backups. backup_file_image.inc lists every entry of
+// the partition as it was when backed up, and names the backup it is
+// based on. backup_file_image.inc.tar holds only what changed since:
+// new files, and files whose type, size, mtime, inode, mode or owner
+// differ from the base. directories are always stored.
+
+// back up backup_path, diffing against base, the .inc list of an
+// earlier backup of the same partition, or making a full backup when
+// base is NULL. options->filter is used internally.
+int nandroid_incremental_backup(const char* backup_path, const char* backup_file_image, const char* base, const struct NANDROID_TAR_OPTIONS* options);
+
+// restore the chain of backups ending with backup_file_image (the .inc
+// list): the base first, then each increment on top of it, removing
+// whatever the increment's list no longer has.
+int nandroid_incremental_restore(const char* backup_file_image, const char* backup_path, tar_event_callback callback);
+
+#endif
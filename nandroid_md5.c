@@ -0,0 +1,248 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "nandroid_md5.h"
+
+#define MD5_BUFFER_SIZE (256 * 1024)
+
+struct MD5_ENTRY {
+    char* path;
+    unsigned char digest[MD5_DIGEST_LENGTH];
+};
+
+static pthread_mutex_t md5_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct MD5_ENTRY* md5_entries = NULL;
+static int md5_count = 0;
+static int md5_capacity = 0;
+
+static void md5_clear() {
+    int i;
+    for (i = 0; i < md5_count; i++)
+        free(md5_entries[i].path);
+    free(md5_entries);
+    md5_entries = NULL;
+    md5_count = 0;
+    md5_capacity = 0;
+}
+
+// the same file is named "/sdcard/backup/x" and "/sdcard/backup//x"
+static void md5_key(const char* path, char* key) {
+    char* k = key;
+    for (; *path; path++) {
+        if (*path != '/' || k == key || k[-1] != '/')
+            *k++ = *path;
+    }
+    *k = '\0';
+}
+
+// the caller holds md5_lock
+static struct MD5_ENTRY* md5_find(const char* path) {
+    char key[PATH_MAX];
+    int i;
+    md5_key(path, key);
+    for (i = 0; i < md5_count; i++) {
+        if (strcmp(md5_entries[i].path, key) == 0)
+            return &md5_entries[i];
+    }
+    return NULL;
+}
+
+static void md5_set(const char* path, const unsigned char* digest) {
+    struct MD5_ENTRY* e = md5_find(path);
+    if (e == NULL) {
+        char key[PATH_MAX];
+        md5_key(path, key);
+        if (md5_count == md5_capacity) {
+            md5_capacity = md5_capacity ? md5_capacity * 2 : 32;
+            md5_entries = realloc(md5_entries, md5_capacity * sizeof(struct MD5_ENTRY));
+        }
+        e = &md5_entries[md5_count++];
+        e->path = strdup(key);
+    }
+    memcpy(e->digest, digest, MD5_DIGEST_LENGTH);
+}
+
+void nandroid_md5_reset() {
+    pthread_mutex_lock(&md5_lock);
+    md5_clear();
+    pthread_mutex_unlock(&md5_lock);
+}
+
+void nandroid_md5_add(const char* path, const unsigned char* digest) {
+    pthread_mutex_lock(&md5_lock);
+    md5_set(path, digest);
+    pthread_mutex_unlock(&md5_lock);
+}
+
+int nandroid_md5_verify(const char* path, const unsigned char* digest) {
+    pthread_mutex_lock(&md5_lock);
+    struct MD5_ENTRY* e = md5_find(path);
+    int ret = e != NULL && memcmp(e->digest, digest, MD5_DIGEST_LENGTH) != 0;
+    pthread_mutex_unlock(&md5_lock);
+    return ret;
+}
+
+static int md5_file(const char* path, unsigned char* digest) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    unsigned char* buffer = malloc(MD5_BUFFER_SIZE);
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    ssize_t n;
+    while ((n = read(fd, buffer, MD5_BUFFER_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        MD5_Update(&ctx, buffer, n);
+    }
+    MD5_Final(digest, &ctx);
+    free(buffer);
+    close(fd);
+    return n != 0;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int nandroid_md5_write(const char* backup_path) {
+    char path[PATH_MAX];
+    char** names = NULL;
+    int count = 0;
+    int capacity = 0;
+    int ret = 0;
+    int i, j;
+
+    DIR* d = opendir(backup_path);
+    if (d == NULL) {
+        ui_print("Unable to open %s\n", backup_path);
+        return 1;
+    }
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+        sprintf(path, "%s/%s", backup_path, de->d_name);
+        if (strcmp(de->d_name, NANDROID_MD5_FILE) == 0 || lstat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            names = realloc(names, capacity * sizeof(char*));
+        }
+        names[count++] = strdup(de->d_name);
+    }
+    closedir(d);
+    qsort(names, count, sizeof(char*), compare_names);
+
+    sprintf(path, "%s/%s", backup_path, NANDROID_MD5_FILE);
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        ui_print("Unable to create %s\n", path);
+        ret = 1;
+    }
+    for (i = 0; i < count && ret == 0; i++) {
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        sprintf(path, "%s/%s", backup_path, names[i]);
+        pthread_mutex_lock(&md5_lock);
+        struct MD5_ENTRY* e = md5_find(path);
+        if (e != NULL)
+            memcpy(digest, e->digest, MD5_DIGEST_LENGTH);
+        pthread_mutex_unlock(&md5_lock);
+        // raw images, yaffs2 images and dedupe manifests are written
+        // elsewhere, and are small next to the tar volumes
+        if (e == NULL && md5_file(path, digest)) {
+            ui_print("Unable to read %s\n", path);
+            ret = 1;
+            break;
+        }
+        for (j = 0; j < MD5_DIGEST_LENGTH; j++)
+            fprintf(f, "%02x", digest[j]);
+        fprintf(f, "  %s\n", names[i]);
+    }
+    if (f != NULL && fclose(f) && ret == 0) {
+        ui_print("Error writing %s\n", NANDROID_MD5_FILE);
+        ret = 1;
+    }
+
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    return ret;
+}
+
+static int parse_digest(const char* hex, unsigned char* digest) {
+    int i;
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return 1;
+        digest[i] = byte;
+    }
+    return 0;
+}
+
+// tar volumes, and the empty .tar file in front of them, are read by
+// nandroid_tar_restore, which hashes them on the way.
+static int md5_streamed(const char* name) {
+    return strstr(name, ".tar") != NULL;
+}
+
+int nandroid_md5_check(const char* backup_path) {
+    char path[PATH_MAX];
+    char line[PATH_MAX + 64];
+    int ret = 0;
+    int i;
+
+    sprintf(path, "%s/%s", backup_path, NANDROID_MD5_FILE);
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        ui_print("Unable to open %s\n", path);
+        return 1;
+    }
+    pthread_mutex_lock(&md5_lock);
+    md5_clear();
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        // "<hex>  <name>", or "<hex> *<name>" for binary mode
+        if (len < MD5_DIGEST_LENGTH * 2 + 3 || parse_digest(line, digest) || line[MD5_DIGEST_LENGTH * 2] != ' ')
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", backup_path, line + MD5_DIGEST_LENGTH * 2 + 2) >= (int)sizeof(path)) {
+            // can't be checked, so it doesn't pass
+            ui_print("MD5 mismatch: %s\n", line + MD5_DIGEST_LENGTH * 2 + 2);
+            ret = 1;
+            continue;
+        }
+        md5_set(path, digest);
+    }
+    fclose(f);
+
+    for (i = 0; i < md5_count && ret == 0; i++) {
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        const char* name = strrchr(md5_entries[i].path, '/') + 1;
+        if (md5_streamed(name))
+            continue;
+        if (md5_file(md5_entries[i].path, digest)) {
+            ui_print("Unable to read %s\n", md5_entries[i].path);
+            ret = 1;
+        }
+        else if (memcmp(digest, md5_entries[i].digest, MD5_DIGEST_LENGTH) != 0) {
+            ui_print("MD5 mismatch: %s\n", name);
+            ret = 1;
+        }
+    }
+    pthread_mutex_unlock(&md5_lock);
+    return ret;
+}
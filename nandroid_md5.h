@@ -0,0 +1,31 @@
+#ifndef NANDROID_MD5_H
+#define NANDROID_MD5_H
+
+#include <openssl/md5.h>
+
+#define NANDROID_MD5_FILE "nandroid.md5"
+
+// md5 sums of the files of a backup, taken while the files are written
+// or read, instead of reading every image a second time just to hash it.
+// the functions are safe to call from any thread.
+
+// forget every digest, before a backup
+void nandroid_md5_reset();
+
+// record the digest of path, computed as it was written
+void nandroid_md5_add(const char* path, const unsigned char* digest);
+
+// write backup_path/nandroid.md5 in md5sum's format, covering every
+// file in backup_path. files that were not added are hashed now.
+int nandroid_md5_write(const char* backup_path);
+
+// load backup_path/nandroid.md5 and check the files in it, except for
+// the tar volumes, which the tar reader checks while restoring them.
+// returns nonzero on a mismatch or if there are no sums.
+int nandroid_md5_check(const char* backup_path);
+
+// compare the digest of path, computed as it was read, to the loaded
+// sums. returns nonzero on a mismatch, 0 if it matches or is not listed.
+int nandroid_md5_verify(const char* path, const unsigned char* digest);
+
+#endif
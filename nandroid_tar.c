@@ -0,0 +1,1737 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "nandroid_md5.h"
+#include "nandroid_tar.h"
+
+#define TAR_RECORD_SIZE 512
+// tar pads the archive to a multiple of 20 records
+#define TAR_BLOCKING_SIZE (20 * TAR_RECORD_SIZE)
+// what split cut the volumes at. vfat can not hold files of 4GB or more.
+#define TAR_VOLUME_SIZE 1000000000LL
+// split -a 1
+#define TAR_MAX_VOLUMES 26
+// archive data is handed between threads in buffers of this size
+#define TAR_BUFFER_SIZE (256 * 1024)
+#define TAR_BUFFER_COUNT 16
+#define TAR_HARDLINK_BUCKETS 256
+// backup_file_image.journal, the volumes a resumed backup can keep
+#define TAR_JOURNAL_MAGIC "nandroid-tar-journal 1"
+// speed over size, this runs on phones
+#define TAR_GZIP_LEVEL 1
+#define TAR_GZIP_MAX_THREADS 8
+// a compressed buffer, with room for deflate's worst case and the gzip
+// header and trailer
+#define TAR_GZIP_BUFFER_SIZE (TAR_BUFFER_SIZE + TAR_BUFFER_SIZE / 16 + 64)
+
+// a posix ustar header
+struct TAR_HEADER {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+struct TAR_BUFFER {
+    unsigned char* data;
+    size_t length;
+    struct TAR_BUFFER* next;
+};
+
+// a fixed pool of buffers passed from a producer thread to a consumer
+// thread. full buffers arrive in order, empty ones are recycled, so the
+// producer blocks once the consumer falls TAR_BUFFER_COUNT behind.
+struct BUFFER_QUEUE {
+    pthread_mutex_t lock;
+    size_t buffer_size;
+    pthread_cond_t changed;
+    struct TAR_BUFFER* buffers;
+    struct TAR_BUFFER* empty;
+    struct TAR_BUFFER* head;
+    struct TAR_BUFFER* tail;
+    // the producer is done
+    int closed;
+    // either side gave up
+    int failed;
+};
+
+static void queue_init(struct BUFFER_QUEUE* q, size_t buffer_size) {
+    int i;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+    q->buffer_size = buffer_size;
+    q->buffers = calloc(TAR_BUFFER_COUNT, sizeof(struct TAR_BUFFER));
+    q->empty = NULL;
+    for (i = 0; i < TAR_BUFFER_COUNT; i++) {
+        q->buffers[i].data = malloc(buffer_size);
+        q->buffers[i].next = q->empty;
+        q->empty = &q->buffers[i];
+    }
+    q->head = q->tail = NULL;
+    q->closed = 0;
+    q->failed = 0;
+}
+
+static void queue_destroy(struct BUFFER_QUEUE* q) {
+    int i;
+    for (i = 0; i < TAR_BUFFER_COUNT; i++)
+        free(q->buffers[i].data);
+    free(q->buffers);
+    pthread_cond_destroy(&q->changed);
+    pthread_mutex_destroy(&q->lock);
+}
+
+// an empty buffer to fill, or NULL once the consumer has failed.
+static struct TAR_BUFFER* queue_get_empty(struct BUFFER_QUEUE* q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->empty == NULL && !q->failed)
+        pthread_cond_wait(&q->changed, &q->lock);
+    struct TAR_BUFFER* b = q->failed ? NULL : q->empty;
+    if (b != NULL) {
+        q->empty = b->next;
+        b->length = 0;
+        b->next = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return b;
+}
+
+static void queue_put_full(struct BUFFER_QUEUE* q, struct TAR_BUFFER* b) {
+    pthread_mutex_lock(&q->lock);
+    b->next = NULL;
+    if (q->tail != NULL)
+        q->tail->next = b;
+    else
+        q->head = b;
+    q->tail = b;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// the next full buffer, or NULL at the end of the stream or once the
+// producer has failed.
+static struct TAR_BUFFER* queue_get_full(struct BUFFER_QUEUE* q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->head == NULL && !q->closed && !q->failed)
+        pthread_cond_wait(&q->changed, &q->lock);
+    struct TAR_BUFFER* b = q->failed ? NULL : q->head;
+    if (b != NULL) {
+        q->head = b->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return b;
+}
+
+static void queue_put_empty(struct BUFFER_QUEUE* q, struct TAR_BUFFER* b) {
+    pthread_mutex_lock(&q->lock);
+    b->next = q->empty;
+    q->empty = b;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_close(struct BUFFER_QUEUE* q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_fail(struct BUFFER_QUEUE* q) {
+    pthread_mutex_lock(&q->lock);
+    q->failed = 1;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int write_all(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// the entry that holds a given byte of the archive. a resumed backup
+// only keeps its volumes if the same entries end them again.
+struct TAR_CHECKPOINT {
+    unsigned long long start;
+    unsigned long long size;
+    long long mtime;
+    unsigned long name_crc;
+    // the digest of the volume it ends, for nandroid.md5
+    unsigned char digest[MD5_DIGEST_LENGTH];
+};
+
+static int tar_journal_write(FILE* f, int volume, const struct TAR_CHECKPOINT* c) {
+    int i;
+    fprintf(f, "%d ", volume);
+    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+        fprintf(f, "%02x", c->digest[i]);
+    fprintf(f, " %llu %llu %lld %lu\n", c->start, c->size, c->mtime, c->name_crc);
+    return fflush(f) || fsync(fileno(f));
+}
+
+// "<prefix>a", "<prefix>b"... returns 1 if the name does not fit in
+// PATH_MAX.
+static int volume_path(char* path, const char* prefix, int volume) {
+    return snprintf(path, PATH_MAX, "%s%c", prefix, 'a' + volume) >= PATH_MAX;
+}
+
+// the volumes listed in the journal that are still whole on the card.
+// a line cut short by the interruption ends the list.
+static int tar_journal_load(const char* journal, const char* prefix, struct TAR_CHECKPOINT* kept) {
+    char line[256];
+    char path[PATH_MAX];
+    int count = 0;
+    FILE* f = fopen(journal, "r");
+    if (f == NULL)
+        return 0;
+    if (fgets(line, sizeof(line), f) == NULL || strcmp(line, TAR_JOURNAL_MAGIC "\n") != 0) {
+        fclose(f);
+        return 0;
+    }
+    while (count < TAR_MAX_VOLUMES && fgets(line, sizeof(line), f) != NULL) {
+        struct TAR_CHECKPOINT* c = &kept[count];
+        char hex[2 * MD5_DIGEST_LENGTH + 1];
+        struct stat st;
+        int volume;
+        int i;
+        if (strchr(line, '\n') == NULL ||
+                sscanf(line, "%d %32s %llu %llu %lld %lu", &volume, hex, &c->start, &c->size, &c->mtime, &c->name_crc) != 6 ||
+                volume != count || strlen(hex) != sizeof(hex) - 1)
+            break;
+        for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+            unsigned int byte;
+            if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+                break;
+            c->digest[i] = byte;
+        }
+        if (i < MD5_DIGEST_LENGTH || volume_path(path, prefix, count) ||
+                stat(path, &st) || st.st_size != TAR_VOLUME_SIZE)
+            break;
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+// writes the archive out as split volumes on its own thread, so the
+// sd card is busy while the next files are read. each volume is hashed
+// on the way for nandroid.md5.
+struct VOLUME_WRITER {
+    struct BUFFER_QUEUE* queue;
+    char prefix[PATH_MAX];
+    char path[PATH_MAX];
+    int fd;
+    int volume;
+    long long volume_written;
+    MD5_CTX md5;
+    // full volumes are synced and listed here, when journaling
+    FILE* journal;
+    // filled in by the TAR_WRITER before the volume's last byte is queued
+    struct TAR_CHECKPOINT* boundaries;
+    int ret;
+};
+
+static int finish_volume(struct VOLUME_WRITER* w) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    if (w->fd < 0)
+        return 0;
+    // a journaled volume has to be on the card before it is listed
+    int ret = (w->journal != NULL && fsync(w->fd)) | close(w->fd);
+    w->fd = -1;
+    MD5_Final(digest, &w->md5);
+    if (ret == 0)
+        nandroid_md5_add(w->path, digest);
+    if (ret == 0 && w->journal != NULL && w->volume_written == TAR_VOLUME_SIZE) {
+        memcpy(w->boundaries[w->volume - 1].digest, digest, sizeof(digest));
+        ret = tar_journal_write(w->journal, w->volume - 1, &w->boundaries[w->volume - 1]);
+    }
+    return ret;
+}
+
+static int next_volume(struct VOLUME_WRITER* w) {
+    if (finish_volume(w))
+        return 1;
+    if (w->volume == TAR_MAX_VOLUMES) {
+        ui_print("Backup is too large, out of volume names.\n");
+        return 1;
+    }
+    if (volume_path(w->path, w->prefix, w->volume)) {
+        ui_print("Path too long: %s\n", w->prefix);
+        return 1;
+    }
+    w->fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (w->fd < 0) {
+        ui_print("Unable to create %s\n", w->path);
+        return 1;
+    }
+    MD5_Init(&w->md5);
+    w->volume++;
+    w->volume_written = 0;
+    return 0;
+}
+
+static void* volume_writer_thread(void* cookie) {
+    struct VOLUME_WRITER* w = (struct VOLUME_WRITER*)cookie;
+    struct TAR_BUFFER* b;
+    while (w->ret == 0 && (b = queue_get_full(w->queue)) != NULL) {
+        size_t done = 0;
+        while (w->ret == 0 && done < b->length) {
+            if (w->fd < 0 || w->volume_written == TAR_VOLUME_SIZE) {
+                if ((w->ret = next_volume(w)))
+                    break;
+            }
+            size_t n = b->length - done;
+            if ((long long)n > TAR_VOLUME_SIZE - w->volume_written)
+                n = TAR_VOLUME_SIZE - w->volume_written;
+            if (write_all(w->fd, b->data + done, n)) {
+                ui_print("Error writing backup volume: %s\n", strerror(errno));
+                w->ret = 1;
+                break;
+            }
+            MD5_Update(&w->md5, b->data + done, n);
+            done += n;
+            w->volume_written += n;
+        }
+        queue_put_empty(w->queue, b);
+    }
+    if (finish_volume(w) && w->ret == 0) {
+        ui_print("Error writing backup volume: %s\n", strerror(errno));
+        w->ret = 1;
+    }
+    if (w->ret)
+        queue_fail(w->queue);
+    return NULL;
+}
+
+// compresses the archive on every core, like pigz. each buffer becomes
+// a gzip member of its own, and concatenated members are still one
+// valid gzip stream, so the volumes can be joined and gunzip'ed.
+struct GZIP_COMPRESSOR {
+    struct BUFFER_QUEUE* in;
+    struct BUFFER_QUEUE* out;
+    // buffers are numbered as they are taken...
+    pthread_mutex_t take_lock;
+    unsigned long next_in;
+    // ...and handed on in that order
+    pthread_mutex_t order_lock;
+    pthread_cond_t turn;
+    unsigned long next_out;
+    int failed;
+};
+
+static void gzip_fail(struct GZIP_COMPRESSOR* c) {
+    pthread_mutex_lock(&c->order_lock);
+    c->failed = 1;
+    pthread_cond_broadcast(&c->turn);
+    pthread_mutex_unlock(&c->order_lock);
+    queue_fail(c->in);
+    queue_fail(c->out);
+}
+
+static void* gzip_compressor_thread(void* cookie) {
+    struct GZIP_COMPRESSOR* c = (struct GZIP_COMPRESSOR*)cookie;
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, TAR_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        ui_print("Unable to start the backup compressor.\n");
+        gzip_fail(c);
+        return NULL;
+    }
+    for (;;) {
+        // take the output buffer first, so the thread with the oldest
+        // block never waits for one held by a newer block.
+        struct TAR_BUFFER* out = queue_get_empty(c->out);
+        if (out == NULL) {
+            // the writer gave up
+            queue_fail(c->in);
+            break;
+        }
+        pthread_mutex_lock(&c->take_lock);
+        struct TAR_BUFFER* in = queue_get_full(c->in);
+        unsigned long sequence = c->next_in++;
+        pthread_mutex_unlock(&c->take_lock);
+        if (in == NULL) {
+            queue_put_empty(c->out, out);
+            break;
+        }
+
+        deflateReset(&z);
+        z.next_in = in->data;
+        z.avail_in = in->length;
+        z.next_out = out->data;
+        z.avail_out = TAR_GZIP_BUFFER_SIZE;
+        int ok = deflate(&z, Z_FINISH) == Z_STREAM_END;
+        out->length = TAR_GZIP_BUFFER_SIZE - z.avail_out;
+        queue_put_empty(c->in, in);
+
+        pthread_mutex_lock(&c->order_lock);
+        while (c->next_out != sequence && !c->failed)
+            pthread_cond_wait(&c->turn, &c->order_lock);
+        if (ok && !c->failed) {
+            queue_put_full(c->out, out);
+            c->next_out++;
+            pthread_cond_broadcast(&c->turn);
+            out = NULL;
+        }
+        pthread_mutex_unlock(&c->order_lock);
+        if (out != NULL) {
+            queue_put_empty(c->out, out);
+            if (!ok)
+                ui_print("Error compressing the backup.\n");
+            gzip_fail(c);
+            break;
+        }
+    }
+    deflateEnd(&z);
+    return NULL;
+}
+
+static int gzip_thread_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > TAR_GZIP_MAX_THREADS ? TAR_GZIP_MAX_THREADS : cpus;
+}
+
+struct HARDLINK {
+    dev_t dev;
+    ino_t ino;
+    char* name;
+    struct HARDLINK* next;
+};
+
+struct TAR_WRITER {
+    struct BUFFER_QUEUE* queue;
+    struct TAR_BUFFER* buffer;
+    unsigned long long offset;
+    const struct NANDROID_TAR_OPTIONS* options;
+    // first archive name of every file with more than one link
+    struct HARDLINK* hardlinks[TAR_HARDLINK_BUCKETS];
+    // the entry being written, and the ones that end each volume
+    struct TAR_CHECKPOINT entry;
+    struct TAR_CHECKPOINT* boundaries;
+    // resuming: the archive up to skip is in the kept volumes already,
+    // and the journal says which entries ended them
+    unsigned long long skip;
+    const struct TAR_CHECKPOINT* kept;
+    int kept_count;
+    int mismatch;
+};
+
+// room left in the current buffer, handing it on when it is full.
+static unsigned char* tar_space(struct TAR_WRITER* w, size_t* space) {
+    if (w->buffer != NULL && w->buffer->length == TAR_BUFFER_SIZE) {
+        queue_put_full(w->queue, w->buffer);
+        w->buffer = NULL;
+    }
+    if (w->buffer == NULL && (w->buffer = queue_get_empty(w->queue)) == NULL)
+        return NULL;
+    *space = TAR_BUFFER_SIZE - w->buffer->length;
+    return w->buffer->data + w->buffer->length;
+}
+
+// moves the archive offset on, noting the entry under the last byte of
+// every volume passed
+static void tar_advance(struct TAR_WRITER* w, unsigned long long len) {
+    unsigned long long end = w->offset + len;
+    unsigned long long k;
+    for (k = w->offset / TAR_VOLUME_SIZE; (k + 1) * TAR_VOLUME_SIZE <= end && k < TAR_MAX_VOLUMES; k++) {
+        w->boundaries[k] = w->entry;
+        if ((int)k < w->kept_count) {
+            const struct TAR_CHECKPOINT* c = &w->kept[k];
+            if (c->start != w->entry.start || c->size != w->entry.size ||
+                    c->mtime != w->entry.mtime || c->name_crc != w->entry.name_crc)
+                w->mismatch = 1;
+        }
+    }
+    w->offset = end;
+}
+
+static void tar_commit(struct TAR_WRITER* w, size_t len) {
+    w->buffer->length += len;
+    tar_advance(w, len);
+}
+
+static int tar_write(struct TAR_WRITER* w, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    if (w->offset < w->skip) {
+        unsigned long long n = w->skip - w->offset;
+        if (n > len)
+            n = len;
+        tar_advance(w, n);
+        if (p != NULL)
+            p += n;
+        len -= n;
+    }
+    while (len > 0) {
+        size_t space;
+        unsigned char* dst = tar_space(w, &space);
+        if (dst == NULL)
+            return 1;
+        if (space > len)
+            space = len;
+        if (p != NULL) {
+            memcpy(dst, p, space);
+            p += space;
+        }
+        else {
+            memset(dst, 0, space);
+        }
+        tar_commit(w, space);
+        len -= space;
+    }
+    return 0;
+}
+
+// zero fill up to the next multiple of size
+static int tar_pad(struct TAR_WRITER* w, unsigned long long size) {
+    unsigned long long rest = w->offset % size;
+    return rest ? tar_write(w, NULL, size - rest) : 0;
+}
+
+// values too large for the octal field use gnu's base-256 encoding
+static void tar_number(char* field, size_t width, unsigned long long value) {
+    if (value >= 1ULL << (3 * (width - 1))) {
+        size_t i;
+        memset(field, 0, width);
+        for (i = width - 1; i > 0; i--) {
+            field[i] = value & 0xff;
+            value >>= 8;
+        }
+        field[0] = 0x80;
+        return;
+    }
+    sprintf(field, "%0*llo", (int)width - 1, value);
+}
+
+static void tar_checksum(struct TAR_HEADER* h) {
+    const unsigned char* p = (const unsigned char*)h;
+    unsigned int sum = 0;
+    size_t i;
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (i = 0; i < sizeof(*h); i++)
+        sum += p[i];
+    sprintf(h->chksum, "%06o", sum);
+    h->chksum[7] = ' ';
+}
+
+// a gnu long name ('L') or long link ('K') pseudo entry
+static int tar_long_entry(struct TAR_WRITER* w, char type, const char* value) {
+    struct TAR_HEADER h;
+    size_t len = strlen(value) + 1;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, "././@LongLink");
+    tar_number(h.mode, sizeof(h.mode), 0);
+    tar_number(h.uid, sizeof(h.uid), 0);
+    tar_number(h.gid, sizeof(h.gid), 0);
+    tar_number(h.size, sizeof(h.size), len);
+    tar_number(h.mtime, sizeof(h.mtime), 0);
+    h.typeflag = type;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+    tar_checksum(&h);
+    if (tar_write(w, &h, sizeof(h)) || tar_write(w, value, len))
+        return 1;
+    return tar_pad(w, TAR_RECORD_SIZE);
+}
+
+static int tar_header(struct TAR_WRITER* w, const char* name, const struct stat* st, char type, const char* link, unsigned long long size) {
+    struct TAR_HEADER h;
+    size_t len = strlen(name);
+    memset(&h, 0, sizeof(h));
+
+    w->entry.start = w->offset;
+    w->entry.size = size;
+    w->entry.mtime = st->st_mtime;
+    w->entry.name_crc = crc32(0, (const Bytef*)name, len);
+
+    if (link != NULL && strlen(link) > sizeof(h.linkname)) {
+        if (tar_long_entry(w, 'K', link))
+            return 1;
+    }
+    if (link != NULL)
+        strncpy(h.linkname, link, sizeof(h.linkname));
+
+    if (len <= sizeof(h.name)) {
+        memcpy(h.name, name, len);
+    }
+    else {
+        // split at a '/' into prefix and name if possible
+        const char* split = NULL;
+        const char* p;
+        for (p = name + len - 1; p > name; p--) {
+            if (*p == '/' && (size_t)(p - name) <= sizeof(h.prefix) && len - (p - name) - 1 <= sizeof(h.name) && p[1] != '\0') {
+                split = p;
+                break;
+            }
+        }
+        if (split != NULL) {
+            memcpy(h.prefix, name, split - name);
+            memcpy(h.name, split + 1, len - (split - name) - 1);
+        }
+        else {
+            if (tar_long_entry(w, 'L', name))
+                return 1;
+            memcpy(h.name, name, sizeof(h.name));
+        }
+    }
+
+    tar_number(h.mode, sizeof(h.mode), st->st_mode & 07777);
+    tar_number(h.uid, sizeof(h.uid), st->st_uid);
+    tar_number(h.gid, sizeof(h.gid), st->st_gid);
+    tar_number(h.size, sizeof(h.size), size);
+    tar_number(h.mtime, sizeof(h.mtime), st->st_mtime);
+    h.typeflag = type;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+    if (type == '3' || type == '4') {
+        tar_number(h.devmajor, sizeof(h.devmajor), major(st->st_rdev));
+        tar_number(h.devminor, sizeof(h.devminor), minor(st->st_rdev));
+    }
+    tar_checksum(&h);
+    return tar_write(w, &h, sizeof(h));
+}
+
+// returns the archive name the file was first stored under, or records
+// this one.
+static const char* tar_hardlink(struct TAR_WRITER* w, const struct stat* st, const char* name) {
+    unsigned int bucket = (unsigned int)(st->st_ino ^ st->st_dev) % TAR_HARDLINK_BUCKETS;
+    struct HARDLINK* l;
+    for (l = w->hardlinks[bucket]; l != NULL; l = l->next) {
+        if (l->ino == st->st_ino && l->dev == st->st_dev)
+            return l->name;
+    }
+    l = malloc(sizeof(struct HARDLINK));
+    l->dev = st->st_dev;
+    l->ino = st->st_ino;
+    l->name = strdup(name);
+    l->next = w->hardlinks[bucket];
+    w->hardlinks[bucket] = l;
+    return NULL;
+}
+
+static int tar_file_data(struct TAR_WRITER* w, const char* path, unsigned long long size) {
+    if (w->offset + size <= w->skip) {
+        // in the kept volumes already
+        tar_advance(w, size);
+        return tar_pad(w, TAR_RECORD_SIZE);
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ui_print("Unable to open %s\n", path);
+        return 1;
+    }
+    if (w->offset < w->skip) {
+        off_t done = w->skip - w->offset;
+        if (lseek(fd, done, SEEK_SET) != done) {
+            ui_print("Error reading %s\n", path);
+            close(fd);
+            return 1;
+        }
+        tar_advance(w, done);
+        size -= done;
+    }
+    // read straight into the archive buffers
+    while (size > 0) {
+        size_t space;
+        unsigned char* dst = tar_space(w, &space);
+        if (dst == NULL) {
+            close(fd);
+            return 1;
+        }
+        if (space > size)
+            space = size;
+        ssize_t n = read(fd, dst, space);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ui_print("Error reading %s\n", path);
+            close(fd);
+            return 1;
+        }
+        if (n == 0) {
+            // the file shrank since it was stat'ed. like tar, keep the
+            // archive consistent with the header.
+            close(fd);
+            return tar_write(w, NULL, size) || tar_pad(w, TAR_RECORD_SIZE);
+        }
+        tar_commit(w, n);
+        size -= n;
+    }
+    close(fd);
+    return tar_pad(w, TAR_RECORD_SIZE);
+}
+
+static int tar_entry(struct TAR_WRITER* w, const char* path, const char* name) {
+    struct stat st;
+    int i;
+    if (w->mismatch)
+        return 1;
+    for (i = 0; i < w->options->exclude_count; i++) {
+        if (strcmp(w->options->excludes[i], name) == 0)
+            return 0;
+    }
+    if (lstat(path, &st)) {
+        // vanished since the directory was read
+        ui_print("Unable to stat %s\n", path);
+        return 0;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        char dir_name[PATH_MAX];
+        snprintf(dir_name, sizeof(dir_name), "%s/", name);
+        // directories are always archived, they are small
+        if (w->options->filter != NULL)
+            w->options->filter(dir_name, &st, w->options->cookie);
+        if (tar_header(w, dir_name, &st, '5', NULL, 0))
+            return 1;
+        if (w->options->callback)
+            w->options->callback(dir_name, 0);
+
+        DIR* d = opendir(path);
+        if (d == NULL) {
+            ui_print("Unable to open %s\n", path);
+            return 0;
+        }
+        struct dirent* de;
+        int ret = 0;
+        while (ret == 0 && (de = readdir(d)) != NULL) {
+            char child_path[PATH_MAX];
+            char child_name[PATH_MAX];
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            snprintf(child_path, sizeof(child_path), "%s/%s", path, de->d_name);
+            snprintf(child_name, sizeof(child_name), "%s/%s", name, de->d_name);
+            ret = tar_entry(w, child_path, child_name);
+        }
+        closedir(d);
+        return ret;
+    }
+
+    if (w->options->filter != NULL && !w->options->filter(name, &st, w->options->cookie)) {
+        if (w->options->callback)
+            w->options->callback(name, S_ISREG(st.st_mode) ? st.st_size : 0);
+        return 0;
+    }
+    // a second link to a file is stored without its data
+    const char* first = S_ISREG(st.st_mode) && st.st_nlink > 1 ? tar_hardlink(w, &st, name) : NULL;
+    if (w->options->callback)
+        w->options->callback(name, S_ISREG(st.st_mode) && first == NULL ? st.st_size : 0);
+    if (S_ISREG(st.st_mode)) {
+        if (first != NULL)
+            return tar_header(w, name, &st, '1', first, 0);
+        if (tar_header(w, name, &st, '0', NULL, st.st_size))
+            return 1;
+        return tar_file_data(w, path, st.st_size);
+    }
+    if (S_ISLNK(st.st_mode)) {
+        char link[PATH_MAX];
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        if (len < 0) {
+            ui_print("Unable to read link %s\n", path);
+            return 0;
+        }
+        link[len] = '\0';
+        return tar_header(w, name, &st, '2', link, 0);
+    }
+    if (S_ISCHR(st.st_mode))
+        return tar_header(w, name, &st, '3', NULL, 0);
+    if (S_ISBLK(st.st_mode))
+        return tar_header(w, name, &st, '4', NULL, 0);
+    if (S_ISFIFO(st.st_mode))
+        return tar_header(w, name, &st, '6', NULL, 0);
+    // sockets can not be archived
+    return 0;
+}
+
+// archives the partition after the first kept_count volumes, which
+// are left as they are. sets *mismatch if the partition no longer
+// matches them.
+static int tar_backup(const char* backup_path, const char* backup_file_image, const struct NANDROID_TAR_OPTIONS* options,
+        const char* journal, const struct TAR_CHECKPOINT* kept, int kept_count, int* mismatch) {
+    char tmp[PATH_MAX];
+    char name[PATH_MAX];
+    int compress = options->compress;
+    const char* extension = compress ? "tar.gz" : "tar";
+    struct BUFFER_QUEUE queue;
+    struct BUFFER_QUEUE packed;
+    struct VOLUME_WRITER writer;
+    struct GZIP_COMPRESSOR compressor;
+    struct TAR_WRITER w;
+    struct TAR_CHECKPOINT boundaries[TAR_MAX_VOLUMES];
+    pthread_t thread;
+    pthread_t compressor_threads[TAR_GZIP_MAX_THREADS];
+    int compressor_count = 0;
+    int i;
+
+    path_basename(backup_path, name);
+
+    memset(&writer, 0, sizeof(writer));
+    // the longest volume name fitting means they all do
+    if (snprintf(writer.prefix, sizeof(writer.prefix), "%s.%s.", backup_file_image, extension) >= (int)sizeof(writer.prefix) ||
+            volume_path(tmp, writer.prefix, TAR_MAX_VOLUMES - 1)) {
+        ui_print("Path too long: %s\n", backup_file_image);
+        return 1;
+    }
+    // volumes left over from an interrupted run would be restored too
+    for (i = kept_count; i < TAR_MAX_VOLUMES; i++) {
+        volume_path(tmp, writer.prefix, i);
+        unlink(tmp);
+    }
+    if (journal != NULL) {
+        writer.journal = fopen(journal, "w");
+        if (writer.journal == NULL) {
+            ui_print("Unable to create %s\n", journal);
+            return 1;
+        }
+        fprintf(writer.journal, "%s\n", TAR_JOURNAL_MAGIC);
+        for (i = 0; i < kept_count; i++) {
+            if (tar_journal_write(writer.journal, i, &kept[i])) {
+                ui_print("Error writing %s\n", journal);
+                fclose(writer.journal);
+                return 1;
+            }
+        }
+    }
+    for (i = 0; i < kept_count; i++) {
+        volume_path(tmp, writer.prefix, i);
+        nandroid_md5_add(tmp, kept[i].digest);
+    }
+
+    // restore looks for the .tar file, the data is in the .tar.? volumes
+    sprintf(tmp, "%s.%s", backup_file_image, extension);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        ui_print("Unable to create %s\n", tmp);
+        if (writer.journal != NULL)
+            fclose(writer.journal);
+        return 1;
+    }
+    close(fd);
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5((const unsigned char*)"", 0, digest);
+    nandroid_md5_add(tmp, digest);
+
+    queue_init(&queue, TAR_BUFFER_SIZE);
+    if (compress)
+        queue_init(&packed, TAR_GZIP_BUFFER_SIZE);
+    writer.queue = compress ? &packed : &queue;
+    writer.fd = -1;
+    writer.volume = kept_count;
+    writer.boundaries = boundaries;
+    if (pthread_create(&thread, NULL, volume_writer_thread, &writer)) {
+        ui_print("Unable to start the backup writer.\n");
+        queue_destroy(&queue);
+        if (compress)
+            queue_destroy(&packed);
+        if (writer.journal != NULL)
+            fclose(writer.journal);
+        return 1;
+    }
+
+    if (compress) {
+        memset(&compressor, 0, sizeof(compressor));
+        compressor.in = &queue;
+        compressor.out = &packed;
+        pthread_mutex_init(&compressor.take_lock, NULL);
+        pthread_mutex_init(&compressor.order_lock, NULL);
+        pthread_cond_init(&compressor.turn, NULL);
+        int count = gzip_thread_count();
+        while (compressor_count < count) {
+            if (pthread_create(&compressor_threads[compressor_count], NULL, gzip_compressor_thread, &compressor))
+                break;
+            compressor_count++;
+        }
+        if (compressor_count == 0) {
+            ui_print("Unable to start the backup compressor.\n");
+            gzip_fail(&compressor);
+        }
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.queue = &queue;
+    w.options = options;
+    w.boundaries = boundaries;
+    w.skip = kept_count * TAR_VOLUME_SIZE;
+    w.kept = kept;
+    w.kept_count = kept_count;
+    int ret = tar_entry(&w, backup_path, name);
+    // the end of archive marker, then pad like tar does
+    if (ret == 0) {
+        memset(&w.entry, 0, sizeof(w.entry));
+        w.entry.start = w.offset;
+        ret = tar_write(&w, NULL, 2 * TAR_RECORD_SIZE) || tar_pad(&w, TAR_BLOCKING_SIZE);
+    }
+    // the partition shrank below what the kept volumes hold
+    if (w.offset < w.skip)
+        w.mismatch = 1;
+    *mismatch = w.mismatch;
+    if (w.mismatch)
+        ret = 1;
+    if (w.buffer != NULL)
+        queue_put_full(&queue, w.buffer);
+    if (ret)
+        queue_fail(&queue);
+    else
+        queue_close(&queue);
+    if (compress) {
+        for (i = 0; i < compressor_count; i++)
+            pthread_join(compressor_threads[i], NULL);
+        if (ret || compressor.failed || compressor_count == 0)
+            queue_fail(&packed);
+        else
+            queue_close(&packed);
+    }
+    pthread_join(thread, NULL);
+    queue_destroy(&queue);
+    if (compress) {
+        queue_destroy(&packed);
+        pthread_cond_destroy(&compressor.turn);
+        pthread_mutex_destroy(&compressor.order_lock);
+        pthread_mutex_destroy(&compressor.take_lock);
+        if (compressor.failed)
+            ret = 1;
+    }
+
+    for (i = 0; i < TAR_HARDLINK_BUCKETS; i++) {
+        struct HARDLINK* l = w.hardlinks[i];
+        while (l != NULL) {
+            struct HARDLINK* next = l->next;
+            free(l->name);
+            free(l);
+            l = next;
+        }
+    }
+    if (writer.journal != NULL)
+        fclose(writer.journal);
+    return ret || writer.ret;
+}
+
+int nandroid_tar_backup(const char* backup_path, const char* backup_file_image, const struct NANDROID_TAR_OPTIONS* options) {
+    struct TAR_CHECKPOINT kept[TAR_MAX_VOLUMES];
+    char journal[PATH_MAX];
+    char prefix[PATH_MAX];
+    int kept_count = 0;
+    int mismatch = 0;
+    // a gzip stream can not be picked up part way, it is redone whole
+    int journaling = options->journal && !options->compress;
+
+    if (snprintf(journal, sizeof(journal), "%s.journal", backup_file_image) >= (int)sizeof(journal)) {
+        ui_print("Path too long: %s\n", backup_file_image);
+        return 1;
+    }
+    snprintf(prefix, sizeof(prefix), "%s.tar.", backup_file_image);
+    if (journaling && (kept_count = tar_journal_load(journal, prefix, kept)) > 0)
+        ui_print("Resuming after %d volume%s...\n", kept_count, kept_count > 1 ? "s" : "");
+    int ret = tar_backup(backup_path, backup_file_image, options, journaling ? journal : NULL, kept, kept_count, &mismatch);
+    if (ret && mismatch) {
+        ui_print("%s changed since it was interrupted, starting it over.\n", backup_path);
+        ret = tar_backup(backup_path, backup_file_image, options, journal, kept, 0, &mismatch);
+    }
+    if (ret == 0 && journaling)
+        unlink(journal);
+    return ret;
+}
+
+// reads the volumes on its own thread, so the sd card is busy while
+// the previous files are written out. each volume is checked against
+// nandroid.md5 as it is read, and dropped from the page cache once it
+// has been, so it does not push out what is being restored.
+struct VOLUME_READER {
+    struct BUFFER_QUEUE* queue;
+    char** volumes;
+    int count;
+    int ret;
+};
+
+static void* volume_reader_thread(void* cookie) {
+    struct VOLUME_READER* r = (struct VOLUME_READER*)cookie;
+    int i;
+    for (i = 0; i < r->count && r->ret == 0; i++) {
+        int fd = open(r->volumes[i], O_RDONLY);
+        if (fd < 0) {
+            ui_print("Unable to open %s\n", r->volumes[i]);
+            r->ret = 1;
+            break;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        off_t offset = 0;
+        MD5_CTX md5;
+        MD5_Init(&md5);
+        for (;;) {
+            struct TAR_BUFFER* b = queue_get_empty(r->queue);
+            if (b == NULL) {
+                // the extractor gave up
+                r->ret = 1;
+                break;
+            }
+            ssize_t n;
+            do {
+                n = read(fd, b->data, TAR_BUFFER_SIZE);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) {
+                queue_put_empty(r->queue, b);
+                if (n < 0) {
+                    ui_print("Error reading %s\n", r->volumes[i]);
+                    r->ret = 1;
+                }
+                break;
+            }
+            MD5_Update(&md5, b->data, n);
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+#endif
+            offset += n;
+            b->length = n;
+            queue_put_full(r->queue, b);
+        }
+        close(fd);
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        MD5_Final(digest, &md5);
+        if (r->ret == 0 && nandroid_md5_verify(r->volumes[i], digest)) {
+            ui_print("MD5 mismatch: %s\n", r->volumes[i]);
+            r->ret = 1;
+        }
+    }
+    if (r->ret)
+        queue_fail(r->queue);
+    else
+        queue_close(r->queue);
+    return NULL;
+}
+
+// inflates a compressed archive on its own thread, between the volume
+// reader and the extractor.
+struct GZIP_DECOMPRESSOR {
+    struct BUFFER_QUEUE* in;
+    struct BUFFER_QUEUE* out;
+    int ret;
+};
+
+static void* gzip_decompressor_thread(void* cookie) {
+    struct GZIP_DECOMPRESSOR* d = (struct GZIP_DECOMPRESSOR*)cookie;
+    struct TAR_BUFFER* in;
+    struct TAR_BUFFER* out = NULL;
+    z_stream z;
+    // inside a gzip member, as opposed to between two of them
+    int member = 0;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 16) != Z_OK) {
+        ui_print("Unable to start the backup decompressor.\n");
+        d->ret = 1;
+    }
+    while (d->ret == 0 && (in = queue_get_full(d->in)) != NULL) {
+        z.next_in = in->data;
+        z.avail_in = in->length;
+        while (d->ret == 0 && z.avail_in > 0) {
+            if (out == NULL && (out = queue_get_empty(d->out)) == NULL) {
+                // the extractor gave up
+                d->ret = 1;
+                break;
+            }
+            z.next_out = out->data + out->length;
+            z.avail_out = TAR_BUFFER_SIZE - out->length;
+            member = 1;
+            int zret = inflate(&z, Z_NO_FLUSH);
+            out->length = TAR_BUFFER_SIZE - z.avail_out;
+            if (zret == Z_STREAM_END) {
+                // another member may follow
+                inflateReset(&z);
+                member = 0;
+            }
+            else if (zret != Z_OK && zret != Z_BUF_ERROR) {
+                ui_print("Corrupt compressed backup.\n");
+                d->ret = 1;
+            }
+            if (out->length == TAR_BUFFER_SIZE) {
+                queue_put_full(d->out, out);
+                out = NULL;
+            }
+        }
+        queue_put_empty(d->in, in);
+    }
+    if (d->ret == 0 && member) {
+        ui_print("Compressed backup is truncated.\n");
+        d->ret = 1;
+    }
+    if (out != NULL) {
+        if (out->length > 0)
+            queue_put_full(d->out, out);
+        else
+            queue_put_empty(d->out, out);
+    }
+    inflateEnd(&z);
+    if (d->ret) {
+        queue_fail(d->in);
+        queue_fail(d->out);
+    }
+    else {
+        queue_close(d->out);
+    }
+    return NULL;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void path_dirname(const char* path, char* dir) {
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+        return;
+    }
+    while (slash > path && slash[-1] == '/')
+        slash--;
+    if (slash == path) {
+        strcpy(dir, "/");
+        return;
+    }
+    memmove(dir, path, slash - path);
+    dir[slash - path] = '\0';
+}
+
+void path_basename(const char* path, char* name) {
+    const char* slash = strrchr(path, '/');
+    const char* base = slash != NULL ? slash + 1 : path;
+    memmove(name, base, strlen(base) + 1);
+}
+
+// the volumes are every file whose name starts with that of the .tar
+// file, in name order, like "cat data.ext4.tar*".
+static int find_volumes(const char* backup_file_image, char*** volumes) {
+    char dir[PATH_MAX];
+    char base[PATH_MAX];
+    char tmp[PATH_MAX];
+    int count = 0;
+    int capacity = 0;
+    path_dirname(backup_file_image, dir);
+    path_basename(backup_file_image, base);
+    size_t len = strlen(base);
+
+    *volumes = NULL;
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return 0;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, base, len) != 0)
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            *volumes = realloc(*volumes, capacity * sizeof(char*));
+        }
+        if (snprintf(tmp, sizeof(tmp), "%s/%s", dir, de->d_name) >= (int)sizeof(tmp)) {
+            // a volume left out would restore as a truncated archive
+            ui_print("Path too long: %s/%s\n", dir, de->d_name);
+            break;
+        }
+        (*volumes)[count++] = strdup(tmp);
+    }
+    closedir(d);
+    if (de != NULL) {
+        while (count > 0)
+            free((*volumes)[--count]);
+        free(*volumes);
+        *volumes = NULL;
+        return 0;
+    }
+    qsort(*volumes, count, sizeof(char*), compare_names);
+    return count;
+}
+
+struct TAR_READER {
+    struct BUFFER_QUEUE* queue;
+    struct TAR_BUFFER* buffer;
+    size_t position;
+};
+
+// the unread bytes at the read position, at most max of them. returns 0
+// at the end of the archive.
+static size_t tar_peek(struct TAR_READER* r, const unsigned char** data, size_t max) {
+    while (r->buffer == NULL || r->position == r->buffer->length) {
+        if (r->buffer != NULL)
+            queue_put_empty(r->queue, r->buffer);
+        r->position = 0;
+        if ((r->buffer = queue_get_full(r->queue)) == NULL)
+            return 0;
+    }
+    size_t n = r->buffer->length - r->position;
+    if (n > max)
+        n = max;
+    *data = r->buffer->data + r->position;
+    return n;
+}
+
+static int tar_read(struct TAR_READER* r, void* dst, unsigned long long len) {
+    unsigned char* out = (unsigned char*)dst;
+    while (len > 0) {
+        const unsigned char* data;
+        size_t n = tar_peek(r, &data, len > TAR_BUFFER_SIZE ? TAR_BUFFER_SIZE : len);
+        if (n == 0)
+            return 1;
+        if (out != NULL) {
+            memcpy(out, data, n);
+            out += n;
+        }
+        r->position += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int tar_skip(struct TAR_READER* r, unsigned long long len) {
+    return tar_read(r, NULL, len);
+}
+
+static unsigned long long tar_parse_number(const char* field, size_t width) {
+    unsigned long long value = 0;
+    size_t i = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (i = 1; i < width; i++)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    while (i < width && field[i] == ' ')
+        i++;
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+static int tar_header_valid(const struct TAR_HEADER* h) {
+    const unsigned char* p = (const unsigned char*)h;
+    unsigned int sum = 0;
+    int signed_sum = 0;
+    size_t i;
+    for (i = 0; i < sizeof(*h); i++) {
+        unsigned char c = (i >= 148 && i < 156) ? ' ' : p[i];
+        sum += c;
+        signed_sum += (signed char)c;
+    }
+    unsigned long long expected = tar_parse_number(h->chksum, sizeof(h->chksum));
+    return expected == sum || expected == (unsigned long long)signed_sum;
+}
+
+static int tar_header_empty(const struct TAR_HEADER* h) {
+    const unsigned char* p = (const unsigned char*)h;
+    size_t i;
+    for (i = 0; i < sizeof(*h); i++) {
+        if (p[i])
+            return 0;
+    }
+    return 1;
+}
+
+// the data of a long name entry, or the path from a pax header
+static int tar_read_long(struct TAR_READER* r, char* value, unsigned long long size) {
+    unsigned long long keep = size < PATH_MAX - 1 ? size : PATH_MAX - 1;
+    if (tar_read(r, value, keep) || tar_skip(r, size - keep))
+        return 1;
+    value[keep] = '\0';
+    return 0;
+}
+
+static void tar_parse_pax(const char* records, size_t len, char* name, char* link) {
+    const char* p = records;
+    while (p < records + len) {
+        char* end;
+        unsigned long record = strtoul(p, &end, 10);
+        if (record == 0 || end == p || p + record > records + len)
+            return;
+        const char* key = end + 1;
+        const char* eq = memchr(key, '=', p + record - key);
+        if (eq != NULL) {
+            size_t value_len = p + record - eq - 2;
+            if (value_len < PATH_MAX) {
+                if (eq - key == 4 && strncmp(key, "path", 4) == 0) {
+                    memcpy(name, eq + 1, value_len);
+                    name[value_len] = '\0';
+                }
+                else if (eq - key == 8 && strncmp(key, "linkpath", 8) == 0) {
+                    memcpy(link, eq + 1, value_len);
+                    link[value_len] = '\0';
+                }
+            }
+        }
+        p += record;
+    }
+}
+
+// refuse names that would land outside of the destination
+static int tar_name_safe(const char* name) {
+    const char* p = name;
+    while (*p) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            return 0;
+        p = strchr(p, '/');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return 1;
+}
+
+static void make_parents(char* path) {
+    char* p;
+    for (p = path + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
+    }
+}
+
+static void set_times(const char* path, long mtime) {
+    struct timeval times[2];
+    times[0].tv_sec = mtime;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = mtime;
+    times[1].tv_usec = 0;
+    utimes(path, times);
+}
+
+// an entry, or the next piece of a file's data, passed from the parser
+// to the write-behind thread at the start of a buffer, followed by the
+// data. pieces after the first only use more and last.
+struct TAR_OP {
+    char typeflag;
+    int more;
+    int last;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    long mtime;
+    dev_t dev;
+    char path[PATH_MAX];
+    // the target of a symlink, or the full path of a hardlink's target
+    char link[PATH_MAX];
+};
+
+// creates the extracted entries on its own thread, in archive order, so
+// the destination is busy while the parser waits on the backup.
+struct EXTRACT_WRITER {
+    struct BUFFER_QUEUE* queue;
+    // the file being written
+    int fd;
+    int failed;
+    char path[PATH_MAX];
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    long mtime;
+    int errors;
+    // directories get their times once everything in them is written
+    struct TAR_DIR_TIME* dirs;
+    int dir_count;
+    int dir_capacity;
+};
+
+struct TAR_DIR_TIME {
+    char* path;
+    long mtime;
+};
+
+static void defer_dir_time(struct EXTRACT_WRITER* w, const struct TAR_OP* op) {
+    if (w->dir_count == w->dir_capacity) {
+        int capacity = w->dir_capacity ? w->dir_capacity * 2 : 64;
+        struct TAR_DIR_TIME* dirs = realloc(w->dirs, capacity * sizeof(struct TAR_DIR_TIME));
+        if (dirs == NULL)
+            return;
+        w->dirs = dirs;
+        w->dir_capacity = capacity;
+    }
+    if ((w->dirs[w->dir_count].path = strdup(op->path)) == NULL)
+        return;
+    w->dirs[w->dir_count++].mtime = op->mtime;
+}
+
+static void extract_file(struct EXTRACT_WRITER* w, const struct TAR_OP* op, const unsigned char* data, size_t len) {
+    if (!op->more) {
+        strcpy(w->path, op->path);
+        w->mode = op->mode;
+        w->uid = op->uid;
+        w->gid = op->gid;
+        w->mtime = op->mtime;
+        w->failed = 0;
+        make_parents(w->path);
+        unlink(w->path);
+        w->fd = open(w->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (w->fd < 0) {
+            ui_print("Unable to create %s\n", w->path);
+            w->errors++;
+        }
+    }
+    if (w->fd < 0)
+        return;
+    if (!w->failed && len > 0)
+        w->failed = write_all(w->fd, data, len);
+    if (!op->last)
+        return;
+    if (close(w->fd))
+        w->failed = 1;
+    w->fd = -1;
+    if (w->failed) {
+        ui_print("Error writing %s\n", w->path);
+        w->errors++;
+    }
+    chown(w->path, w->uid, w->gid);
+    chmod(w->path, w->mode);
+    set_times(w->path, w->mtime);
+}
+
+static void extract_entry(struct EXTRACT_WRITER* w, struct TAR_OP* op) {
+    make_parents(op->path);
+    switch (op->typeflag) {
+        case '5':
+            if (mkdir(op->path, 0700) && errno != EEXIST) {
+                ui_print("Unable to create %s\n", op->path);
+                w->errors++;
+            }
+            chown(op->path, op->uid, op->gid);
+            chmod(op->path, op->mode);
+            defer_dir_time(w, op);
+            break;
+        case '2':
+            unlink(op->path);
+            if (symlink(op->link, op->path)) {
+                ui_print("Unable to create link %s\n", op->path);
+                w->errors++;
+            }
+            lchown(op->path, op->uid, op->gid);
+            break;
+        case '1':
+            unlink(op->path);
+            if (link(op->link, op->path)) {
+                ui_print("Unable to create link %s\n", op->path);
+                w->errors++;
+            }
+            break;
+        case '3':
+        case '4':
+        case '6': {
+            mode_t type = op->typeflag == '3' ? S_IFCHR : op->typeflag == '4' ? S_IFBLK : S_IFIFO;
+            unlink(op->path);
+            if (mknod(op->path, type | op->mode, op->dev)) {
+                ui_print("Unable to create %s\n", op->path);
+                w->errors++;
+            }
+            chown(op->path, op->uid, op->gid);
+            chmod(op->path, op->mode);
+            break;
+        }
+    }
+}
+
+static void* extract_writer_thread(void* cookie) {
+    struct EXTRACT_WRITER* w = (struct EXTRACT_WRITER*)cookie;
+    struct TAR_BUFFER* b;
+    while ((b = queue_get_full(w->queue)) != NULL) {
+        struct TAR_OP* op = (struct TAR_OP*)b->data;
+        if (op->more || op->typeflag == '0' || op->typeflag == '\0' || op->typeflag == '7')
+            extract_file(w, op, b->data + sizeof(struct TAR_OP), b->length);
+        else
+            extract_entry(w, op);
+        queue_put_empty(w->queue, b);
+    }
+    // the parser gave up in the middle of a file
+    if (w->fd >= 0)
+        close(w->fd);
+    while (w->dir_count > 0) {
+        struct TAR_DIR_TIME* d = &w->dirs[--w->dir_count];
+        set_times(d->path, d->mtime);
+        free(d->path);
+    }
+    free(w->dirs);
+    w->dirs = NULL;
+    return NULL;
+}
+
+static struct TAR_OP* tar_op(struct TAR_BUFFER* b) {
+    return (struct TAR_OP*)b->data;
+}
+
+// reads the archive and queues what to create for the write-behind
+// thread. returns 1 if the archive is corrupt, or was cut short inside
+// an entry.
+static int tar_parse(struct TAR_READER* r, struct BUFFER_QUEUE* out, const char* dir, tar_event_callback callback, int* errors) {
+    char long_name[PATH_MAX] = "";
+    char long_link[PATH_MAX] = "";
+    char name[PATH_MAX];
+    char link_name[PATH_MAX];
+    char target[PATH_MAX];
+    char path[PATH_MAX];
+
+    for (;;) {
+        struct TAR_HEADER h;
+        if (tar_read(r, &h, sizeof(h))) {
+            // what was read is kept, but without the end of archive
+            // marker a volume may be missing
+            ui_print("Unexpected end of archive.\n");
+            return 1;
+        }
+        if (tar_header_empty(&h)) {
+            if (tar_read(r, &h, sizeof(h)) || !tar_header_empty(&h))
+                ui_print("A lone zero block at the end of the archive.\n");
+            break;
+        }
+        if (!tar_header_valid(&h)) {
+            ui_print("Corrupt tar header.\n");
+            return 1;
+        }
+
+        unsigned long long size = tar_parse_number(h.size, sizeof(h.size));
+        unsigned long long padding = (TAR_RECORD_SIZE - size % TAR_RECORD_SIZE) % TAR_RECORD_SIZE;
+        if (h.typeflag == 'L' || h.typeflag == 'K') {
+            if (tar_read_long(r, h.typeflag == 'L' ? long_name : long_link, size) || tar_skip(r, padding))
+                return 1;
+            continue;
+        }
+        if (h.typeflag == 'x' || h.typeflag == 'g') {
+            char* records = malloc(size + 1);
+            if (records == NULL || tar_read(r, records, size) || tar_skip(r, padding)) {
+                free(records);
+                return 1;
+            }
+            if (h.typeflag == 'x')
+                tar_parse_pax(records, size, long_name, long_link);
+            free(records);
+            continue;
+        }
+
+        if (long_name[0]) {
+            strcpy(name, long_name);
+        }
+        else if (h.prefix[0]) {
+            snprintf(name, sizeof(name), "%.*s/%.*s", (int)sizeof(h.prefix), h.prefix, (int)sizeof(h.name), h.name);
+        }
+        else {
+            snprintf(name, sizeof(name), "%.*s", (int)sizeof(h.name), h.name);
+        }
+        if (long_link[0])
+            strcpy(link_name, long_link);
+        else
+            snprintf(link_name, sizeof(link_name), "%.*s", (int)sizeof(h.linkname), h.linkname);
+        long_name[0] = '\0';
+        long_link[0] = '\0';
+
+        const char* rel = name;
+        while (*rel == '/')
+            rel++;
+        if (!tar_name_safe(rel) || *rel == '\0') {
+            ui_print("Skipping unsafe name %s\n", name);
+            if (tar_skip(r, size + padding))
+                return 1;
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, rel);
+        size_t len = strlen(path);
+        while (len > 1 && path[len - 1] == '/')
+            path[--len] = '\0';
+        int regular = h.typeflag == '0' || h.typeflag == '\0' || h.typeflag == '7';
+        if (callback)
+            callback(name, regular ? size : 0);
+
+        if (!regular && strchr("51236", h.typeflag) == NULL) {
+            ui_print("Skipping %s of unknown type %c\n", name, h.typeflag);
+            if (tar_skip(r, size + padding))
+                return 1;
+            continue;
+        }
+        if (h.typeflag == '1') {
+            const char* target_rel = link_name;
+            while (*target_rel == '/')
+                target_rel++;
+            if (!tar_name_safe(target_rel)) {
+                ui_print("Unable to create link %s\n", path);
+                (*errors)++;
+                if (tar_skip(r, size + padding))
+                    return 1;
+                continue;
+            }
+            snprintf(target, sizeof(target), "%s/%s", dir, target_rel);
+            strcpy(link_name, target);
+        }
+
+        struct TAR_BUFFER* b = queue_get_empty(out);
+        if (b == NULL)
+            return 1;
+        struct TAR_OP* op = tar_op(b);
+        op->typeflag = h.typeflag;
+        op->more = 0;
+        op->last = 1;
+        op->mode = tar_parse_number(h.mode, sizeof(h.mode)) & 07777;
+        op->uid = tar_parse_number(h.uid, sizeof(h.uid));
+        op->gid = tar_parse_number(h.gid, sizeof(h.gid));
+        op->mtime = tar_parse_number(h.mtime, sizeof(h.mtime));
+        op->dev = makedev(tar_parse_number(h.devmajor, sizeof(h.devmajor)), tar_parse_number(h.devminor, sizeof(h.devminor)));
+        strcpy(op->path, path);
+        strcpy(op->link, link_name);
+        if (!regular) {
+            queue_put_full(out, b);
+            if (tar_skip(r, size + padding))
+                return 1;
+            continue;
+        }
+
+        // the file's data, in buffer sized pieces
+        unsigned long long left = size;
+        for (;;) {
+            size_t n = left > TAR_BUFFER_SIZE ? TAR_BUFFER_SIZE : left;
+            if (tar_read(r, b->data + sizeof(struct TAR_OP), n)) {
+                queue_put_empty(out, b);
+                return 1;
+            }
+            left -= n;
+            b->length = n;
+            tar_op(b)->last = left == 0;
+            queue_put_full(out, b);
+            if (left == 0)
+                break;
+            if ((b = queue_get_empty(out)) == NULL)
+                return 1;
+            tar_op(b)->more = 1;
+        }
+        if (tar_skip(r, padding))
+            return 1;
+    }
+    return 0;
+}
+
+static int tar_extract(struct TAR_READER* r, const char* dir, tar_event_callback callback) {
+    struct BUFFER_QUEUE out;
+    struct EXTRACT_WRITER w;
+    pthread_t thread;
+    int errors = 0;
+
+    queue_init(&out, sizeof(struct TAR_OP) + TAR_BUFFER_SIZE);
+    memset(&w, 0, sizeof(w));
+    w.queue = &out;
+    w.fd = -1;
+    if (pthread_create(&thread, NULL, extract_writer_thread, &w)) {
+        ui_print("Unable to start the restore writer.\n");
+        queue_destroy(&out);
+        return 1;
+    }
+    int ret = tar_parse(r, &out, dir, callback, &errors);
+    if (ret)
+        queue_fail(&out);
+    else
+        queue_close(&out);
+    pthread_join(thread, NULL);
+    queue_destroy(&out);
+    return ret || errors > 0 || w.errors > 0;
+}
+
+int nandroid_tar_restore(const char* backup_file_image, const char* backup_path, tar_event_callback callback) {
+    char dir[PATH_MAX];
+    struct BUFFER_QUEUE queue;
+    struct BUFFER_QUEUE packed;
+    struct VOLUME_READER reader;
+    struct GZIP_DECOMPRESSOR decompressor;
+    struct TAR_READER r;
+    pthread_t thread;
+    pthread_t decompressor_thread;
+    size_t len = strlen(backup_file_image);
+    int compressed = len > 3 && strcmp(backup_file_image + len - 3, ".gz") == 0;
+    int i;
+
+    path_dirname(backup_path, dir);
+
+    memset(&reader, 0, sizeof(reader));
+    reader.count = find_volumes(backup_file_image, &reader.volumes);
+    if (reader.count == 0) {
+        ui_print("Unable to find %s\n", backup_file_image);
+        return 1;
+    }
+
+    queue_init(&queue, TAR_BUFFER_SIZE);
+    memset(&decompressor, 0, sizeof(decompressor));
+    if (compressed) {
+        queue_init(&packed, TAR_BUFFER_SIZE);
+        decompressor.in = &packed;
+        decompressor.out = &queue;
+    }
+    reader.queue = compressed ? &packed : &queue;
+    if (pthread_create(&thread, NULL, volume_reader_thread, &reader)) {
+        ui_print("Unable to start the backup reader.\n");
+        queue_destroy(&queue);
+        if (compressed)
+            queue_destroy(&packed);
+        return 1;
+    }
+    if (compressed && pthread_create(&decompressor_thread, NULL, gzip_decompressor_thread, &decompressor)) {
+        ui_print("Unable to start the backup decompressor.\n");
+        queue_fail(&packed);
+        pthread_join(thread, NULL);
+        queue_destroy(&queue);
+        queue_destroy(&packed);
+        return 1;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.queue = &queue;
+    int ret = tar_extract(&r, strcmp(dir, "/") == 0 ? "" : dir, callback);
+    if (ret) {
+        // let the reader go
+        queue_fail(&queue);
+    }
+    else {
+        // the padding after the end of archive marker
+        const unsigned char* data;
+        size_t n;
+        while ((n = tar_peek(&r, &data, TAR_BUFFER_SIZE)) > 0)
+            r.position += n;
+    }
+    if (compressed)
+        pthread_join(decompressor_thread, NULL);
+    pthread_join(thread, NULL);
+    queue_destroy(&queue);
+    if (compressed)
+        queue_destroy(&packed);
+
+    for (i = 0; i < reader.count; i++)
+        free(reader.volumes[i]);
+    free(reader.volumes);
+    return ret || reader.ret || decompressor.ret;
+}
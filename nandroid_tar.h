@@ -0,0 +1,46 @@
+#ifndef NANDROID_TAR_H
+#define NANDROID_TAR_H
+
+#include <sys/stat.h>
+
+// called with the archive name of every entry written or extracted, and
+// the size of its data
+typedef void (*tar_event_callback)(const char* name, unsigned long long size);
+
+// called with every entry found while archiving, directories included
+// (named with a trailing '/'). entries it returns 0 for are left out of
+// the archive. directories are archived and walked regardless.
+typedef int (*tar_filter_callback)(const char* name, const struct stat* st, void* cookie);
+
+struct NANDROID_TAR_OPTIONS {
+    // entries to skip along with their contents ("data/media")
+    const char** excludes;
+    int exclude_count;
+    // gzip the archive on all cores, into .tar.gz volumes
+    int compress;
+    tar_event_callback callback;
+    tar_filter_callback filter;
+    void* cookie;
+    // list each finished volume in backup_file_image.journal, and keep
+    // the volumes a journal left by an interrupted run lists, as long
+    // as the partition still matches them. not for compressed backups.
+    int journal;
+};
+
+// archive backup_path (a directory, stored relative to its parent, like
+// "tar c data" run from "/") into backup_file_image.tar.a, .b, ...
+// volumes of at most 1GB each, or backup_file_image.tar.gz.a, .b, ...
+int nandroid_tar_backup(const char* backup_path, const char* backup_file_image, const struct NANDROID_TAR_OPTIONS* options);
+
+// extract the volumes of backup_file_image (the .tar file, followed by
+// every file named like it plus a suffix, in name order) into the parent
+// of backup_path. a .tar.gz backup_file_image is decompressed.
+int nandroid_tar_restore(const char* backup_file_image, const char* backup_path, tar_event_callback callback);
+
+// dirname() and basename() into a buffer of the caller's, which may be
+// path itself. bionic's keep their result in a static buffer, and
+// partitions are backed up on several threads at once.
+void path_dirname(const char* path, char* dir);
+void path_basename(const char* path, char* name);
+
+#endif
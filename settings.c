@@ -229,6 +229,12 @@ void show_settings_menu() {
     list[1] = "Theme";
     if (backupfmt == 0) {
 		list[2] = "Choose Backup Format (currently dup)";
+	} else if (backupfmt == 2) {
+		list[2] = "Choose Backup Format (currently tar.gz)";
+	} else if (backupfmt == 3) {
+		list[2] = "Choose Backup Format (currently incremental tar)";
+	} else if (backupfmt == 4) {
+		list[2] = "Choose Backup Format (currently ext4 image)";
 	} else {
 		list[2] = "Choose Backup Format (currently tar)";
 	}
@@ -292,7 +298,7 @@ void show_settings_menu() {
             }
             case SETTINGS_CHOOSE_BACKUP_FMT:
             {
-				static char* cb_fmts[] = {"dup", "tar", NULL};
+				static char* cb_fmts[] = {"dup", "tar", "tar.gz", "incremental tar", "ext4 image", NULL};
 				static char* cb_header[] = {"Choose Backup Format", "", NULL};
 				
 				int cb_fmt = get_menu_selection(cb_header, cb_fmts, 0, 0);
@@ -312,6 +318,24 @@ void show_settings_menu() {
 							nandroid_switch_backup_handler(1);
 							list[2] = "Choose Backup Format (currently tar)";
 							break;
+						case 2:
+							backupfmt = 2;
+							ui_print("Backup format set to tar.gz.\n");
+							nandroid_switch_backup_handler(2);
+							list[2] = "Choose Backup Format (currently tar.gz)";
+							break;
+						case 3:
+							backupfmt = 3;
+							ui_print("Backup format set to incremental tar.\n");
+							nandroid_switch_backup_handler(3);
+							list[2] = "Choose Backup Format (currently incremental tar)";
+							break;
+						case 4:
+							backupfmt = 4;
+							ui_print("Backup format set to ext4 image.\n");
+							nandroid_switch_backup_handler(4);
+							list[2] = "Choose Backup Format (currently ext4 image)";
+							break;
 					}
 					break;
 				}
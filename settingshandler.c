@@ -252,6 +252,12 @@ void parse_settings() {
     backupfmt = config.backupfmt;
     if (backupfmt == 0) {
 		nandroid_switch_backup_handler(0);
+	} else if (backupfmt == 2) {
+		nandroid_switch_backup_handler(2);
+	} else if (backupfmt == 3) {
+		nandroid_switch_backup_handler(3);
+	} else if (backupfmt == 4) {
+		nandroid_switch_backup_handler(4);
 	} else {
 		nandroid_switch_backup_handler(1);
 	}
@@ -0,0 +1,19 @@
+LOCAL_PATH := $(call my-dir)
+
+# host only: times the nandroid backup formats on synthetic trees
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := \
+    nandroid_bench.c \
+    ../../nandroid_incremental.c \
+    ../../nandroid_md5.c \
+    ../../nandroid_tar.c \
+    ../../dedupe/dedupe.c \
+    ../../dedupe/manifest.c \
+    ../../dedupe/workqueue.c \
+    ../../dedupe/blobindex.c
+LOCAL_MODULE := nandroid_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../.. $(LOCAL_PATH)/../../../../external/openssl/include external/zlib
+LOCAL_STATIC_LIBRARIES := libcrypto_static libz
+LOCAL_LDLIBS += -lpthread
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,707 @@
+/*
+ * nandroid_bench: time the nandroid backup formats on the host.
+ *
+ * Generates /system and /data shaped trees (many small files, a few
+ * large ones, symlinks, deep directories) from a fixed seed, then backs
+ * each one up and restores it with every format, in a child process per
+ * step so the numbers do not mix. For each step it reports wall and cpu
+ * time, bytes and read/write syscalls from /proc/<pid>/io, peak RSS and
+ * the size of the backup, and checks that the restored tree matches.
+ *
+ * usage: nandroid_bench [-s scale] [-w workdir] [-k] [-d] [format...]
+ *   formats: tar tar.gz dup yaffs2 inc (default: all)
+ *   -s  multiply the number of files, default 1 (about 200MB in total)
+ *   -w  where to put the trees, default a new directory under /tmp
+ *   -k  keep the work directory
+ *   -d  drop the page cache before every step (needs root)
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "dedupe/dedupe.h"
+#include "nandroid_incremental.h"
+#include "nandroid_tar.h"
+
+static int drop_caches = 0;
+
+// the handlers print their errors through the recovery ui
+void ui_print(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+/* Synthetic trees */
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned int rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned int)(rng_state >> 16);
+}
+
+static unsigned int rng_range(unsigned int min, unsigned int max)
+{
+    return min + rng() % (max - min + 1);
+}
+
+enum {
+    CONTENT_RANDOM,     // apks, jpegs: does not compress
+    CONTENT_TEXT,       // xml, scripts: compresses well
+    CONTENT_BINARY,     // libraries, dex: somewhere in between
+    CONTENT_DATABASE,   // sqlite pages: mostly zero padding
+};
+
+static const char* words[] = {
+    "android", "system", "package", "version", "name", "value", "true",
+    "false", "string", "int", "<map>", "</map>", "activity", "service",
+    "com.google", "permission", "=", "\"", "\n", "    ",
+};
+
+static void fill_content(unsigned char* buffer, size_t len, int content)
+{
+    size_t i = 0;
+    while (i < len) {
+        switch (content) {
+            case CONTENT_RANDOM:
+                buffer[i++] = rng();
+                break;
+            case CONTENT_TEXT: {
+                const char* w = words[rng() % (sizeof(words) / sizeof(words[0]))];
+                while (*w && i < len)
+                    buffer[i++] = *w++;
+                break;
+            }
+            case CONTENT_BINARY:
+                // runs of code-like bytes between repeated tables
+                buffer[i] = (rng() & 3) ? (unsigned char)rng() : buffer[i > 64 ? i - 64 : 0];
+                i++;
+                break;
+            case CONTENT_DATABASE:
+                buffer[i] = (i % 4096) < 512 ? (unsigned char)rng() : 0;
+                i++;
+                break;
+        }
+    }
+}
+
+struct TREE_STATS {
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long links;
+    unsigned long long bytes;
+};
+
+static void make_file(const char* path, size_t size, int content)
+{
+    static unsigned char buffer[1024 * 1024];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "unable to create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while (size > 0) {
+        size_t n = size > sizeof(buffer) ? sizeof(buffer) : size;
+        fill_content(buffer, n, content);
+        if (write(fd, buffer, n) != (ssize_t)n) {
+            fprintf(stderr, "unable to write %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+        size -= n;
+    }
+    close(fd);
+}
+
+static void make_dir(const char* path)
+{
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        fprintf(stderr, "unable to create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+// count files of [min, max] bytes into dir/prefix<n>suffix
+static void make_files(const char* dir, const char* prefix, const char* suffix, int count, size_t min, size_t max, int content)
+{
+    char path[PATH_MAX];
+    int i;
+    make_dir(dir);
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/%s%d%s", dir, prefix, i, suffix);
+        make_file(path, rng_range(min, max), content);
+    }
+}
+
+static void make_system(const char* root, int scale)
+{
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    int i, j;
+    make_dir(root);
+    snprintf(path, sizeof(path), "%s/app", root);
+    make_files(path, "App", ".apk", 40 * scale, 100 << 10, 3 << 20, CONTENT_RANDOM);
+    snprintf(path, sizeof(path), "%s/framework", root);
+    make_files(path, "framework", ".jar", 10 * scale, 100 << 10, 4 << 20, CONTENT_BINARY);
+    snprintf(path, sizeof(path), "%s/lib", root);
+    make_files(path, "lib", ".so", 150 * scale, 8 << 10, 600 << 10, CONTENT_BINARY);
+    snprintf(path, sizeof(path), "%s/etc", root);
+    make_files(path, "config", ".xml", 60 * scale, 200, 20 << 10, CONTENT_TEXT);
+    snprintf(path, sizeof(path), "%s/media", root);
+    make_files(path, "bootanimation", ".zip", 2, 4 << 20, 12 << 20, CONTENT_RANDOM);
+
+    // toolbox and its links
+    snprintf(path, sizeof(path), "%s/bin", root);
+    make_files(path, "tool", "", 40 * scale, 4 << 10, 120 << 10, CONTENT_BINARY);
+    for (i = 0; i < 80 * scale; i++) {
+        snprintf(path, sizeof(path), "%s/bin/cmd%d", root, i);
+        snprintf(target, sizeof(target), "tool%d", i % (40 * scale));
+        symlink(target, path);
+    }
+
+    // zoneinfo and friends: deep and tiny
+    snprintf(path, sizeof(path), "%s/usr", root);
+    make_dir(path);
+    snprintf(path, sizeof(path), "%s/usr/share", root);
+    make_dir(path);
+    for (i = 0; i < 20 * scale; i++) {
+        snprintf(path, sizeof(path), "%s/usr/share/zone%d", root, i);
+        make_dir(path);
+        for (j = 0; j < 4; j++) {
+            size_t len = strlen(path);
+            snprintf(path + len, sizeof(path) - len, "/d%d", j);
+            make_files(path, "z", "", 6, 50, 3 << 10, CONTENT_TEXT);
+        }
+    }
+}
+
+static void make_data(const char* root, int scale)
+{
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    int i;
+    make_dir(root);
+    snprintf(path, sizeof(path), "%s/app", root);
+    make_files(path, "com.example.app", ".apk", 15 * scale, 500 << 10, 6 << 20, CONTENT_RANDOM);
+    snprintf(path, sizeof(path), "%s/dalvik-cache", root);
+    make_files(path, "data@app@classes", ".dex", 60 * scale, 30 << 10, 1 << 20, CONTENT_BINARY);
+
+    snprintf(path, sizeof(path), "%s/data", root);
+    make_dir(path);
+    for (i = 0; i < 100 * scale; i++) {
+        char pkg[PATH_MAX];
+        snprintf(pkg, sizeof(pkg), "%s/data/com.example.pkg%d", root, i);
+        make_dir(pkg);
+        snprintf(path, sizeof(path), "%s/databases", pkg);
+        make_files(path, "db", ".db", rng_range(0, 3), 8 << 10, 400 << 10, CONTENT_DATABASE);
+        snprintf(path, sizeof(path), "%s/shared_prefs", pkg);
+        make_files(path, "prefs", ".xml", rng_range(1, 4), 100, 4 << 10, CONTENT_TEXT);
+        snprintf(path, sizeof(path), "%s/cache", pkg);
+        make_files(path, "cache", "", rng_range(0, 10), 100, 64 << 10, CONTENT_RANDOM);
+        // the usual dangling link to the app's native libraries
+        snprintf(path, sizeof(path), "%s/lib", pkg);
+        snprintf(target, sizeof(target), "/data/app-lib/com.example.pkg%d-1", i);
+        symlink(target, path);
+        if (i % 10 == 0) {
+            int depth;
+            snprintf(path, sizeof(path), "%s/files", pkg);
+            make_dir(path);
+            for (depth = 0; depth < 8; depth++) {
+                size_t len = strlen(path);
+                snprintf(path + len, sizeof(path) - len, "/level%d", depth);
+                make_files(path, "f", ".dat", 3, 10, 8 << 10, CONTENT_BINARY);
+            }
+        }
+    }
+}
+
+// change about one file in fifty and add a few, for an incremental backup
+static void mutate_tree(const char* dir, int* counter)
+{
+    DIR* d = opendir(dir);
+    struct dirent* de;
+    if (d == NULL)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (lstat(path, &st))
+            continue;
+        if (S_ISDIR(st.st_mode))
+            mutate_tree(path, counter);
+        else if (S_ISREG(st.st_mode) && ++*counter % 50 == 0)
+            make_file(path, st.st_size, CONTENT_BINARY);
+    }
+    closedir(d);
+}
+
+static void tree_stats(const char* dir, struct TREE_STATS* stats)
+{
+    DIR* d = opendir(dir);
+    struct dirent* de;
+    if (d == NULL)
+        return;
+    stats->dirs++;
+    while ((de = readdir(d)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (lstat(path, &st))
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            tree_stats(path, stats);
+        }
+        else if (S_ISLNK(st.st_mode)) {
+            stats->links++;
+        }
+        else {
+            stats->files++;
+            stats->bytes += st.st_size;
+        }
+    }
+    closedir(d);
+}
+
+static unsigned long long path_size(const char* path)
+{
+    struct stat st;
+    if (lstat(path, &st))
+        return 0;
+    if (!S_ISDIR(st.st_mode))
+        return st.st_size;
+    struct TREE_STATS stats;
+    memset(&stats, 0, sizeof(stats));
+    tree_stats(path, &stats);
+    return stats.bytes;
+}
+
+static int run_command(const char* fmt, ...)
+{
+    char cmd[PATH_MAX * 2];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(cmd, sizeof(cmd), fmt, ap);
+    va_end(ap);
+    return system(cmd);
+}
+
+/* Formats */
+
+// what a step works on: the tree, and where its backup goes
+struct STEP {
+    const char* src;
+    const char* backup_dir;
+    const char* image;
+    const char* restore;
+};
+
+static int tar_options_backup(const struct STEP* s, int compress)
+{
+    struct NANDROID_TAR_OPTIONS options;
+    memset(&options, 0, sizeof(options));
+    options.compress = compress;
+    return nandroid_tar_backup(s->src, s->image, &options);
+}
+
+static int tar_backup(const struct STEP* s)
+{
+    return tar_options_backup(s, 0);
+}
+
+static int tar_gzip_backup(const struct STEP* s)
+{
+    return tar_options_backup(s, 1);
+}
+
+static int tar_restore(const struct STEP* s)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tar", s->image);
+    return nandroid_tar_restore(tmp, s->restore, NULL);
+}
+
+static int tar_gzip_restore(const struct STEP* s)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tar.gz", s->image);
+    return nandroid_tar_restore(tmp, s->restore, NULL);
+}
+
+// set up like dedupe_compress_wrapper and dedupe_extract_wrapper
+static int dedupe_backup(const struct STEP* s)
+{
+    char tmp[PATH_MAX];
+    char blob_dir[PATH_MAX];
+    struct DEDUPE_CONTEXT dedupe;
+    dedupe_init(&dedupe);
+    dedupe.compress = 1;
+    dedupe.chunking = 1;
+    snprintf(blob_dir, sizeof(blob_dir), "%s/blobs", s->backup_dir);
+    make_dir(blob_dir);
+    snprintf(tmp, sizeof(tmp), "%s.dup", s->image);
+    return dedupe_store(&dedupe, s->src, blob_dir, tmp);
+}
+
+static int dedupe_restore_step(const struct STEP* s)
+{
+    char tmp[PATH_MAX];
+    char blob_dir[PATH_MAX];
+    struct DEDUPE_CONTEXT dedupe;
+    dedupe_init(&dedupe);
+    snprintf(blob_dir, sizeof(blob_dir), "%s/blobs", s->backup_dir);
+    snprintf(tmp, sizeof(tmp), "%s.dup", s->image);
+    make_dir(s->restore);
+    return dedupe_restore(&dedupe, tmp, blob_dir, s->restore);
+}
+
+// the recovery runs these tools the same way
+static int yaffs2_backup(const struct STEP* s)
+{
+    return run_command("cd %s && mkyaffs2image . %s.img > /dev/null", s->src, s->image);
+}
+
+static int yaffs2_restore(const struct STEP* s)
+{
+    make_dir(s->restore);
+    return run_command("cd %s && unyaffs %s.img > /dev/null", s->restore, s->image);
+}
+
+static int inc_backup(const struct STEP* s)
+{
+    struct NANDROID_TAR_OPTIONS options;
+    memset(&options, 0, sizeof(options));
+    return nandroid_incremental_backup(s->src, s->image, NULL, &options);
+}
+
+// after changing the tree: back up against the first backup
+static int inc_delta_backup(const struct STEP* s)
+{
+    char base[PATH_MAX];
+    char image[PATH_MAX];
+    struct NANDROID_TAR_OPTIONS options;
+    memset(&options, 0, sizeof(options));
+    snprintf(base, sizeof(base), "%s.inc", s->image);
+    snprintf(image, sizeof(image), "%s/../2/%s", s->backup_dir, strrchr(s->image, '/') + 1);
+    return nandroid_incremental_backup(s->src, image, base, &options);
+}
+
+static int inc_delta_restore(const struct STEP* s)
+{
+    char image[PATH_MAX];
+    snprintf(image, sizeof(image), "%s/../2/%s.inc", s->backup_dir, strrchr(s->image, '/') + 1);
+    return nandroid_incremental_restore(image, s->restore, NULL);
+}
+
+typedef int (*bench_handler)(const struct STEP* s);
+
+struct FORMAT {
+    const char* name;
+    bench_handler backup;
+    bench_handler restore;
+    // a second backup after changing the tree, and its restore
+    bench_handler delta_backup;
+    bench_handler delta_restore;
+    // the tool the format needs on the path
+    const char* tool;
+};
+
+// inc goes last, it changes the trees
+static const struct FORMAT formats[] = {
+    { "tar", tar_backup, tar_restore, NULL, NULL, NULL },
+    { "tar.gz", tar_gzip_backup, tar_gzip_restore, NULL, NULL, NULL },
+    { "dup", dedupe_backup, dedupe_restore_step, NULL, NULL, NULL },
+    { "yaffs2", yaffs2_backup, yaffs2_restore, NULL, NULL, "mkyaffs2image" },
+    { "inc", inc_backup, NULL, inc_delta_backup, inc_delta_restore, NULL },
+};
+
+/* Measurement */
+
+struct RESULT {
+    double wall;
+    double cpu;
+    unsigned long long rchar;
+    unsigned long long wchar;
+    unsigned long long syscalls;
+    long max_rss_kb;
+    int ret;
+};
+
+struct PROC_IO {
+    unsigned long long rchar;
+    unsigned long long wchar;
+    unsigned long long syscr;
+    unsigned long long syscw;
+};
+
+// includes the threads, and children that were waited for
+static void read_proc_io(struct PROC_IO* io)
+{
+    char line[256];
+    memset(io, 0, sizeof(*io));
+    FILE* f = fopen("/proc/self/io", "r");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        sscanf(line, "rchar: %llu", &io->rchar);
+        sscanf(line, "wchar: %llu", &io->wchar);
+        sscanf(line, "syscr: %llu", &io->syscr);
+        sscanf(line, "syscw: %llu", &io->syscw);
+    }
+    fclose(f);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void drop_page_cache()
+{
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "3", 1) != 1)
+        fprintf(stderr, "unable to drop the page cache\n");
+    if (fd >= 0)
+        close(fd);
+}
+
+// run one step in a child, so peak RSS and the io counters are its own
+static void measure(bench_handler handler, const struct STEP* s, struct RESULT* result)
+{
+    int fds[2];
+    struct rusage usage;
+    int status;
+
+    memset(result, 0, sizeof(*result));
+    result->ret = -1;
+    if (drop_caches)
+        drop_page_cache();
+    if (pipe(fds)) {
+        perror("pipe");
+        return;
+    }
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (pid == 0) {
+        struct PROC_IO before, after;
+        close(fds[0]);
+        read_proc_io(&before);
+        int ret = handler(s);
+        read_proc_io(&after);
+        result->rchar = after.rchar - before.rchar;
+        result->wchar = after.wchar - before.wchar;
+        result->syscalls = after.syscr + after.syscw - before.syscr - before.syscw;
+        result->ret = ret;
+        write(fds[1], result, sizeof(*result));
+        _exit(0);
+    }
+    close(fds[1]);
+    if (read(fds[0], result, sizeof(*result)) != sizeof(*result))
+        result->ret = -1;
+    close(fds[0]);
+    wait4(pid, &status, 0, &usage);
+    result->wall = now() - start;
+    result->cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    result->max_rss_kb = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        result->ret = -1;
+}
+
+static void print_result(const char* format, const char* tree, const char* op, const struct RESULT* r, unsigned long long size, const char* check)
+{
+    printf("%-7s %-7s %-9s %8.2f %8.2f %9.1f %9.1f %9llu %8.1f %9.1f  %s\n",
+            format, tree, op, r->wall, r->cpu, r->rchar / 1048576.0, r->wchar / 1048576.0,
+            r->syscalls, r->max_rss_kb / 1024.0, size / 1048576.0,
+            r->ret ? "FAILED" : check);
+    fflush(stdout);
+}
+
+static const char* compare_trees(const char* a, const char* b)
+{
+    struct TREE_STATS sa, sb;
+    memset(&sa, 0, sizeof(sa));
+    memset(&sb, 0, sizeof(sb));
+    tree_stats(a, &sa);
+    tree_stats(b, &sb);
+    if (sa.files != sb.files || sa.dirs != sb.dirs || sa.links != sb.links || sa.bytes != sb.bytes)
+        return "MISMATCH";
+    return "ok";
+}
+
+static int has_tool(const char* tool)
+{
+    return run_command("command -v %s > /dev/null 2>&1", tool) == 0;
+}
+
+static void bench_tree(const struct FORMAT* f, const char* work, const char* tree, int scale)
+{
+    char src[PATH_MAX];
+    char backup_dir[PATH_MAX];
+    char image[PATH_MAX];
+    char restore_dir[PATH_MAX];
+    char restore[PATH_MAX];
+    struct STEP s;
+    struct RESULT r;
+
+    snprintf(src, sizeof(src), "%s/%s", work, tree);
+    snprintf(backup_dir, sizeof(backup_dir), "%s/backup/%s/%s/1", work, f->name, tree);
+    snprintf(image, sizeof(image), "%s/%s.ext4", backup_dir, tree);
+    snprintf(restore_dir, sizeof(restore_dir), "%s/restore", work);
+    snprintf(restore, sizeof(restore), "%s/%s", restore_dir, tree);
+    run_command("mkdir -p %s %s/../2 %s", backup_dir, backup_dir, restore_dir);
+    s.src = src;
+    s.backup_dir = backup_dir;
+    s.image = image;
+    s.restore = restore;
+
+    measure(f->backup, &s, &r);
+    print_result(f->name, tree, "backup", &r, path_size(backup_dir), "");
+    if (f->restore != NULL) {
+        measure(f->restore, &s, &r);
+        print_result(f->name, tree, "restore", &r, path_size(restore), compare_trees(src, restore));
+        run_command("rm -rf %s", restore);
+    }
+    if (f->delta_backup != NULL) {
+        char delta_dir[PATH_MAX];
+        int counter = 0;
+        snprintf(delta_dir, sizeof(delta_dir), "%s/../2", backup_dir);
+        mutate_tree(src, &counter);
+        snprintf(image, sizeof(image), "%s/%s/new", work, tree);
+        make_files(image, "file", "", 10 * scale, 1 << 10, 64 << 10, CONTENT_TEXT);
+        snprintf(image, sizeof(image), "%s/%s.ext4", backup_dir, tree);
+        measure(f->delta_backup, &s, &r);
+        print_result(f->name, tree, "backup+", &r, path_size(delta_dir), "");
+        measure(f->delta_restore, &s, &r);
+        print_result(f->name, tree, "restore+", &r, path_size(restore), compare_trees(src, restore));
+        run_command("rm -rf %s", restore);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: nandroid_bench [-s scale] [-w workdir] [-k] [-d] [tar|tar.gz|dup|yaffs2|inc...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    char work[PATH_MAX] = "";
+    char path[PATH_MAX];
+    int scale = 1;
+    int keep = 0;
+    int i, j, c;
+
+    while ((c = getopt(argc, argv, "s:w:kd")) != -1) {
+        switch (c) {
+            case 's':
+                scale = atoi(optarg);
+                if (scale < 1)
+                    usage();
+                break;
+            case 'w':
+                snprintf(work, sizeof(work), "%s", optarg);
+                break;
+            case 'k':
+                keep = 1;
+                break;
+            case 'd':
+                drop_caches = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    for (i = optind; i < argc; i++) {
+        for (j = 0; j < (int)(sizeof(formats) / sizeof(formats[0])); j++) {
+            if (strcmp(argv[i], formats[j].name) == 0)
+                break;
+        }
+        if (j == (int)(sizeof(formats) / sizeof(formats[0])))
+            usage();
+    }
+
+    if (work[0] == '\0') {
+        strcpy(work, "/tmp/nandroid_bench.XXXXXX");
+        if (mkdtemp(work) == NULL) {
+            perror("mkdtemp");
+            return 1;
+        }
+    }
+    else {
+        make_dir(work);
+    }
+    // mkyaffs2image and unyaffs run from inside the trees
+    if (realpath(work, path) == NULL) {
+        perror(work);
+        return 1;
+    }
+    strcpy(work, path);
+
+    const char* trees[] = { "system", "data" };
+    printf("generating trees in %s...\n", work);
+    for (i = 0; i < 2; i++) {
+        struct TREE_STATS stats;
+        snprintf(path, sizeof(path), "%s/%s", work, trees[i]);
+        if (i == 0)
+            make_system(path, scale);
+        else
+            make_data(path, scale);
+        memset(&stats, 0, sizeof(stats));
+        tree_stats(path, &stats);
+        printf("%-7s %lu files, %lu dirs, %lu links, %.1f MB\n", trees[i],
+                stats.files, stats.dirs, stats.links, stats.bytes / 1048576.0);
+    }
+
+    printf("\n%-7s %-7s %-9s %8s %8s %9s %9s %9s %8s %9s  %s\n", "format", "tree", "step",
+            "wall s", "cpu s", "read MB", "write MB", "syscalls", "rss MB", "size MB", "check");
+    for (j = 0; j < (int)(sizeof(formats) / sizeof(formats[0])); j++) {
+        const struct FORMAT* f = &formats[j];
+        int selected = optind == argc;
+        for (i = optind; i < argc; i++)
+            selected |= strcmp(argv[i], f->name) == 0;
+        if (!selected)
+            continue;
+        if (f->tool != NULL && !has_tool(f->tool)) {
+            printf("%-7s skipped, %s is not on the path\n", f->name, f->tool);
+            continue;
+        }
+        for (i = 0; i < 2; i++)
+            bench_tree(f, work, trees[i], scale);
+    }
+
+    if (!keep)
+        run_command("rm -rf %s", work);
+    return 0;
+}